@@ -36,6 +36,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
 //start #including the functions directly once you start pulling them out of cmatrix
 //#include "transforms/Chebyshev.h"
 
@@ -55,14 +56,11 @@ ChebyshevFourierCoefficients::ChebyshevFourierCoefficients() : FeatureAlgorithm
 //	cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> ChebyshevFourierCoefficients::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;	
+void ChebyshevFourierCoefficients::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
-	IN_matrix.ChebyshevFourierTransform2D(coeffs.data());
-
-	return coeffs;
+	IN_matrix.ChebyshevFourierTransform2D(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -79,14 +77,11 @@ ChebyshevCoefficients::ChebyshevCoefficients() : FeatureAlgorithm ("Chebyshev Co
  * and generating a histogram of pixel intensities.
  *
  */
-std::vector<double> ChebyshevCoefficients::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void ChebyshevCoefficients::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
-	IN_matrix.ChebyshevStatistics2D(coeffs.data(), 0, 32);
-
-	return coeffs;
+	std::fill_n (coeffs, n_features, 0.0);
+	IN_matrix.ChebyshevStatistics2D(coeffs, 0, 32);
 }
 
 // Register a static instance of the class using a global bool
@@ -99,17 +94,14 @@ ZernikeCoefficients::ZernikeCoefficients() : FeatureAlgorithm ("Zernike Coeffici
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> ZernikeCoefficients::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void ZernikeCoefficients::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
 	long output_size;   // output size is normally 72
 
-	IN_matrix.zernike2D(coeffs.data(), &output_size);
-
-	return coeffs;
+	IN_matrix.zernike2D(coeffs, &output_size);
 }
 
 // Register a static instance of the class using a global bool
@@ -122,15 +114,12 @@ HaralickTextures::HaralickTextures() : FeatureAlgorithm ("Haralick Textures", 28
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> HaralickTextures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void HaralickTextures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
-	IN_matrix.HaralickTexture2D(0,coeffs.data());
-
-	return coeffs;
+	IN_matrix.HaralickTexture2D(0,coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -143,15 +132,12 @@ MultiscaleHistograms::MultiscaleHistograms() : FeatureAlgorithm ("Multiscale His
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> MultiscaleHistograms::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void MultiscaleHistograms::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
-
-	IN_matrix.MultiScaleHistogram(coeffs.data());
+	std::fill_n (coeffs, n_features, 0.0);
 
-	return coeffs;
+	IN_matrix.MultiScaleHistogram(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -164,15 +150,12 @@ TamuraTextures::TamuraTextures() : FeatureAlgorithm ("Tamura Textures", 6) {
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> TamuraTextures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void TamuraTextures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
-
-	IN_matrix.TamuraTexture2D(coeffs.data());
+	std::fill_n (coeffs, n_features, 0.0);
 
-	return coeffs;
+	IN_matrix.TamuraTexture2D(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -185,15 +168,12 @@ CombFirstFourMoments::CombFirstFourMoments() : FeatureAlgorithm ("Comb Moments",
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> CombFirstFourMoments::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void CombFirstFourMoments::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
-	IN_matrix.CombFirstFourMoments2D(coeffs.data());
-
-	return coeffs;
+	IN_matrix.CombFirstFourMoments2D(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -206,15 +186,12 @@ RadonCoefficients::RadonCoefficients() : FeatureAlgorithm ("Radon Coefficients",
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> RadonCoefficients::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void RadonCoefficients::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
-
-	IN_matrix.RadonTransform2D(coeffs.data());
+	std::fill_n (coeffs, n_features, 0.0);
 
-	return coeffs;
+	IN_matrix.RadonTransform2D(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -233,11 +210,10 @@ FractalFeatures::FractalFeatures() : FeatureAlgorithm ("Fractal Features", 20) {
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> FractalFeatures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void FractalFeatures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
 	int bins = n_features;
 	int width = IN_matrix.width;
@@ -259,8 +235,6 @@ std::vector<double> FractalFeatures::execute (const ImageMatrix &IN_matrix) cons
 		if( bin < bins )
 			coeffs[ bin++ ] = sum / ( width * ( width - k ) + height * ( height - k ) );    
 	}
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
@@ -273,11 +247,10 @@ PixelIntensityStatistics::PixelIntensityStatistics() : FeatureAlgorithm ("Pixel
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> PixelIntensityStatistics::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void PixelIntensityStatistics::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 	
 	Moments2 stats;
 	IN_matrix.GetStats (stats);
@@ -286,8 +259,6 @@ std::vector<double> PixelIntensityStatistics::execute (const ImageMatrix &IN_mat
 	coeffs[2] = stats.std();
 	coeffs[3] = stats.min();
 	coeffs[4] = stats.max();
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
@@ -298,17 +269,29 @@ static bool PixelIntensityStatisticsReg = ComputationTaskInstances::add (new Pix
 
 EdgeFeatures::EdgeFeatures() : FeatureAlgorithm ("Edge Features", 28) {
 	//cout << "Instantiating new " << name << " object." << endl;
+	derived_inputs.push_back ("Prewitt Magnitude");
+	derived_inputs.push_back ("Prewitt Direction");
+}
+
+void EdgeFeatures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
+	ImageMatrix GradientMagnitude, GradientDirection;
+	GradientMagnitude.PrewittMagnitude2D (IN_matrix);
+	GradientDirection.PrewittDirection2D (IN_matrix);
+
+	std::vector<const ImageMatrix *> inputs;
+	inputs.push_back (&GradientMagnitude);
+	inputs.push_back (&GradientDirection);
+	execute (inputs, coeffs);
 }
 
-std::vector<double> EdgeFeatures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void EdgeFeatures::execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
 	unsigned long EdgeArea = 0;
 	double MagMean=0, MagMedian=0, MagVar=0, MagHist[8]={0,0,0,0,0,0,0,0}, DirecMean=0, DirecMedian=0, DirecVar=0, DirecHist[8]={0,0,0,0,0,0,0,0}, DirecHomogeneity=0, DiffDirecHist[4]={0,0,0,0};
-	IN_matrix.EdgeStatistics(&EdgeArea, &MagMean, &MagMedian, &MagVar, MagHist, &DirecMean, &DirecMedian, &DirecVar, DirecHist, &DirecHomogeneity, DiffDirecHist, 8);
+	ImageMatrix::GradientStatistics(*inputs[0], *inputs[1], &EdgeArea, &MagMean, &MagMedian, &MagVar, MagHist, &DirecMean, &DirecMedian, &DirecVar, DirecHist, &DirecHomogeneity, DiffDirecHist, 8);
 
 
 	int j, here = 0;
@@ -333,8 +316,6 @@ std::vector<double> EdgeFeatures::execute (const ImageMatrix &IN_matrix) const {
 	coeffs[here++] = MagMean;
 	coeffs[here++] = MagMedian;
 	coeffs[here++] = MagVar;
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
@@ -345,13 +326,26 @@ static bool EdgeFeaturesReg = ComputationTaskInstances::add (new EdgeFeatures);
 
 ObjectFeatures::ObjectFeatures() : FeatureAlgorithm ("Otsu Object Features", 34) {
 	//cout << "Instantiating new " << name << " object." << endl;
+	derived_inputs.push_back ("Otsu Mask");
+}
+
+void ObjectFeatures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
+	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
+	ImageMatrix BWImage;
+	BWImage.OtsuBinaryMaskTransform (IN_matrix);
+	mask_features (BWImage, coeffs);
 }
 
-std::vector<double> ObjectFeatures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+// The input is a binary mask, which is copied because the objects get labeled in place
+void ObjectFeatures::execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
+	ImageMatrix BWImage;
+	BWImage.copy (*inputs[0]);
+	mask_features (BWImage, coeffs);
+}
 
-	coeffs.resize (n_features, 0);
+void ObjectFeatures::mask_features (ImageMatrix &BWImage, double *coeffs) const {
+	std::fill_n (coeffs, n_features, 0.0);
 
 	unsigned long feature_count=0, AreaMin=0, AreaMax=0;
 	long Euler=0;
@@ -362,7 +356,7 @@ std::vector<double> ObjectFeatures::execute (const ImageMatrix &IN_matrix) const
 	double centroid_x=0, centroid_y=0, AreaMean=0, AreaVar=0, DistMin=0,
 				 DistMax=0, DistMean=0, DistMedian=0, DistVar=0;
 
-	IN_matrix.FeatureStatistics(&feature_count, &Euler, &centroid_x, &centroid_y,
+	BWImage.BinaryMaskStatistics(&feature_count, &Euler, &centroid_x, &centroid_y,
 			&AreaMin, &AreaMax, &AreaMean, &AreaMedian,
 			&AreaVar, area_histogram, &DistMin, &DistMax,
 			&DistMean, &DistMedian, &DistVar, dist_histogram, 10);
@@ -392,8 +386,6 @@ std::vector<double> ObjectFeatures::execute (const ImageMatrix &IN_matrix) const
 	coeffs[here++] = DistMin;
 	coeffs[here++] = DistVar;
 	coeffs[here++] = Euler;
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
@@ -403,14 +395,20 @@ static bool ObjectFeaturesReg = ComputationTaskInstances::add (new ObjectFeature
 //===========================================================================
 InverseObjectFeatures::InverseObjectFeatures() : FeatureAlgorithm ("Inverse-Otsu Object Features", 34) {
 	//cout << "Instantiating new " << name << " object." << endl;
+	derived_inputs.push_back ("Inverse Otsu Mask");
 }
 
-std::vector<double> InverseObjectFeatures::execute (const ImageMatrix &IN_matrix) const {
+void InverseObjectFeatures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	ImageMatrix InvMatrix;
-	InvMatrix.copy (IN_matrix);
-	InvMatrix.invert();
+	InvMatrix.invert (IN_matrix);
+	static ObjectFeatures ObjFeaturesInst;
+	ObjFeaturesInst.execute (InvMatrix, coeffs);
+}
+
+// The input is the mask made by the "Inverse Otsu Mask" transform, which is all that's left to do for ObjectFeatures.
+void InverseObjectFeatures::execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const {
 	static ObjectFeatures ObjFeaturesInst;
-	return (ObjFeaturesInst.execute (InvMatrix));
+	ObjFeaturesInst.execute (inputs, coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -423,14 +421,12 @@ GaborTextures::GaborTextures() : FeatureAlgorithm ("Gabor Textures", 7) {
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> GaborTextures::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void GaborTextures::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize (n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
-	IN_matrix.GaborFilters2D(coeffs.data());
-	return coeffs;
+	IN_matrix.GaborFilters2D(coeffs);
 }
 
 // Register a static instance of the class using a global bool
@@ -449,13 +445,12 @@ GiniCoefficient::GiniCoefficient() : FeatureAlgorithm ("Gini Coefficient", 1) {
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> GiniCoefficient::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void GiniCoefficient::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.resize(n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 
-	long pixel_index, num_pixels;
+	long num_pixels;
 	double *pixels, mean = 0.0, g = 0.0;
 	long i, count = 0;
 	double val;
@@ -464,12 +459,14 @@ std::vector<double> GiniCoefficient::execute (const ImageMatrix &IN_matrix) cons
 	pixels = new double[ num_pixels ];
 
 	readOnlyPixels IN_matrix_pix_plane = IN_matrix.ReadablePixels();
-	for( pixel_index = 0; pixel_index < num_pixels; pixel_index++ ) {
-		val = IN_matrix_pix_plane.array().coeff(pixel_index);
-		if( val > 0 ) {
-			pixels[ count ] = val;
-			mean += val;
-			count++;
+	for( unsigned int y = 0; y < IN_matrix.height; y++ ) {
+		for( unsigned int x = 0; x < IN_matrix.width; x++ ) {
+			val = IN_matrix_pix_plane(y,x);
+			if( val > 0 ) {
+				pixels[ count ] = val;
+				mean += val;
+				count++;
+			}
 		}
 	}
 	if( count > 0 )
@@ -484,8 +481,6 @@ std::vector<double> GiniCoefficient::execute (const ImageMatrix &IN_matrix) cons
 		coeffs[0] = 0.0;   // avoid division by zero
 	else
 		coeffs[0] = g / ( mean * count * ( count-1 ) );
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
@@ -503,31 +498,26 @@ ColorHistogram::ColorHistogram() : FeatureAlgorithm ("Color Histogram", COLORS_N
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> ColorHistogram::execute (const ImageMatrix &IN_matrix) const {
-	std::vector<double> coeffs;
+void ColorHistogram::execute (const ImageMatrix &IN_matrix, double *coeffs) const {
 	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
 
-	coeffs.assign(n_features, 0);
+	std::fill_n (coeffs, n_features, 0.0);
 	unsigned int x,y, width = IN_matrix.width, height = IN_matrix.height;
-	HSVcolor hsv_pixel;
 	unsigned long color_index=0;   
-	double certainties[COLORS_NUM+1];
 
 	readOnlyColors clr_plane = IN_matrix.ReadableColors();
 
 	// find the colors
 	for( y = 0; y < height; y++ ) {
+		const byte *h_row = &clr_plane.h.coeffRef (y, 0), *s_row = &clr_plane.s.coeffRef (y, 0), *v_row = &clr_plane.v.coeffRef (y, 0);
 		for( x = 0; x < width; x++ ) { 
-			hsv_pixel = clr_plane (y, x);
-			color_index = FindColor( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, certainties );
+			color_index = FindColorIndex( h_row[x], s_row[x], v_row[x] );
 			coeffs[ color_index ]++;
 		}
 	}
 	/* normalize the color histogram */
 	for (color_index = 0; color_index <= COLORS_NUM; color_index++)
 		coeffs[color_index] /= (width*height);	 
-
-	return coeffs;
 }
 
 // Register a static instance of the class using a global bool
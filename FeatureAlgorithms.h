@@ -41,7 +41,15 @@ class ImageMatrix;
 class FeatureAlgorithm : public ComputationTask {
 	public:
 		int n_features;
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const { return std::vector<double>(); };
+		// Names of ImageTransforms whose outputs this algorithm uses instead of its source image (e.g. "Otsu Mask").
+		// Plans add these as transform nodes on the source image, so they are computed once for all of the algorithms that use them.
+		std::vector<std::string> derived_inputs;
+		// Writes n_features values directly into coeffs, which is typically the destination row of a feature matrix
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const {};
+		// Called by plan executors with the derived_inputs images in order, or with just the source image if there are none.
+		virtual void execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const {
+			execute (*inputs[0], coeffs);
+		}
 		virtual void print_info() const;
 		virtual bool register_task() const;
 	protected:
@@ -52,7 +60,7 @@ class FeatureAlgorithm : public ComputationTask {
 
 class EmptyFeatureAlgorithm : public FeatureAlgorithm {
 	public:
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const { return std::vector<double>(); };
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const {};
 		EmptyFeatureAlgorithm () : FeatureAlgorithm ("Empty", 0) {};
 		EmptyFeatureAlgorithm (const std::string &s) : FeatureAlgorithm (s, 0) {};
 };
@@ -60,97 +68,102 @@ class EmptyFeatureAlgorithm : public FeatureAlgorithm {
 class ChebyshevFourierCoefficients : public FeatureAlgorithm {
 	public:
 		ChebyshevFourierCoefficients();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class ChebyshevCoefficients : public FeatureAlgorithm {
 	public:
 		ChebyshevCoefficients();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class ZernikeCoefficients : public FeatureAlgorithm {
 	public:
 		ZernikeCoefficients();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class HaralickTextures : public FeatureAlgorithm {
 	public:
 		HaralickTextures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class MultiscaleHistograms : public FeatureAlgorithm {
 	public:
 		MultiscaleHistograms();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class TamuraTextures : public FeatureAlgorithm {
 	public:
 		TamuraTextures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class CombFirstFourMoments : public FeatureAlgorithm {
 	public:
 		CombFirstFourMoments();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class RadonCoefficients : public FeatureAlgorithm {
 	public:
 		RadonCoefficients();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class FractalFeatures : public FeatureAlgorithm {
 	public:
 		FractalFeatures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class PixelIntensityStatistics : public FeatureAlgorithm {
 	public:
 		PixelIntensityStatistics();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class EdgeFeatures : public FeatureAlgorithm {
 	public:
 		EdgeFeatures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
+		virtual void execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const;
 };
 
 class ObjectFeatures : public FeatureAlgorithm {
 	public:
 		ObjectFeatures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
+		virtual void execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const;
+		// The features of a binary mask, whose objects get labeled in place.
+		void mask_features (ImageMatrix &BWImage, double *coeffs) const;
 };
 
 class InverseObjectFeatures : public FeatureAlgorithm {
 	public:
 		InverseObjectFeatures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
+		virtual void execute (const std::vector<const ImageMatrix *> &inputs, double *coeffs) const;
 };
 
 class GaborTextures : public FeatureAlgorithm {
 	public:
 		GaborTextures();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class GiniCoefficient : public FeatureAlgorithm {
 	public:
 		GiniCoefficient();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 class ColorHistogram : public FeatureAlgorithm {
 	public:
 		ColorHistogram();
-		virtual std::vector<double> execute (const ImageMatrix &IN_matrix) const;
+		virtual void execute (const ImageMatrix &IN_matrix, double *coeffs) const;
 };
 
 #endif //__FEATURE_ALGORITHMS_H_
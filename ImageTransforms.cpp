@@ -139,3 +139,63 @@ void HueTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OU
 // Register a static instance of the class using a global bool
 static bool HueTransformReg = ComputationTaskInstances::add (new HueTransform);
 
+
+//===========================================================================
+
+PrewittMagnitudeTransform::PrewittMagnitudeTransform () : ImageTransform ("Prewitt Magnitude") {};
+
+// The median is cached along with the stats, since Edge Features uses both.
+void PrewittMagnitudeTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
+	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
+	matrix_OUT.PrewittMagnitude2D (matrix_IN);
+	matrix_OUT.update_median();
+	matrix_OUT.finish();
+}
+
+// Register a static instance of the class using a global bool
+static bool PrewittMagnitudeTransformReg = ComputationTaskInstances::add (new PrewittMagnitudeTransform);
+
+
+//===========================================================================
+
+PrewittDirectionTransform::PrewittDirectionTransform () : ImageTransform ("Prewitt Direction") {};
+
+void PrewittDirectionTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
+	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
+	matrix_OUT.PrewittDirection2D (matrix_IN);
+	matrix_OUT.update_median();
+	matrix_OUT.finish();
+}
+
+// Register a static instance of the class using a global bool
+static bool PrewittDirectionTransformReg = ComputationTaskInstances::add (new PrewittDirectionTransform);
+
+
+//===========================================================================
+
+OtsuMaskTransform::OtsuMaskTransform () : ImageTransform ("Otsu Mask") {};
+
+void OtsuMaskTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
+	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
+	matrix_OUT.OtsuBinaryMaskTransform (matrix_IN);
+	matrix_OUT.finish();
+}
+
+// Register a static instance of the class using a global bool
+static bool OtsuMaskTransformReg = ComputationTaskInstances::add (new OtsuMaskTransform);
+
+
+//===========================================================================
+
+InverseOtsuMaskTransform::InverseOtsuMaskTransform () : ImageTransform ("Inverse Otsu Mask") {};
+
+void InverseOtsuMaskTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
+	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
+	ImageMatrix InvMatrix;
+	InvMatrix.invert (matrix_IN);
+	matrix_OUT.OtsuBinaryMaskTransform (InvMatrix);
+	matrix_OUT.finish();
+}
+
+// Register a static instance of the class using a global bool
+static bool InverseOtsuMaskTransformReg = ComputationTaskInstances::add (new InverseOtsuMaskTransform);
@@ -94,5 +94,31 @@ class HueTransform : public ImageTransform {
 		virtual void execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const;
 };
 
+// The following produce derived images that feature algorithms use internally (see FeatureAlgorithm::derived_inputs).
+// They are ordinary transforms, so the plan caches their outputs and shares them between all of their consumers.
+class PrewittMagnitudeTransform : public ImageTransform {
+	public:
+		PrewittMagnitudeTransform();
+		virtual void execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const;
+};
+
+class PrewittDirectionTransform : public ImageTransform {
+	public:
+		PrewittDirectionTransform();
+		virtual void execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const;
+};
+
+class OtsuMaskTransform : public ImageTransform {
+	public:
+		OtsuMaskTransform();
+		virtual void execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const;
+};
+
+class InverseOtsuMaskTransform : public ImageTransform {
+	public:
+		InverseOtsuMaskTransform();
+		virtual void execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const;
+};
+
 #endif
 
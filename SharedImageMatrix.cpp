@@ -1,5 +1,6 @@
 #include "SharedImageMatrix.h"
 #include "cmatrix.h"
+#include <algorithm> // std::swap
 
 #include <unistd.h> // sysconf(), page_size
 #include <errno.h>
@@ -69,7 +70,7 @@ void SharedImageMatrix::SetShmemName ( ) {
 //   It is not declared static here because static in a .cpp means something else entirely.
 const size_t SharedImageMatrix::calc_shmem_size (const unsigned int w, const unsigned int h, const enum ColorModes ColorMode, size_t &clr_plane_offset, size_t &shmem_data_offset) {
 	size_t new_mat_size = w * h;
-	size_t new_shmem_size = new_mat_size * sizeof (double);
+	size_t new_shmem_size = new_mat_size * sizeof (pixel_t);
 	// Expand the size to be a multiple of the page size.
 	new_shmem_size = ( (1 + (new_shmem_size / shmem_page_size)) * shmem_page_size );
 	// The color plane starts at a page boundary.
@@ -138,8 +139,8 @@ void SharedImageMatrix::allocate (unsigned int w, unsigned int h) {
 	}
 	shmem_size = new_shmem_size;
 	// remap the data for the object to use the mmap_ptr.
-	remap_pix_plane ( (double *)mmap_ptr, w, h);
-	if (ColorMode != cmGRAY) remap_clr_plane ((HSVcolor *)(mmap_ptr + clr_plane_offset), w, h);
+	remap_pix_plane ( (pixel_t *)mmap_ptr, w, h);
+	if (ColorMode != cmGRAY) remap_clr_plane ((byte *)(mmap_ptr + clr_plane_offset), w, h);
 			
 	
 	// If this memory gets read from cache, we wont know the size of the matrix,
@@ -253,8 +254,8 @@ std::cout << "shmem_size: " << shmem_size << std::endl;
 			
 			// Looks like we have a valid matrix stored, so create the cached result.
 			// remap the data for the object to use the mmap_ptr, keeping the rest of the object where it was.
-			remap_pix_plane ( (double *)mmap_ptr, stored_shmem_data->width, stored_shmem_data->height);
-			if (ColorMode != cmGRAY) remap_clr_plane ((HSVcolor *)(mmap_ptr + stored_clr_plane_offset), stored_shmem_data->width, stored_shmem_data->height);
+			remap_pix_plane ( (pixel_t *)mmap_ptr, stored_shmem_data->width, stored_shmem_data->height);
+			if (ColorMode != cmGRAY) remap_clr_plane ((byte *)(mmap_ptr + stored_clr_plane_offset), stored_shmem_data->width, stored_shmem_data->height);
 			if (width != stored_shmem_data->width || height != stored_shmem_data->height) {
 				error_str = string_format ("error when mapping existing shmem: recovered w,h (%u, %u) doesn't match that in shmem (%u, %u)",
 					(unsigned int)width, (unsigned int)height,
@@ -418,10 +419,9 @@ ImageMatrix &SharedImageMatrix::transform (const ImageTransform *transform) cons
 }
 
 
-// The destructor will unlink the shared memory unless DisableDestructorCacheCleanup(true) class method has been called.
-SharedImageMatrix::~SharedImageMatrix () {
-std::cout << "SharedImageMatrix DESTRUCTOR for " << shmem_name << std::endl;
-
+// Unmaps and closes the shared memory and the lock file, leaving the planes empty.
+// The shared memory and the lockfile are unlinked unless DisableDestructorCacheCleanup(true) class method has been called.
+void SharedImageMatrix::release_shmem () {
 	finish();
 	remap_pix_plane (NULL, 0, 0);
 	remap_clr_plane (NULL, 0, 0);
@@ -440,5 +440,38 @@ std::cout << "    unlinking POSIX shared memory " << shmem_name << " and lockfil
 		unlink (lock_file.path.c_str());
 	}
 	cache_status = csUNKNOWN;
+}
+
+// The planes of another SharedImageMatrix are taken over together with its shared memory and lock file.
+// Any other matrix's planes are not in shared memory, so they are copied into this one's (see allocate()).
+void SharedImageMatrix::take (ImageMatrix &other) {
+	if (&other == this) return;
+	SharedImageMatrix *shared = dynamic_cast<SharedImageMatrix *>(&other);
+	if (!shared) {
+		copy (other);
+		return;
+	}
+
+	release_shmem();
+	take_planes (*shared);
+	std::swap (cached_source, shared->cached_source);
+	std::swap (operation, shared->operation);
+	std::swap (shmem_name, shared->shmem_name);
+	std::swap (was_cached, shared->was_cached);
+	std::swap (shmem_size, shared->shmem_size);
+	std::swap (shmem_fd, shared->shmem_fd);
+	std::swap (mmap_ptr, shared->mmap_ptr);
+	std::swap (error_str, shared->error_str);
+	std::swap (cache_status, shared->cache_status);
+	lock_file.swap (shared->lock_file);
+	// other's destructor must not unlink what this one now owns, or what was already released above
+	shared->shmem_name.clear();
+	shared->lock_file.path.clear();
+}
+
+// The destructor will unlink the shared memory unless DisableDestructorCacheCleanup(true) class method has been called.
+SharedImageMatrix::~SharedImageMatrix () {
+std::cout << "SharedImageMatrix DESTRUCTOR for " << shmem_name << std::endl;
 
+	release_shmem();
 }
@@ -41,6 +41,7 @@ class SharedImageMatrix: public ImageMatrix {
 			int downsample, rect *bounding_rect,
 			double mean, double stddev);
 		virtual ImageMatrix &transform (const ImageTransform *transform) const;
+		virtual void take (ImageMatrix &other);
 
 		virtual ~SharedImageMatrix();                                 // destructor
 
@@ -56,6 +57,11 @@ class SharedImageMatrix: public ImageMatrix {
 		static const size_t calc_shmem_size (const unsigned int w, const unsigned int h, const enum ColorModes ColorMode, size_t &clr_plane_offset, size_t &shmem_data_offset);
 		// private instance methods
 		void SetShmemName();
+		void release_shmem ();
+	protected:
+		// the planes are in this object's shared memory, so ImageMatrix::take() copies them
+		virtual bool planes_are_movable () const { return (false); }
+	private:
 
 		// private object fields
 		WORMfile lock_file;
@@ -72,7 +78,7 @@ class SharedImageMatrix: public ImageMatrix {
 		// shared-memory layout:
 		// last sizeof(shmem_data) bytes are shmem_data.
 		// First pages are the array of doubles for pix_plane
-		// Second set of pages are array of HSVColor for clr_plane if shmem_data->ColorMode != cmGRAY
+		// Second set of pages are the h, s and v byte planes of clr_plane if shmem_data->ColorMode != cmGRAY (see clrPlanes)
 		// The pix_plane matrix storage ends on a page boundary so that clr_plane can begin at a page boundary
 		// The shmem_data storage does not necessarily begin at a page boundary, but it is at the end of the last page.
 };
@@ -26,13 +26,21 @@
 /*      Ilya G. Goldberg <goldbergil [at] mail [dot] nih [dot] gov>              */
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 #include <assert.h>
+#include <unistd.h> // for sysconf
+#include <pthread.h>
+#include <time.h>   // for clock_gettime
 #include <string>
 #include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <fstream>
+#include <errno.h>
 #include "Tasks.h"
 #include "FeatureNames.h"
 #include "ImageTransforms.h"
 #include "FeatureAlgorithms.h"
 #include "cmatrix.h"
+#include "wndchrm_error.h"
 
 
 // This file contains base classes for computation tasks, plans and executors.
@@ -114,6 +122,140 @@ size_t ComputationTaskNode::get_num_dependent_nodes () {
 }
 
 
+double ComputationPlanProfile::wall_time () {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+double ComputationPlanProfile::thread_cpu_time () {
+	struct timespec ts;
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+void ComputationPlanProfile::add (const ComputationTaskNode *node, double wall_secs, double cpu_secs, size_t alloc_bytes, size_t copy_bytes, size_t output_bytes, double pixels) {
+	pthread_mutex_lock (&stats_mutex);
+	node_stats_map_t::iterator it = node_stats.find (node->node_key);
+	if (it == node_stats.end()) {
+		node_stats_t new_stats;
+		new_stats.name = node->name;
+		new_stats.type = node->task ? node->task->typeLabel() : "";
+		new_stats.n_runs = 0;
+		new_stats.wall_secs = new_stats.cpu_secs = 0;
+		new_stats.alloc_bytes = new_stats.copy_bytes = new_stats.output_bytes = 0;
+		new_stats.pixels = 0;
+		it = node_stats.insert (std::pair<std::string, node_stats_t>(node->node_key, new_stats)).first;
+	}
+	it->second.n_runs++;
+	it->second.wall_secs += wall_secs;
+	it->second.cpu_secs += cpu_secs;
+	it->second.alloc_bytes += alloc_bytes;
+	it->second.copy_bytes += copy_bytes;
+	it->second.output_bytes += output_bytes;
+	it->second.pixels += pixels;
+	pthread_mutex_unlock (&stats_mutex);
+}
+
+void ComputationPlanProfile::clear () {
+	pthread_mutex_lock (&stats_mutex);
+	node_stats.clear();
+	pthread_mutex_unlock (&stats_mutex);
+}
+
+static bool more_cpu_time (const ComputationPlanProfile::node_stats_t &a, const ComputationPlanProfile::node_stats_t &b) {
+	return (a.cpu_secs > b.cpu_secs);
+}
+
+std::vector<ComputationPlanProfile::node_stats_t> ComputationPlanProfile::sorted_stats () const {
+	std::vector<node_stats_t> stats;
+	pthread_mutex_lock (&stats_mutex);
+	for (node_stats_map_t::const_iterator it = node_stats.begin(); it != node_stats.end(); ++it)
+		stats.push_back (it->second);
+	pthread_mutex_unlock (&stats_mutex);
+	std::stable_sort (stats.begin(), stats.end(), more_cpu_time);
+	return (stats);
+}
+
+void ComputationPlanProfile::write_tsv (std::ostream &out) const {
+	std::vector<node_stats_t> stats = sorted_stats();
+	out << "node\ttype\truns\twall_secs\tcpu_secs\talloc_bytes\tcopy_bytes\toutput_bytes\tpixels" << std::endl;
+	for (size_t i = 0; i < stats.size(); i++) {
+		out << stats[i].name << "\t" << stats[i].type << "\t" << stats[i].n_runs << "\t"
+			<< stats[i].wall_secs << "\t" << stats[i].cpu_secs << "\t"
+			<< stats[i].alloc_bytes << "\t" << stats[i].copy_bytes << "\t" << stats[i].output_bytes << "\t" << stats[i].pixels << std::endl;
+	}
+}
+
+// node names are feature group and transform names, so only quotes and backslashes need escaping.
+static std::string json_string (const std::string &str) {
+	std::string escaped = "\"";
+	for (size_t i = 0; i < str.size(); i++) {
+		if (str[i] == '"' || str[i] == '\\') escaped += '\\';
+		escaped += str[i];
+	}
+	return (escaped + "\"");
+}
+
+void ComputationPlanProfile::write_json (std::ostream &out) const {
+	std::vector<node_stats_t> stats = sorted_stats();
+	out << "[" << std::endl;
+	for (size_t i = 0; i < stats.size(); i++) {
+		out << "  {\"node\": " << json_string (stats[i].name) << ", \"type\": " << json_string (stats[i].type)
+			<< ", \"runs\": " << stats[i].n_runs << ", \"wall_secs\": " << stats[i].wall_secs << ", \"cpu_secs\": " << stats[i].cpu_secs
+			<< ", \"alloc_bytes\": " << stats[i].alloc_bytes << ", \"copy_bytes\": " << stats[i].copy_bytes << ", \"output_bytes\": " << stats[i].output_bytes
+			<< ", \"pixels\": " << stats[i].pixels << "}"
+			<< (i + 1 < stats.size() ? "," : "") << std::endl;
+	}
+	out << "]" << std::endl;
+}
+
+void ComputationPlanProfile::print_summary (std::ostream &out, size_t max_rows) const {
+	std::vector<node_stats_t> stats = sorted_stats();
+	double total_cpu = 0;
+	for (size_t i = 0; i < stats.size(); i++) total_cpu += stats[i].cpu_secs;
+	if (max_rows == 0 || max_rows > stats.size()) max_rows = stats.size();
+
+	std::ios_base::fmtflags old_flags = out.flags();
+	std::streamsize old_precision = out.precision();
+	out << std::fixed << std::setprecision (3);
+	out << "Computation profile (" << stats.size() << " nodes, " << total_cpu << " CPU seconds):" << std::endl;
+	out << std::setw(10) << "CPU s" << std::setw(8) << "%" << std::setw(10) << "wall s" << std::setw(8) << "runs"
+		<< std::setw(12) << "ms/run" << std::setw(12) << "alloc MB" << std::setw(12) << "copied MB" << std::setw(12) << "output KB" << "  node" << std::endl;
+	for (size_t i = 0; i < max_rows; i++) {
+		out << std::setw(10) << stats[i].cpu_secs
+			<< std::setw(8) << std::setprecision(1) << (total_cpu > 0 ? 100.0 * stats[i].cpu_secs / total_cpu : 0.0) << std::setprecision(3)
+			<< std::setw(10) << stats[i].wall_secs
+			<< std::setw(8) << stats[i].n_runs
+			<< std::setw(12) << 1000.0 * stats[i].cpu_secs / stats[i].n_runs
+			<< std::setw(12) << stats[i].alloc_bytes / (1024.0 * 1024.0)
+			<< std::setw(12) << stats[i].copy_bytes / (1024.0 * 1024.0)
+			<< std::setw(12) << stats[i].output_bytes / 1024.0
+			<< "  " << stats[i].name << std::endl;
+	}
+	out.flags (old_flags);
+	out.precision (old_precision);
+}
+
+double ComputationCostModel::cost (const ComputationTaskNode *node, double pixels) const {
+	if (!node->task) return (0);
+	secs_per_pixel_t::const_iterator it = secs_per_pixel.find (node->name);
+	if (it != secs_per_pixel.end()) return (it->second * pixels);
+	return (mean_secs_per_pixel * pixels);
+}
+
+void ComputationCostModel::calibrate (const ComputationPlanProfile &profile) {
+	std::vector<ComputationPlanProfile::node_stats_t> stats = profile.sorted_stats();
+	for (size_t i = 0; i < stats.size(); i++) {
+		if (stats[i].pixels > 0) secs_per_pixel[stats[i].name] = stats[i].cpu_secs / stats[i].pixels;
+	}
+
+	double sum = 0;
+	for (secs_per_pixel_t::const_iterator it = secs_per_pixel.begin(); it != secs_per_pixel.end(); ++it)
+		sum += it->second;
+	mean_secs_per_pixel = secs_per_pixel.empty() ? 0 : sum / secs_per_pixel.size();
+}
+
 void FeatureComputationPlan::add (const FeatureGroup *fg) {
 	const ComputationTaskNode *source_node = root;
 	nodemap_t::iterator nodemap_it;
@@ -123,9 +265,6 @@ void FeatureComputationPlan::add (const FeatureGroup *fg) {
 	assert(fg && "Attempt to call FeatureComputationPlan::add() with NULL feature group");
 	assert(FG_offset_map.find (fg->name) == FG_offset_map.end() && "Calling FeatureComputationPlan::add() with duplicate FeatureGroup");
 
-	// Add the feature group to the list in the order they are added.
-	feature_groups.push_back (fg);
-
 	// Add nodes as necessary for transform dependencies
 	// N.B.: add_get_node stores an internal reference to the node in the base class nodemap
 	std::string trans_node_name;
@@ -136,14 +275,55 @@ void FeatureComputationPlan::add (const FeatureGroup *fg) {
 		source_node = add_get_node (node_key, source_node, fg->transforms[i], trans_node_name);
 	}
 
+	// Add nodes for the derived images the algorithm uses instead of its source image.
+	// These are keyed like any other transform, so they are shared by all algorithms with the same source,
+	// including those in feature groups that name the same transform explicitly.
+	std::vector<const ComputationTaskNode *> input_nodes;
+	for (size_t i = 0; i < fg->algorithm->derived_inputs.size(); i++) {
+		const ImageTransform *derived = FeatureNames::getTransformByName (fg->algorithm->derived_inputs[i]);
+		assert (derived && "FeatureAlgorithm has an unknown derived input");
+		std::string derived_name = trans_node_name.empty() ? derived->name : trans_node_name + "->" + derived->name;
+		input_nodes.push_back (add_get_node (node_key + derived->name, source_node, derived, derived_name));
+	}
+
 	// Add the feature algorithm
 	node_key += fg->algorithm->name;
-	FG_node_map[fg->name] = add_get_node (node_key, source_node, fg->algorithm, fg->name);
+	if (input_nodes.empty()) {
+		FG_node_map[fg->name] = add_get_node (node_key, source_node, fg->algorithm, fg->name);
+	} else {
+		ComputationTaskNode *FA_node = const_cast<ComputationTaskNode *>(add_get_node (node_key, input_nodes[0], fg->algorithm, fg->name));
+		for (size_t i = 1; i < input_nodes.size(); i++) {
+			FA_node->input_tasks.push_back (input_nodes[i]);
+			const_cast<ComputationTaskNode *>(input_nodes[i])->dependent_tasks.push_back (FA_node);
+		}
+		FG_node_map[fg->name] = FA_node;
+	}
+
+	add_columns (fg);
+}
+
+void FeatureComputationPlan::skip (const FeatureGroup *fg) {
+	assert(!isFinal && "Attempt to call FeatureComputationPlan::skip() to a finalized plan");
+	assert(fg && "Attempt to call FeatureComputationPlan::skip() with NULL feature group");
+	assert(FG_offset_map.find (fg->name) == FG_offset_map.end() && "Calling FeatureComputationPlan::skip() with duplicate FeatureGroup");
+
+	add_columns (fg);
+	pruned = true;
+}
+
+void FeatureComputationPlan::add_columns (const FeatureGroup *fg) {
+	// Add the feature group to the list in the order they are added.
+	feature_groups.push_back (fg);
 
 	// Determine the column where to put this FG's results, and update the feature count.
 	size_t start_idx = n_features;
 	n_features += fg->algorithm->n_features;
 	FG_offset_map[fg->name] = start_idx;
+
+	// 32-bit FNV-1a over the normalized group names, so that the hash is the same on all platforms
+	for (size_t idx = 0; idx < fg->name.size(); idx++)
+		plan_hash = ((plan_hash ^ (unsigned char)fg->name[idx]) * 16777619UL) & 0xFFFFFFFFUL;
+	plan_hash = ((plan_hash ^ (unsigned char)'\n') * 16777619UL) & 0xFFFFFFFFUL;
 	
 	// Add a lookup by index, mapping to the FG labels as well as the FG itself
 	for (size_t idx = 0; idx < fg->labels.size(); idx++) {
@@ -152,6 +332,138 @@ void FeatureComputationPlan::add (const FeatureGroup *fg) {
 	}
 }
 
+FeatureComputationPlan *FeatureComputationPlan::prune (const FeatureComputationPlan *plan, const double *weights) {
+	FeatureComputationPlan *pruned_plan = new FeatureComputationPlan (plan->name + " (pruned)");
+	pruned_plan->feature_vec_type = plan->feature_vec_type;
+	size_t n_skipped = 0;
+
+	// Feature groups are re-added in the same order so that every column stays where it was.
+	// Since transform nodes are only made by add(), the ones used exclusively by skipped groups are never created.
+	for (size_t fg_idx = 0; fg_idx < plan->feature_groups.size(); fg_idx++) {
+		const FeatureGroup *fg = plan->feature_groups[fg_idx];
+		size_t start_idx = plan->getFGoffset (fg->name);
+		bool needed = false;
+		for (int idx = 0; idx < fg->algorithm->n_features && !needed; idx++) {
+			if (weights[start_idx + idx] > 0) needed = true;
+		}
+		if (needed) {
+			pruned_plan->add (fg);
+		} else {
+			pruned_plan->skip (fg);
+			n_skipped += fg->algorithm->n_features;
+		}
+	}
+	assert (pruned_plan->n_features == plan->n_features && "Pruned plan has a different number of features than the original");
+	pruned_plan->finalize();
+
+	if (verbosity >= 2) std::cout << "Pruned plan '" << plan->name << "' computes " << plan->n_features - n_skipped
+		<< " of " << plan->n_features << " features using " << pruned_plan->nodemap.size() << " of " << plan->nodemap.size() << " tasks" << std::endl;
+	return (pruned_plan);
+}
+
+// Returns the feature group for fg_name, or NULL with the reason in error if fg_name isn't a valid feature group.
+// N.B.: FeatureNames::getGroupByName() asserts on unknown algorithms and makes empty transforms for unknown transforms.
+static const FeatureGroup *validate_group_name (const std::string &fg_name, std::string &error) {
+	int depth = 0, max_depth = 0;
+	size_t idx;
+	for (idx = 0; idx < fg_name.size() && !(depth == 0 && max_depth > 0); idx++) {
+		if (fg_name[idx] == '(') depth++;
+		else if (fg_name[idx] == ')') depth--;
+		if (depth < 0) break;
+		if (depth > max_depth) max_depth = depth;
+	}
+	if (depth != 0 || max_depth == 0 || idx != fg_name.size()) {
+		error = "unbalanced or missing parentheses in '" + fg_name + "'";
+		return (NULL);
+	}
+
+	std::string algorithm_name = fg_name.substr (0, fg_name.find ('('));
+	algorithm_name.erase (algorithm_name.find_last_not_of (" \t") + 1);
+	if (!FeatureNames::getFeatureAlgorithmByName (algorithm_name)) {
+		error = "unknown feature algorithm '" + algorithm_name + "'";
+		return (NULL);
+	}
+
+	const FeatureGroup *fg = FeatureNames::getGroupByName (fg_name);
+	// The standard color plans use transform names that aren't registered (e.g. 'Color Transform'), which are valid here too.
+	for (int large_set = 0; large_set < 2; large_set++) {
+		if (StdFeatureComputationPlans::getFeatureSet (large_set, 1)->getFGoffset (fg->name) != (size_t)-1) return (fg);
+	}
+	for (idx = 0; idx < fg->transforms.size(); idx++) {
+		if (dynamic_cast<const EmptyTransform *>(fg->transforms[idx])) {
+			error = "unknown transform '" + fg->transforms[idx]->name + "'";
+			return (NULL);
+		}
+	}
+	if (fg->channel) {
+		error = "unknown transform '" + fg->channel->name + "' (transforms must be followed by parentheses)";
+		return (NULL);
+	}
+	return (fg);
+}
+
+FeatureComputationPlan *FeatureComputationPlan::read (const std::string &path) {
+	std::ifstream plan_file (path.c_str());
+	if (!plan_file) {
+		catError ("Could not open feature computation plan '%s'\n", path.c_str());
+		return (NULL);
+	}
+
+	FeatureComputationPlan *the_plan = new FeatureComputationPlan (path);
+	std::string line, error;
+	size_t line_num = 0, n_errors = 0;
+	while (std::getline (plan_file, line)) {
+		line_num++;
+		size_t start = line.find_first_not_of (" \t\r");
+		if (start == std::string::npos || line[start] == '#') continue;
+		line = line.substr (start, line.find_last_not_of (" \t\r") + 1 - start);
+
+		const FeatureGroup *fg = validate_group_name (line, error);
+		if (fg && the_plan->getFGoffset (fg->name) != (size_t)-1) {
+			error = "duplicate feature group '" + fg->name + "'";
+			fg = NULL;
+		}
+		if (fg) {
+			the_plan->add (fg);
+		} else {
+			errno = 0;
+			catError ("%s:%lu: %s\n", path.c_str(), (unsigned long)line_num, error.c_str());
+			n_errors++;
+		}
+	}
+	if (!n_errors && the_plan->n_features == 0) {
+		errno = 0;
+		catError ("Feature computation plan '%s' has no feature groups.\n", path.c_str());
+		n_errors++;
+	}
+	if (n_errors) {
+		delete the_plan;
+		return (NULL);
+	}
+	the_plan->finalize();
+
+	// A file listing one of the standard plans is equivalent to it.
+	for (int large_set = 0; large_set < 2; large_set++) {
+		for (int compute_colors = 0; compute_colors < 2; compute_colors++) {
+			const FeatureComputationPlan *std_plan = StdFeatureComputationPlans::getFeatureSet (large_set, compute_colors);
+			if (std_plan->plan_hash == the_plan->plan_hash) the_plan->feature_vec_type = std_plan->feature_vec_type;
+		}
+	}
+
+	if (verbosity >= 2) std::cout << "Read feature computation plan '" << path << "' with " << the_plan->n_features << " features in "
+		<< the_plan->feature_groups.size() << " groups (hash " << std::hex << std::setw(8) << std::setfill('0') << the_plan->plan_hash
+		<< std::dec << std::setfill(' ') << ")" << std::endl;
+	return (the_plan);
+}
+
+void FeatureComputationPlan::write (std::ostream &out) const {
+	out << "# wndchrm feature computation plan '" << name << "'" << std::endl;
+	out << "# " << n_features << " features in " << feature_groups.size() << " groups, hash "
+		<< std::hex << std::setw(8) << std::setfill('0') << plan_hash << std::dec << std::setfill(' ') << std::endl;
+	for (size_t fg_idx = 0; fg_idx < feature_groups.size(); fg_idx++)
+		out << feature_groups[fg_idx]->name << std::endl;
+}
+
 void FeatureComputationPlan::add (const std::string &fg_name) {
 	add ( FeatureNames::getGroupByName (fg_name) );
 };
@@ -178,19 +490,45 @@ const FeatureGroup *FeatureComputationPlan::getFeatureGroupByIndex (size_t offse
 
 
 
+// The priority is depth-first, so that sub-trees get completed (and their cached transforms released) before new ones are started.
+// At the same depth, nodes without dependents go before those with dependents, so that a transform's last dependent is
+// more likely to be a transform, releasing the source before descending into the new sub-tree.
+// Otherwise, nodes with more dependents go first.
 bool compare_dependencies (const ComputationTaskNode *first, const ComputationTaskNode *second) {
+	if (first->depth != second->depth) return first->depth < second->depth;
+	if (first->dependent_tasks.empty() != second->dependent_tasks.empty()) return second->dependent_tasks.empty();
 	return first->num_dependent_nodes < second->num_dependent_nodes;
 }
+bool ComputationPlanExecutor::compare_priorities::operator() (const ComputationTaskNode *first, const ComputationTaskNode *second) const {
+	if (! priorities->empty()) {
+		node_priorities_t::const_iterator first_it = priorities->find (first), second_it = priorities->find (second);
+		double first_priority = first_it != priorities->end() ? first_it->second : 0;
+		double second_priority = second_it != priorities->end() ? second_it->second : 0;
+		if (first_priority != second_priority) return first_priority < second_priority;
+	}
+	return compare_dependencies (first, second);
+}
+
 void ComputationPlanExecutor::make_dependencies_executable (const ComputationTaskNode *exec_node) {
+	compare_priorities compare = {&node_priorities};
 	// add dependencies to executable_nodes
-	executable_nodes.insert (executable_nodes.end(), exec_node->dependent_tasks.begin(), exec_node->dependent_tasks.end());
-	make_heap (executable_nodes.begin(), executable_nodes.end(), compare_dependencies);
+	for (size_t i = 0; i < exec_node->dependent_tasks.size(); i++) {
+		const ComputationTaskNode *dependent = exec_node->dependent_tasks[i];
+		if (! dependent->input_tasks.empty()) {
+			size_t &n_finished = finished_inputs[dependent];
+			if (++n_finished <= dependent->input_tasks.size()) continue;
+			finished_inputs.erase (dependent);
+		}
+		executable_nodes.push_back (dependent);
+	}
+	make_heap (executable_nodes.begin(), executable_nodes.end(), compare);
 };
 
 const ComputationTaskNode *ComputationPlanExecutor::get_next_executable_node () {
+	compare_priorities compare = {&node_priorities};
 // get the first node off the heap and pop it off the vector
 
-	pop_heap (executable_nodes.begin(), executable_nodes.end(), compare_dependencies);
+	pop_heap (executable_nodes.begin(), executable_nodes.end(), compare);
 	const ComputationTaskNode *exec_node = executable_nodes.back();
 	executable_nodes.pop_back();
 	return (exec_node);
@@ -200,22 +538,77 @@ void FeatureComputationPlanExecutor::execute_node (const ComputationTaskNode *ex
 	// Put it in the executing nodes set
 	ComputationPlanExecutor::execute_node (exec_node);
 
+	std::vector<const ImageMatrix *> IM_ins;
+	get_inputs (exec_node, IM_ins);
+	const ImageMatrix *IM_out = execute_task (exec_node, IM_ins);
+	if (IM_out) cache_IM (exec_node, IM_out);
+}
+
+void FeatureComputationPlanExecutor::get_inputs (const ComputationTaskNode *exec_node, std::vector<const ImageMatrix *> &IM_ins) {
+	IM_ins.clear();
+	IM_ins.push_back (IM_map[exec_node->source_task->node_key]);
+	for (size_t i = 0; i < exec_node->input_tasks.size(); i++)
+		IM_ins.push_back (IM_map[exec_node->input_tasks[i]->node_key]);
+}
+
+// Store a transform's output in the cache until all of its dependents have finished.
+void FeatureComputationPlanExecutor::cache_IM (const ComputationTaskNode *exec_node, const ImageMatrix *IM_out) {
+	// The ImageMatrix cache is keyed by node_key
+	assert (IM_map.find(exec_node->node_key) == IM_map.end() && "Attempt to execute a transform which is already cached.");
+	if (exec_node->dependent_tasks.empty()) {
+		delete (IM_out);
+		return;
+	}
+	IM_map[exec_node->node_key] = IM_out;
+	IM_refcounts[exec_node->node_key] = exec_node->dependent_tasks.size();
+	IM_cache_bytes += IM_out->mem_bytes();
+	if (IM_cache_bytes > IM_cache_peak_bytes) IM_cache_peak_bytes = IM_cache_bytes;
+}
+
+// Called when a dependent of source_node finishes.  Deletes the source's ImageMatrix if this was the last one.
+// The root's ImageMatrix was a parameter to run(), so it is never released here.
+void FeatureComputationPlanExecutor::release_IM (const ComputationTaskNode *source_node) {
+	if (source_node == plan->root) return;
+
+	IM_refcounts_t::iterator refcount_it = IM_refcounts.find (source_node->node_key);
+	assert (refcount_it != IM_refcounts.end() && "Attempt to release an ImageMatrix that is not cached.");
+	if (--(refcount_it->second) > 0) return;
+
+	IM_map_t::iterator IM_map_it = IM_map.find (source_node->node_key);
+	if (verbosity > 7) std::cout << "releasing IM for node_key=" << source_node->node_key << std::endl;
+	IM_cache_bytes -= IM_map_it->second->mem_bytes();
+	delete (IM_map_it->second);
+	IM_map.erase (IM_map_it);
+	IM_refcounts.erase (refcount_it);
+}
+
+const ImageMatrix *FeatureComputationPlanExecutor::execute_task (const ComputationTaskNode *exec_node, const std::vector<const ImageMatrix *> &IM_ins) const {
 	const ComputationTask *task = exec_node->task;
-	const ImageMatrix *IM_in = IM_map[exec_node->source_task->node_key];
-	assert (IM_in != NULL && "Attempt to execute a FeatureComputationPlan node with a NULL source ImageMatrix");
+	const ImageMatrix *IM_in = IM_ins[0];
+	ImageMatrix *IM_out = NULL;
+	size_t output_bytes = 0;
+	for (size_t i = 0; i < IM_ins.size(); i++)
+		assert (IM_ins[i] != NULL && "Attempt to execute a FeatureComputationPlan node with a NULL source ImageMatrix");
+
+	double wall_start = 0, cpu_start = 0;
+	size_t alloc_start = 0, copy_start = 0;
+	if (profile) {
+		wall_start = ComputationPlanProfile::wall_time();
+		cpu_start = ComputationPlanProfile::thread_cpu_time();
+		alloc_start = ImageMatrix::thread_alloc_bytes();
+		copy_start = ImageMatrix::thread_copy_bytes();
+	}
 
 	if (verbosity > 5) std::cout << "** executing node '" << exec_node->name << "' with " << exec_node->num_dependent_nodes << " total dependents. IM_in=" << IM_in;
 	switch (task->type) {
 		case ComputationTask::ImageTransformTask: {
 			const ImageTransform *IT_task = dynamic_cast<const ImageTransform *>(exec_node->task);
 			assert (IT_task && "Attempt to cast task as a (const ImageTransform *) failed.");
-			// The ImageMatrix cache is keyed by node_key
-			assert (IM_map.find(exec_node->node_key) == IM_map.end() && "Attempt to execute a transform which is already cached.");
 			
-			ImageMatrix *IM_out = new ImageMatrix;
+			IM_out = new ImageMatrix;
 			if (verbosity > 5) std::cout << " ImageTransform task '" << IT_task->name << "'" << std::endl;
 			IT_task->execute (*IM_in, *IM_out);
-			IM_map[exec_node->node_key] = IM_out;
+			output_bytes = IM_out->mem_bytes();
 		} break;
 		
 		case ComputationTask::FeatureAlgorithmTask: {
@@ -227,10 +620,9 @@ void FeatureComputationPlanExecutor::execute_node (const ComputationTaskNode *ex
 
 			if (verbosity > 5) std::cout << " FeatureAlgorithm task '" << FA_task->name << "' (@ " << offset << ", " << FA_task->n_features << " features)" << std::endl;
 			size_t mat_offset = (plan->n_features * current_feature_mat_row) + offset;
-			// FIXME: we need to pass the result matrix chunck as a parameter instead of on the stack
-			// construct a vector for the result
-			std::vector<double> res_vec = FA_task->execute (*IM_in);
-			for (int idx = 0; idx < FA_task->n_features; idx++) feature_mat[mat_offset+idx] = res_vec[idx];
+			// Results are written in place: each node owns a disjoint span of the row, so concurrent writes don't need a lock
+			FA_task->execute (IM_ins, feature_mat + mat_offset);
+			output_bytes = FA_task->n_features * sizeof (double);
 		} break;
 		
 		default:
@@ -238,6 +630,39 @@ void FeatureComputationPlanExecutor::execute_node (const ComputationTaskNode *ex
 			assert (false && "Attempt to execute a node with an undefined task type");
 		break;
 	}
+
+	if (profile) profile->add (exec_node,
+		ComputationPlanProfile::wall_time() - wall_start,
+		ComputationPlanProfile::thread_cpu_time() - cpu_start,
+		ImageMatrix::thread_alloc_bytes() - alloc_start,
+		ImageMatrix::thread_copy_bytes() - copy_start,
+		output_bytes, source_pixels
+	);
+	return (IM_out);
+}
+
+// Returns the estimated time from the start of node to the end of its most expensive chain of dependents,
+// recording it as the node's priority.
+double FeatureComputationPlanExecutor::critical_path (const ComputationTaskNode *node) {
+	double longest_dependent = 0;
+	for (size_t i = 0; i < node->dependent_tasks.size(); i++) {
+		double dependent_path = critical_path (node->dependent_tasks[i]);
+		if (dependent_path > longest_dependent) longest_dependent = dependent_path;
+	}
+	return (node_priorities[node] = cost_model->cost (node, source_pixels) + longest_dependent);
+}
+
+void FeatureComputationPlanExecutor::schedule_critical_paths () {
+	node_priorities.clear();
+	if (!cost_model || !cost_model->calibrated()) return;
+
+	double makespan = critical_path (plan->root);
+	if (verbosity > 5) {
+		double total = 0;
+		for (node_priorities_t::const_iterator it = node_priorities.begin(); it != node_priorities.end(); ++it)
+			total += cost_model->cost (it->first, source_pixels);
+		std::cout << "Estimated critical path for plan '" << plan->name << "': " << makespan << " of " << total << " CPU seconds" << std::endl;
+	}
 }
 
 // FIXME: this can go into the base class (?) if its not specialized for task types
@@ -245,6 +670,10 @@ void FeatureComputationPlanExecutor::finish_node_execution (const ComputationTas
 	if (verbosity > 6) std::cout << "finished '" << exec_node->name << "'" << std::endl;
 	// remove it from executing_nodes
 	ComputationPlanExecutor::finish_node_execution (exec_node);
+	// this node no longer needs its inputs
+	if (exec_node->source_task) release_IM (exec_node->source_task);
+	for (size_t i = 0; i < exec_node->input_tasks.size(); i++)
+		release_IM (exec_node->input_tasks[i]);
 
 	// N.B.:  The execute_node() method is responsible for storing the execution results
 	make_dependencies_executable (exec_node);
@@ -259,12 +688,27 @@ void FeatureComputationPlanExecutor::finish_node_execution (const ComputationTas
 }
 
 
+FeatureComputationPlanExecutor::FeatureComputationPlanExecutor (const FeatureComputationPlan *plan_in) : ComputationPlanExecutor (plan_in) {
+	plan = plan_in;
+	feature_mat = NULL;
+	current_feature_mat_row = size_t(-1);
+	IM_cache_bytes = IM_cache_peak_bytes = 0;
+	profile = NULL;
+	cost_model = NULL;
+	arena = PlaneArena::current();
+	source_pixels = 0;
+}
+
 void FeatureComputationPlanExecutor::run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row) {
+	PlaneArena *caller_arena = PlaneArena::current();
 
 	reset();
+	PlaneArena::set_current (arena);
 
 	feature_mat = &feature_mat_in[0];
 	current_feature_mat_row = dest_row;
+	source_pixels = (double)source_mat->width * source_mat->height;
+	schedule_critical_paths();
 	// put the source_mat into the cache
 	IM_map["root"] = source_mat;
 
@@ -277,8 +721,10 @@ void FeatureComputationPlanExecutor::run (const ImageMatrix *source_mat, std::ve
 		execute_node (exec_node);
 		finish_node_execution(exec_node);
 	}
+	PlaneArena::set_current (caller_arena);
 	// The caches get cleaned up in reset() above, or in the destructor
 	if (verbosity > 5) std::cout << "Finished running execution plan '" << plan->name << "'" << std::endl;
+	if (verbosity > 3) std::cout << "Peak memory for cached transforms: " << IM_cache_peak_bytes / (1024.0 * 1024.0) << " MB" << std::endl;
 }
 
 void FeatureComputationPlanExecutor::reset () {
@@ -292,11 +738,190 @@ void FeatureComputationPlanExecutor::reset () {
 		delete (IM_map_it->second);
 	}
 	IM_map.clear();
+	IM_refcounts.clear();
+	ComputationPlanExecutor::reset();
+	IM_cache_bytes = IM_cache_peak_bytes = 0;
 	feature_mat = NULL;
 	current_feature_mat_row = size_t(-1);
 	// note that the plan stays.
 }
 
+FeatureComputationPlanConcurrentExecutor::FeatureComputationPlanConcurrentExecutor (const FeatureComputationPlan *plan_in, size_t n_threads_in)
+	: FeatureComputationPlanExecutor (plan_in) {
+	n_threads = n_threads_in ? n_threads_in : default_threads();
+	pthread_mutex_init (&state_mutex, NULL);
+	pthread_cond_init (&node_finished, NULL);
+}
+
+FeatureComputationPlanConcurrentExecutor::~FeatureComputationPlanConcurrentExecutor () {
+	reset();
+	pthread_cond_destroy (&node_finished);
+	pthread_mutex_destroy (&state_mutex);
+}
+
+size_t FeatureComputationPlanConcurrentExecutor::default_threads () {
+	long n_procs = sysconf (_SC_NPROCESSORS_ONLN);
+	return (n_procs > 0 ? (size_t)n_procs : 1);
+}
+
+void *FeatureComputationPlanConcurrentExecutor::worker_thread (void *executor) {
+	static_cast<FeatureComputationPlanConcurrentExecutor *>(executor)->worker();
+	return (NULL);
+}
+
+// Each worker takes the next node off the shared heap, runs it with the lock released, then stores the results
+// and makes the node's dependents executable with the lock held.
+// The run is over when there is nothing left to execute and nothing executing that could add more nodes.
+void FeatureComputationPlanConcurrentExecutor::worker () {
+	const ComputationTaskNode *exec_node;
+	std::vector<const ImageMatrix *> IM_ins;
+	const ImageMatrix *IM_out;
+	PlaneArena *caller_arena = PlaneArena::current();
+
+	PlaneArena::set_current (arena);
+	pthread_mutex_lock (&state_mutex);
+	while (true) {
+		while (executable_nodes.empty() && !executing_nodes.empty())
+			pthread_cond_wait (&node_finished, &state_mutex);
+		if (executable_nodes.empty()) break;
+
+		exec_node = get_next_executable_node();
+		ComputationPlanExecutor::execute_node (exec_node);
+		get_inputs (exec_node, IM_ins);
+		pthread_mutex_unlock (&state_mutex);
+
+		IM_out = execute_task (exec_node, IM_ins);
+
+		pthread_mutex_lock (&state_mutex);
+		if (IM_out) cache_IM (exec_node, IM_out);
+		finish_node_execution (exec_node);
+		pthread_cond_broadcast (&node_finished);
+	}
+	pthread_mutex_unlock (&state_mutex);
+	PlaneArena::set_current (caller_arena);
+}
+
+void FeatureComputationPlanConcurrentExecutor::run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row) {
+
+	reset();
+
+	feature_mat = &feature_mat_in[0];
+	current_feature_mat_row = dest_row;
+	source_pixels = (double)source_mat->width * source_mat->height;
+	schedule_critical_paths();
+	// put the source_mat into the cache
+	IM_map["root"] = source_mat;
+
+	finish_node_execution(plan->root);
+
+	// no need to start more threads than there are nodes in the plan
+	size_t n_workers = n_threads;
+	if (n_workers > plan->root->num_dependent_nodes) n_workers = plan->root->num_dependent_nodes;
+	if (n_workers < 1) n_workers = 1;
+	if (verbosity > 5) std::cout << "Running execution plan '" << plan->name << "' with " << n_workers << " threads" << std::endl;
+
+	// The calling thread is one of the workers
+	std::vector<pthread_t> threads (n_workers - 1);
+	size_t n_started = 0;
+	for (size_t i = 0; i < threads.size(); i++) {
+		if (pthread_create (&threads[i], NULL, worker_thread, this) != 0) break;
+		n_started++;
+	}
+	worker ();
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join (threads[i], NULL);
+
+	assert (executable_nodes.empty() && executing_nodes.empty() && "Concurrent execution finished with unexecuted nodes");
+	// The caches get cleaned up in reset() above, or in the destructor
+	if (verbosity > 5) std::cout << "Finished running execution plan '" << plan->name << "'" << std::endl;
+	if (verbosity > 3) std::cout << "Peak memory for cached transforms: " << IM_cache_peak_bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+}
+
+FeatureComputationPlanBatchExecutor::FeatureComputationPlanBatchExecutor (const FeatureComputationPlan *plan_in, size_t n_threads_in) {
+	plan = plan_in;
+	n_threads = n_threads_in;
+	profile = NULL;
+	cost_model = NULL;
+	arena = PlaneArena::current();
+	row_finished = NULL;
+	row_finished_arg = NULL;
+	if (n_threads > 1) executor = new FeatureComputationPlanConcurrentExecutor (plan, n_threads);
+	else executor = new FeatureComputationPlanExecutor (plan);
+
+	row_sources = NULL;
+	row_feature_mat = NULL;
+	row_first_row = next_row = 0;
+	pthread_mutex_init (&rows_mutex, NULL);
+}
+
+FeatureComputationPlanBatchExecutor::~FeatureComputationPlanBatchExecutor () {
+	delete executor;
+	pthread_mutex_destroy (&rows_mutex);
+}
+
+size_t FeatureComputationPlanBatchExecutor::run (const std::vector<const ImageMatrix *> &sources, std::vector<double> &feature_mat, size_t first_row) {
+	executor->profile = profile;
+	executor->cost_model = cost_model;
+	executor->arena = arena;
+	if (feature_mat.size() < (first_row + sources.size()) * plan->n_features)
+		feature_mat.resize ((first_row + sources.size()) * plan->n_features);
+
+	if (n_threads < 2 || sources.size() < n_threads) {
+		for (size_t i = 0; i < sources.size(); i++) {
+			executor->run (sources[i], feature_mat, first_row + i);
+			if (row_finished) row_finished (first_row + i, row_finished_arg);
+		}
+		return (sources.size());
+	}
+
+	row_sources = &sources;
+	row_feature_mat = &feature_mat;
+	row_first_row = first_row;
+	next_row = 0;
+	if (verbosity > 5) std::cout << "Running " << sources.size() << " rows of plan '" << plan->name << "' with " << n_threads << " threads" << std::endl;
+
+	// The calling thread is one of the workers
+	std::vector<pthread_t> threads (n_threads - 1);
+	size_t n_started = 0;
+	for (size_t i = 0; i < threads.size(); i++) {
+		if (pthread_create (&threads[i], NULL, row_worker_thread, this) != 0) break;
+		n_started++;
+	}
+	row_worker ();
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join (threads[i], NULL);
+
+	row_sources = NULL;
+	row_feature_mat = NULL;
+	return (sources.size());
+}
+
+void *FeatureComputationPlanBatchExecutor::row_worker_thread (void *batch_executor) {
+	static_cast<FeatureComputationPlanBatchExecutor *>(batch_executor)->row_worker();
+	return (NULL);
+}
+
+// Each worker takes the next row, and computes it with its own serial executor.
+// The feature matrix was sized before the workers started, and each row is written by only one worker.
+void FeatureComputationPlanBatchExecutor::row_worker () {
+	FeatureComputationPlanExecutor row_executor (plan);
+	row_executor.profile = profile;
+	row_executor.arena = arena;
+	size_t row;
+
+	pthread_mutex_lock (&rows_mutex);
+	while (next_row < row_sources->size()) {
+		row = next_row++;
+		pthread_mutex_unlock (&rows_mutex);
+
+		row_executor.run ((*row_sources)[row], *row_feature_mat, row_first_row + row);
+		if (row_finished) row_finished (row_first_row + row, row_finished_arg);
+
+		pthread_mutex_lock (&rows_mutex);
+	}
+	pthread_mutex_unlock (&rows_mutex);
+}
+
 const FeatureComputationPlan *StdFeatureComputationPlans::getFeatureSet () {
 	static FeatureComputationPlan *the_plan = new FeatureComputationPlan ("Standard Feature Set");
 	if ( the_plan->isFinalized() ) return the_plan;
@@ -307,6 +932,34 @@ const FeatureComputationPlan *StdFeatureComputationPlans::getFeatureSet () {
 	return (the_plan);
 }
 
+const FeatureComputationPlan *StdFeatureComputationPlans::getFeatureSet (int large_set, int compute_colors) {
+	if (large_set) {
+		if (compute_colors) return getFeatureSetLongColor();
+		else return getFeatureSetLong();
+	} else {
+		if (compute_colors) return getFeatureSetColor();
+		else return getFeatureSet();
+	}
+}
+
+const FeatureComputationPlan *StdFeatureComputationPlans::getFeatureSetFromFile (const std::string &path) {
+	typedef OUR_UNORDERED_MAP<std::string, const FeatureComputationPlan *> file_plans_t;
+	static file_plans_t file_plans;
+	static pthread_mutex_t file_plans_mutex = PTHREAD_MUTEX_INITIALIZER;
+	const FeatureComputationPlan *the_plan = NULL;
+
+	pthread_mutex_lock (&file_plans_mutex);
+	file_plans_t::const_iterator it = file_plans.find (path);
+	if (it != file_plans.end()) {
+		the_plan = it->second;
+	} else {
+		the_plan = FeatureComputationPlan::read (path);
+		if (the_plan) file_plans[path] = the_plan;
+	}
+	pthread_mutex_unlock (&file_plans_mutex);
+	return (the_plan);
+}
+
 const FeatureComputationPlan *StdFeatureComputationPlans::getFeatureSetColor () {
 	static FeatureComputationPlan *the_plan = new FeatureComputationPlan ("Color Feature Set");
 	if ( the_plan->isFinalized() ) return the_plan;
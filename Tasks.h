@@ -29,8 +29,10 @@
 #define __TASKS_H_
 
 #include <assert.h>
+#include <pthread.h>
 #include <vector>
 #include <string>
+#include <iostream>
 // defines OUR_UNORDERED_MAP based on what's available
 #include "unordered_map_dfn.h"
 
@@ -92,6 +94,9 @@ class ComputationTaskNode {
 		size_t depth; // root = 0
 		// The nodes are owned by a ComputationPlan
 		std::vector <const ComputationTaskNode *> dependent_tasks;
+		// Inputs in addition to source_task.  The node is also one of their dependent_tasks,
+		// and only becomes executable once all of its inputs have finished.
+		std::vector <const ComputationTaskNode *> input_tasks;
 		void print_info() const;
 		size_t get_num_dependent_nodes ();
 		ComputationTaskNode(ComputationTaskNode *source_node_in, const ComputationTask *task_in, const std::string &name_in = "", const std::string &key_in = "") {
@@ -172,7 +177,7 @@ class ComputationPlan {
 			root = new ComputationTaskNode(NULL,NULL);
 			isFinal = false;
 		}
-		~ComputationPlan() {
+		virtual ~ComputationPlan() {
 			nodemap_t::iterator nodemap_it;
 			for(nodemap_it = nodemap.begin(); nodemap_it != nodemap.end(); nodemap_it++) {
 				delete (nodemap_it->second);
@@ -221,6 +226,7 @@ class ComputationPlanExecutor {
 		}
 
 		// This should be called at the end of an over-ridden finish_node_execution()
+		// Dependents with input_tasks are held back until this has been called for all of their inputs.
 		void make_dependencies_executable (const ComputationTaskNode *exec_node);
 
 		// Sub-classes must assign their specific plan pointer in their constructor
@@ -231,10 +237,19 @@ class ComputationPlanExecutor {
 		ComputationPlanExecutor(const ComputationPlan *plan_in) {
 			plan = plan_in;
 		}
-		~ComputationPlanExecutor () {
+		virtual ~ComputationPlanExecutor () {
 			reset();
 		}
 	protected:
+		// Optional scheduling priorities: nodes with higher priorities are executed first.
+		// Nodes with equal (or no) priorities are executed in compare_dependencies() order.
+		typedef OUR_UNORDERED_MAP<const ComputationTaskNode *, double> node_priorities_t;
+		node_priorities_t node_priorities;
+		// heap comparison using node_priorities
+		struct compare_priorities {
+			const node_priorities_t *priorities;
+			bool operator() (const ComputationTaskNode *first, const ComputationTaskNode *second) const;
+		};
 		// executable_nodes is a vector that gets heap-ified to act as a priority queue.
 		// The only reason its not an actual std::priority_queue is that we want to add nodes to it in a block, then heapify.
 		typedef std::vector<const ComputationTaskNode *> executable_nodes_t;
@@ -242,6 +257,9 @@ class ComputationPlanExecutor {
 		// The executing_nodes is a map of node pointers keyed on node_key
 		typedef OUR_UNORDERED_MAP<std::string, const ComputationTaskNode *> executing_nodes_t;
 		executing_nodes_t executing_nodes;
+		// The number of finished inputs of nodes with input_tasks that are not yet executable
+		typedef OUR_UNORDERED_MAP<const ComputationTaskNode *, size_t> finished_inputs_t;
+		finished_inputs_t finished_inputs;
 
 		// execute_node in the parent only knows about executing_nodes, so it inserts it into its executing_nodes map
 		// Also, it asserts that this node isn't already in the executing_nodes map
@@ -252,7 +270,9 @@ class ComputationPlanExecutor {
 		// This resets the object for the next call to run()
 		// run() calls reset(), so this is protected.  The destructor also calls reset()
 		// The base class doesn't create things during a run, so there's nothing to destroy here between runs.
-		virtual void reset () {};
+		virtual void reset () {
+			finished_inputs.clear();
+		};
 	private:
 		ComputationPlanExecutor();                                // Don't implement
         ComputationPlanExecutor(ComputationPlanExecutor const&);  // Don't Implement
@@ -260,10 +280,83 @@ class ComputationPlanExecutor {
 };
 
 
+// ComputationPlanProfile collects per-node execution statistics for any number of runs of any number of executors.
+// Nodes are keyed on node_key, so nodes of different plans that do the same thing are aggregated together.
+// Executors record into the profile they are given (their profile member), and do nothing if it is NULL.
+// add() may be called from several threads at once.
+// The allocated bytes are those of ImageMatrix planes allocated by the executing thread while the node ran,
+//   the copied bytes are those of planes it copied from other matrices (see ImageMatrix::thread_copy_bytes()),
+//   and the output bytes are the size of the transform's ImageMatrix or of the feature group's values.
+// The pixels are those of the plan's source image (not the node's input), summed over runs.
+class ComputationPlanProfile {
+	public:
+		struct node_stats_t {
+			std::string name;
+			const char *type;
+			size_t n_runs;
+			double wall_secs;
+			double cpu_secs;
+			size_t alloc_bytes;
+			size_t copy_bytes;
+			size_t output_bytes;
+			double pixels;
+		};
+		void add (const ComputationTaskNode *node, double wall_secs, double cpu_secs, size_t alloc_bytes, size_t copy_bytes, size_t output_bytes, double pixels);
+		void clear ();
+		// the accumulated stats, sorted by total CPU time (most expensive first)
+		std::vector<node_stats_t> sorted_stats () const;
+		// machine-readable reports
+		void write_tsv (std::ostream &out) const;
+		void write_json (std::ostream &out) const;
+		// human-readable table of the most expensive nodes (max_rows = 0 prints all of them)
+		void print_summary (std::ostream &out, size_t max_rows = 0) const;
+
+		// timers used by executors
+		static double wall_time ();
+		static double thread_cpu_time ();
+
+		ComputationPlanProfile () {
+			pthread_mutex_init (&stats_mutex, NULL);
+		}
+		~ComputationPlanProfile () {
+			pthread_mutex_destroy (&stats_mutex);
+		}
+	private:
+		typedef OUR_UNORDERED_MAP<std::string, node_stats_t> node_stats_map_t;
+		node_stats_map_t node_stats;
+		mutable pthread_mutex_t stats_mutex;
+        ComputationPlanProfile(ComputationPlanProfile const&); // Don't Implement
+        void operator=(ComputationPlanProfile const&);        // Don't implement
+};
+
+// ComputationCostModel estimates the CPU time of each node as a cost per pixel of the plan's source image, so it
+//   includes the effect of transforms that change the image size further up the chain.
+// Costs are calibrated from the timings recorded in a ComputationPlanProfile, and are keyed by node name
+//   so they apply to any plan with the same transforms and feature groups.
+// Nodes that have not been calibrated are assumed to cost the average of the ones that have.
+class ComputationCostModel {
+	public:
+		// estimated CPU seconds for node given the number of pixels in the source image
+		double cost (const ComputationTaskNode *node, double pixels) const;
+		// (re)calibrates the nodes that are in profile, leaving the others as they were.
+		void calibrate (const ComputationPlanProfile &profile);
+		bool calibrated () const { return (! secs_per_pixel.empty()); }
+
+		ComputationCostModel () {
+			mean_secs_per_pixel = 0;
+		}
+	private:
+		typedef OUR_UNORDERED_MAP<std::string, double> secs_per_pixel_t;
+		secs_per_pixel_t secs_per_pixel;
+		double mean_secs_per_pixel;
+};
+
 // 
 // forward declarations
 class ImageMatrix;
+class PlaneArena;
 class FeatureGroup;
+struct rect;
 // This class has additional members and methods specific for a feature computation plan
 // Plans aren't executable themselves because they do not hold state durring an execution.
 #define CURRENT_FEATURE_VERSION 2
@@ -271,9 +364,27 @@ class FeatureComputationPlan : public ComputationPlan {
 	public:
 		size_t n_features;
 		int feature_vec_type;              // stores the integer value of the feature_vec_types enum.
+		// true if some of the feature groups have columns but no nodes (see prune() below)
+		bool pruned;
+		// Identifies the column layout: a hash of the feature group names in column order (see add_columns()).
+		// Plans with the same columns (e.g. a plan and its pruned version) have the same hash.  Stored in .sig and .fit headers.
+		unsigned long plan_hash;
 
 		virtual void add (const std::string &FGname);
 		void add (const FeatureGroup *fg);
+		// Reserves the columns for a feature group without adding any nodes to compute it.
+		// The columns are left untouched by executors.
+		void skip (const FeatureGroup *fg);
+		// Returns a new finalized plan with the same column layout as plan, but with only the feature groups
+		// that have at least one non-zero weight.  weights is indexed by column, and must have plan->n_features entries.
+		// Transforms are only added when a remaining feature group depends on them.  The caller owns the returned plan.
+		static FeatureComputationPlan *prune (const FeatureComputationPlan *plan, const double *weights);
+		// Plan files list one feature group name per line in column order, e.g. "Haralick Textures (Fourier (Wavelet ()))".
+		// Blank lines and lines starting with '#' are ignored.
+		// Returns a new finalized plan, or NULL if the file can't be read or fails validation (reported with catError()).
+		static FeatureComputationPlan *read (const std::string &path);
+		// Writes the plan's feature groups (including skipped ones) in the format read by read()
+		void write (std::ostream &out) const;
 
 		size_t getFGoffset (const std::string &FGname) const {
 			FG_offset_map_t::const_iterator it = FG_offset_map.find (FGname);
@@ -288,11 +399,14 @@ class FeatureComputationPlan : public ComputationPlan {
 		FeatureComputationPlan (const std::string &name_in) : ComputationPlan (name_in) {
 			n_features = 0;
 			feature_vec_type = 0;
+			pruned = false;
+			plan_hash = 2166136261UL; // FNV-1a offset basis
 		}
 		// parent destructor takes care of CalculationTask objects
 		// This plan doesn't own any of the objects it has references to
 		~FeatureComputationPlan() {}
 	private:
+		void add_columns (const FeatureGroup *fg);
 		std::vector<const FeatureGroup *> feature_groups;
 
 		// FG_offset_map keys are feature group names. The value is the column where the FG vector starts.
@@ -318,6 +432,16 @@ class FeatureComputationPlanExecutor : public ComputationPlanExecutor {
 		const FeatureComputationPlan *plan;
 		double *feature_mat;
 		size_t current_feature_mat_row;
+		// Memory used by cached transform outputs (not including the source image)
+		// The peak is kept after run() returns, and cleared by the next run()
+		size_t IM_cache_bytes;
+		size_t IM_cache_peak_bytes;
+		// if not NULL, node executions are recorded here
+		ComputationPlanProfile *profile;
+		// if not NULL and calibrated, executable nodes are run longest critical path first (see schedule_critical_paths())
+		const ComputationCostModel *cost_model;
+		// the planes and scratch buffers of the run come from here (by default, the arena current when the executor was made)
+		PlaneArena *arena;
 
 		virtual void finish_node_execution (const ComputationTaskNode *exec_node);
 		virtual void run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row);
@@ -328,27 +452,102 @@ class FeatureComputationPlanExecutor : public ComputationPlanExecutor {
 			reset();
 		}
 		// sub-classes must set their own plan.  Relying on the parent class to do this doesn't work.
-		FeatureComputationPlanExecutor (const FeatureComputationPlan *plan_in) : ComputationPlanExecutor (plan_in) {
-			plan = plan_in;
-			feature_mat = NULL;
-			current_feature_mat_row = size_t(-1);
-		}
+		FeatureComputationPlanExecutor (const FeatureComputationPlan *plan_in);
 	protected:
 		// ImageMatrix cache
 		// IM_map keys are node_keys for transform nodes (source->node_key)
 		typedef OUR_UNORDERED_MAP<std::string, const ImageMatrix *> IM_map_t;
 		IM_map_t IM_map;
+		// The number of dependent nodes that have yet to finish with each cached ImageMatrix, keyed like IM_map.
+		// A cached ImageMatrix is deleted as soon as its last dependent finishes.
+		typedef OUR_UNORDERED_MAP<std::string, size_t> IM_refcounts_t;
+		IM_refcounts_t IM_refcounts;
+		void cache_IM (const ComputationTaskNode *exec_node, const ImageMatrix *IM_out);
+		void release_IM (const ComputationTaskNode *source_node);
+		// The cached ImageMatrixes of the node's source_task and input_tasks, in that order
+		void get_inputs (const ComputationTaskNode *exec_node, std::vector<const ImageMatrix *> &IM_ins);
+		// pixels in the source image of the current run
+		double source_pixels;
+		// Sets the node priorities to the estimated time from the start of each node to the end of its longest chain of dependents
+		// With enough threads, the run can't finish before the longest of these, so starting them first minimizes the makespan.
+		void schedule_critical_paths ();
+		double critical_path (const ComputationTaskNode *node);
 
 		virtual void execute_node (const ComputationTaskNode *exec_node);
+		// execute_task() does the actual work for a node given its input ImageMatrixes (see get_inputs()), and doesn't touch the executor's state.
+		// FeatureAlgorithm results go into the node's own columns in feature_mat, and NULL is returned.
+		// ImageTransform results are returned as a new ImageMatrix, which the caller is responsible for caching in IM_map.
+		const ImageMatrix *execute_task (const ComputationTaskNode *exec_node, const std::vector<const ImageMatrix *> &IM_ins) const;
 		// This resets the object for the next call to run() (run() calls reset)
 		virtual void reset ();
 
 };
-// two options for concurrent executors:  Derive from ConcurrentExecutor, or derive from plan-specific executor.
-// class FeatureComputationPlanConcurrentExecutor : public ConcurrentPlanExecutor
-//   -- and --  class ConcurrentPlanExecutor : public ComputationPlanExecutor
-// -- or --
-// class FeatureCalculationConcurrentExecutor : public FeatureComputationPlanExecutor
+
+// The concurrent executor runs independent nodes of the plan in a pool of worker threads.
+// The workers share the executable_nodes heap, so nodes are picked longest critical path first when the cost model is
+// calibrated (see schedule_critical_paths()), and in depth-first dependency order otherwise (see compare_dependencies()).
+// The executor's heap and maps are only touched while holding state_mutex, but the tasks themselves run unlocked:
+//   The source ImageMatrix of a node is finished (read-only) before any of its dependents become executable,
+//   and each FeatureAlgorithm node writes to its own disjoint slice of feature_mat.
+class FeatureComputationPlanConcurrentExecutor : public FeatureComputationPlanExecutor {
+	public:
+		size_t n_threads;
+
+		virtual void run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row);
+		virtual void run () {}
+		// n_threads_in = 0 uses the number of online processors
+		FeatureComputationPlanConcurrentExecutor (const FeatureComputationPlan *plan_in, size_t n_threads_in = 0);
+		~FeatureComputationPlanConcurrentExecutor ();
+		static size_t default_threads ();
+	protected:
+		pthread_mutex_t state_mutex;
+		// signalled whenever a node finishes, which may make new nodes executable or end the run
+		pthread_cond_t node_finished;
+
+		void worker ();
+		static void *worker_thread (void *executor);
+};
+
+// The batch executor runs one plan over many images, filling one row of a feature matrix per image.
+// The same row executor (serial or concurrent, depending on n_threads) is reused for every row.
+// When given at least n_threads images in memory (e.g. the tiles and rotations of one image), each row is a job instead:
+//   n_threads workers each run whole rows with their own serial executor, which keeps all the threads busy with no
+//   scheduling within the rows.
+class FeatureComputationPlanBatchExecutor {
+	public:
+		const FeatureComputationPlan *plan;
+		size_t n_threads;           // threads used to compute each row
+		// if not NULL, node executions are recorded here
+		ComputationPlanProfile *profile;
+		// if not NULL, used for scheduling the nodes of each row
+		const ComputationCostModel *cost_model;
+		// used by all of the threads (by default, the arena current when the executor was made)
+		PlaneArena *arena;
+		// if not NULL, called with the row number and row_finished_arg as soon as each row is computed.
+		// With row jobs, this is called from the worker threads, so it must be thread-safe.
+		void (*row_finished) (size_t row, void *row_finished_arg);
+		void *row_finished_arg;
+
+		// The feature_mat is grown if necessary to hold first_row + the number of images. Returns the number of rows computed.
+		size_t run (const std::vector<const ImageMatrix *> &sources, std::vector<double> &feature_mat, size_t first_row = 0);
+
+		FeatureComputationPlanBatchExecutor (const FeatureComputationPlan *plan_in, size_t n_threads_in = 1);
+		~FeatureComputationPlanBatchExecutor ();
+	protected:
+		FeatureComputationPlanExecutor *executor;
+
+		// state shared with the row workers, protected by rows_mutex
+		pthread_mutex_t rows_mutex;
+		const std::vector<const ImageMatrix *> *row_sources;
+		std::vector<double> *row_feature_mat;
+		size_t row_first_row, next_row;
+		void row_worker ();
+		static void *row_worker_thread (void *batch_executor);
+	private:
+		FeatureComputationPlanBatchExecutor();                                            // Don't implement
+		FeatureComputationPlanBatchExecutor(FeatureComputationPlanBatchExecutor const&);  // Don't Implement
+		void operator=(FeatureComputationPlanBatchExecutor const&);                      // Don't implement
+};
 
 class StdFeatureComputationPlans {
 	private:
@@ -365,6 +564,11 @@ class StdFeatureComputationPlans {
 		static const FeatureComputationPlan *getFeatureSetColor();
 		static const FeatureComputationPlan *getFeatureSetLong();
 		static const FeatureComputationPlan *getFeatureSetLongColor();
+		// one of the above, selected by the -l and -c options
+		static const FeatureComputationPlan *getFeatureSet (int large_set, int compute_colors);
+		// A plan read from a file with FeatureComputationPlan::read().  Each file is only read and validated once per process,
+		// so subsequent calls with the same path return the same plan.  Returns NULL if the plan can't be read.
+		static const FeatureComputationPlan *getFeatureSetFromFile (const std::string &path);
 		static void addLongFeatures (FeatureComputationPlan *the_plan, bool color);
 		static void addGroupAFeatures (FeatureComputationPlan *the_plan, std::string transform);
 		static void addGroupBFeatures (FeatureComputationPlan *the_plan, std::string transform);
@@ -121,12 +121,19 @@ bool AlmostEqual(float A, float B, int maxUlps)
 /* check if the file format is supported */
 int IsSupportedFormat(char *filename) {
 	char *char_p;
-	
+	std::string page_file;
+	int page;
+
+	// a page of a multi-page TIFF (see ImageMatrix::PagePath())
+	if (ImageMatrix::SplitPagePath (filename, page_file, page)) {
+		char_p = strrchr (&page_file[0],'.');
+		return (char_p && (!strcmp(char_p,".tif") || !strcmp(char_p,".TIF") || !strcmp(char_p,".tiff") || !strcmp(char_p,".TIFF")));
+	}
 	char_p = strrchr (filename,'.');
 	if (!char_p) return (0);
 	
 	if (!strcmp(char_p,".sig")) return(1);  /* ignore files the extension but are actually .sig files */
-	if (!strcmp(char_p,".tif") || !strcmp(char_p,".TIF") || !strcmp(char_p,".tiff") || !strcmp(char_p,".TIFF") || !strcmp(char_p,".ppm") || !strcmp(char_p,".PPM")) return(1);  /* process only image files */
+	if (!strcmp(char_p,".tif") || !strcmp(char_p,".TIF") || !strcmp(char_p,".tiff") || !strcmp(char_p,".TIFF") || !strcmp(char_p,".ppm") || !strcmp(char_p,".PPM") || !strcmp(char_p,".planes")) return(1);  /* process only image files */
   return(0);
 }
 
@@ -175,6 +182,7 @@ TrainingSet::TrainingSet(long samples_num, long class_num)
 
 	// set the version to 'unknown'
 	feature_vec_version = feature_vec_type = 0;
+	plan_hash = 0;
 }
 
 /* destructor of a training set object
@@ -314,9 +322,14 @@ int TrainingSet::AddSample(signatures *new_sample)
 				new_sample->GetFileName(buffer), new_sample->version, new_sample->feature_vec_type, feature_vec_version, feature_vec_type);
 			catError ("Delete .fit and .sig files generated by older versions of wndchrm and try again.\n");		
 		return (INCONSISTENT_FEATURE_VECTORS);
+	} else if (plan_hash && new_sample->plan_hash && plan_hash != new_sample->plan_hash) {
+			catError ("ERROR: Adding sample '%s' computed by feature computation plan %08lx to training set computed by plan %08lx.\n",
+				new_sample->GetFileName(buffer), new_sample->plan_hash, plan_hash);
+		return (INCONSISTENT_FEATURE_VECTORS);
 	} else {
 		feature_vec_version = new_sample->version;
 		feature_vec_type = new_sample->feature_vec_type;
+		if (new_sample->plan_hash) plan_hash = new_sample->plan_hash;
 	}
 	if (signature_count > 0)
 		signature_count = new_sample->count;
@@ -342,7 +355,9 @@ int TrainingSet::SaveToFile(char *filename)
    	catError ("Couldn't open '%s' for writing.\n");
    	return(0);
    }
-   fprintf(file,"%ld\t%d.%d\n",class_num,feature_vec_version,feature_vec_type);
+   fprintf(file,"%ld\t%d.%d",class_num,feature_vec_version,feature_vec_type);
+   if (plan_hash) fprintf(file,"\t%08lx",plan_hash);
+   fprintf(file,"\n");
    fprintf(file,"%ld\n",signature_count);
    fprintf(file,"%ld\n",count);
    /* write the signature names */
@@ -415,7 +430,8 @@ int TrainingSet::ReadFromFile(char *filename)
      if (samples[sample_index]) delete samples[sample_index];
    delete [] samples;
    fgets(buffer,sizeof(buffer),file);
-	sscanf (buffer, "%d%*[\t ]%d.%d", &file_class_num, &version_maj, &version_min);
+	plan_hash = 0;
+	sscanf (buffer, "%d%*[\t ]%d.%d%*[\t ]%lx", &file_class_num, &version_maj, &version_min, &plan_hash);
 	// If we did not read a version, then it is 1.0
 	if (version_maj == 0) {
 		feature_vec_version = 1;
@@ -470,6 +486,7 @@ int TrainingSet::ReadFromFile(char *filename)
 		chomp (buffer);
 		strcpy(one_sample->full_path,buffer);                     // copy the full path to the signatures object
 		one_sample->version = feature_vec_version;                // Since we are reading sigs from a fit file, the sig version is the same as fit version.
+		one_sample->plan_hash = plan_hash;
 		if ( (res=AddSample(one_sample)) < 0) {
 			for (sig_index=0;sig_index<sample_index;sig_index++) delete samples[sig_index];
 			delete [] samples;
@@ -823,7 +840,6 @@ int TrainingSet::AddAllSignatures() {
 		sample_class = sample->sample_class;
 		sample_value = sample->sample_value;
 		strcpy (buffer,sample->full_path);
-		sample->Clear();
 		// don't bother with locking except for the last sample.
 		// FIXME: this doesn't really work.
 		//    Easiest is some kind of global lock file for all processes, but that's unlikely.
@@ -831,7 +847,9 @@ int TrainingSet::AddAllSignatures() {
 
 		errno = 0;
 		res = 1;
+		// Samples that still have their sigs (i.e. computed with a pruned plan) have no sig file to read.
 		if (sample->count < 1) {
+			sample->Clear();
 			res = sample->ReadFromFile(1);
 		}
 
@@ -839,8 +857,15 @@ int TrainingSet::AddAllSignatures() {
 			sample->sample_class=sample_class; /* make sure the sample has the right class ID */
 			sample->sample_value=sample_value; /* read the continouos value */
 			strcpy (sample->full_path,buffer);
-			if ( (feature_vec_version && feature_vec_version != sample->version) || (feature_vec_type && feature_vec_type != sample->feature_vec_type) ) {
-				bad_versions << "\t" << sample->GetFileName(buffer) << "\t" << sample->version << "." << sample->feature_vec_type << "\n";
+			if ( (feature_vec_version && feature_vec_version != sample->version) || (feature_vec_type && feature_vec_type != sample->feature_vec_type) ||
+				(plan_hash && sample->plan_hash && plan_hash != sample->plan_hash) ) {
+				bad_versions << "\t" << sample->GetFileName(buffer) << "\t" << sample->version << "." << sample->feature_vec_type;
+				if (sample->plan_hash) {
+					char hash_buf[32];
+					sprintf (hash_buf, "%08lx", sample->plan_hash);
+					bad_versions << " (plan " << hash_buf << ")";
+				}
+				bad_versions << "\n";
 				read_error = INCONSISTENT_FEATURE_VECTORS;
 			}
 			// FIXME: Its not enough that there's more than one, the count has to match.
@@ -1096,6 +1121,10 @@ int TrainingSet::LoadFromPath(char *path, int save_sigs, featureset_t *featurese
 			// We need to have a sorted list of classes, and add them in order, yet we want to keep the samples in file order.
 			// The alternative is to read the file once, and accomplish two passes by holding all of its relevant contents in memory.
 			// Or worse, sort the classes and reindex the samples as we go.
+			// The samples are collected first, so the images can be loaded in the background while the sigs are computed.
+			std::vector<std::string> file_names;
+			std::vector<int> file_classes;
+			std::vector<double> file_values;
 			// reset the system error
 				errno = 0;
 			while (fgets(buffer,sizeof(buffer),input_file)) {
@@ -1126,13 +1155,22 @@ int TrainingSet::LoadFromPath(char *path, int save_sigs, featureset_t *featurese
 					samp_val = 0;
 				}
 	
+				file_names.push_back (filename);
+				file_classes.push_back (file_class_num);
+				file_values.push_back (samp_val);
+			} // while reading file of filenames
+			fclose (input_file);
+
+			int n_load_threads = featureset->preproc_opts.n_load_threads;
+			ImagePrefetcher prefetcher (file_names, featureset, n_load_threads, 2 * n_load_threads);
+			for (size_t file_index = 0; file_index < file_names.size(); file_index++) {
+				snprintf (filename,sizeof(filename),"%s",file_names[file_index].c_str());
+				prefetcher.advance (file_index);
 			// reset the system error
 				errno = 0;
-				res = AddImageFile(filename, file_class_num, samp_val, save_sigs, featureset, skip_sig_comparison_check);
+				res = AddImageFile(filename, file_classes[file_index], file_values[file_index], save_sigs, featureset, skip_sig_comparison_check, &prefetcher);
 				if (res < 0) return (res);
-	
-			} // while reading file of filenames
-			fclose (input_file);
+			}
 	
 		// Finally, we need to make sure all the classes we created have some samples
 			for (class_index=1;class_index<class_num;class_index++) {
@@ -1183,6 +1221,208 @@ int TrainingSet::LoadFromPath(char *path, int save_sigs, featureset_t *featurese
 
 
 
+ImagePrefetcher::ImagePrefetcher (const std::vector<std::string> &paths_in, const featureset_t *featureset_in, size_t n_threads, size_t depth_in) {
+	paths = paths_in;
+	featureset = featureset_in;
+	depth = depth_in > 0 ? depth_in : 1;
+	current = next_load = 0;
+	stopping = false;
+	arena = PlaneArena::current();
+	pthread_mutex_init (&mutex, NULL);
+	pthread_cond_init (&loaded, NULL);
+	pthread_cond_init (&advanced, NULL);
+	if (n_threads < 1 || paths.empty()) return;
+
+	entry_t empty_entry = {std::vector<std::string>(), std::vector<ImageMatrix *>(), false};
+	entries.assign (paths.size(), empty_entry);
+	for (size_t i = 0; i < n_threads && i < paths.size(); i++) {
+		pthread_t thread_id;
+		if (pthread_create (&thread_id, NULL, loader_thread, this) == 0) threads.push_back (thread_id);
+	}
+}
+
+ImagePrefetcher::~ImagePrefetcher () {
+	pthread_mutex_lock (&mutex);
+	stopping = true;
+	pthread_cond_broadcast (&advanced);
+	pthread_cond_broadcast (&loaded);
+	pthread_mutex_unlock (&mutex);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join (threads[i], NULL);
+	for (size_t i = 0; i < entries.size(); i++)
+		drop (entries[i]);
+	pthread_cond_destroy (&advanced);
+	pthread_cond_destroy (&loaded);
+	pthread_mutex_destroy (&mutex);
+}
+
+void ImagePrefetcher::drop (entry_t &entry) {
+	for (size_t i = 0; i < entry.images.size(); i++) {
+		delete entry.images[i];
+		entry.images[i] = NULL;
+	}
+}
+
+void *ImagePrefetcher::loader_thread (void *prefetcher) {
+	static_cast<ImagePrefetcher *>(prefetcher)->loader();
+	return (NULL);
+}
+
+// Each loader takes the next file within depth of the current one.  Files the consumer has moved past are dropped.
+void ImagePrefetcher::loader () {
+	PlaneArena::set_current (arena);
+	size_t index;
+
+	pthread_mutex_lock (&mutex);
+	while (!stopping && next_load < entries.size()) {
+		if (next_load >= current + depth) {
+			pthread_cond_wait (&advanced, &mutex);
+			continue;
+		}
+		index = next_load++;
+		pthread_mutex_unlock (&mutex);
+
+		entry_t entry = {std::vector<std::string>(), std::vector<ImageMatrix *>(), true};
+		load (paths[index], entry);
+
+		pthread_mutex_lock (&mutex);
+		entries[index] = entry;
+		if (index < current || stopping) drop (entries[index]);
+		pthread_cond_broadcast (&loaded);
+	}
+	pthread_mutex_unlock (&mutex);
+}
+
+void ImagePrefetcher::load (const std::string &path, entry_t &entry) const {
+	int n_pages = ImageMatrix::TIFFPages (path.c_str());
+	if (n_pages > 1) {
+		for (int page = 0; page < n_pages; page++)
+			entry.paths.push_back (ImageMatrix::PagePath (path.c_str(), page));
+	} else {
+		entry.paths.push_back (path);
+	}
+
+	const preproc_opts_t &preproc_opts = featureset->preproc_opts;
+	for (size_t i = 0; i < entry.paths.size(); i++) {
+		ImageMatrix *image_matrix = NULL;
+		if (needed (entry.paths[i])) {
+			// OpenImage wants non-const arguments
+			std::vector<char> path_buf (entry.paths[i].begin(), entry.paths[i].end());
+			path_buf.push_back ('\0');
+			rect bounding_rect = preproc_opts.bounding_rect;
+			image_matrix = new ImageMatrix;
+			if (image_matrix->OpenImage (&path_buf[0], preproc_opts.downsample, &bounding_rect, (double)preproc_opts.mean, (double)preproc_opts.stddev) < 1) {
+				delete image_matrix;
+				image_matrix = NULL;
+			}
+		}
+		entry.images.push_back (image_matrix);
+	}
+}
+
+// The image is needed if any of its sig files doesn't exist.  AddImageFile() only computes the sigs it can lock, which it
+// can't if the sig file exists.  Recomputing for the feature drift report needs all of the images.
+bool ImagePrefetcher::needed (const std::string &path) const {
+	char buffer[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1];
+	struct stat sig_st;
+	signatures sig;
+
+	if (featureset->feature_opts.drift || path.length() >= IMAGE_PATH_LENGTH) return (true);
+	strcpy (sig.full_path, path.c_str());
+	for (int sample_index = 0; sample_index < featureset->n_samples; sample_index++) {
+		strcpy (sig.sample_name, featureset->samples[sample_index].sample_name);
+		if (stat (sig.GetFileName (buffer), &sig_st) != 0) return (true);
+	}
+	return (false);
+}
+
+void ImagePrefetcher::advance (size_t index) {
+	pthread_mutex_lock (&mutex);
+	for (size_t i = current; i < index && i < entries.size(); i++)
+		drop (entries[i]);
+	current = index;
+	if (next_load < current) next_load = current;
+	pthread_cond_broadcast (&advanced);
+	pthread_mutex_unlock (&mutex);
+}
+
+ImageMatrix *ImagePrefetcher::take (const char *path) {
+	ImageMatrix *image_matrix = NULL;
+
+	if (threads.empty()) return (NULL);
+	pthread_mutex_lock (&mutex);
+	if (current < entries.size()) {
+		entry_t &entry = entries[current];
+		while (!entry.done && !stopping)
+			pthread_cond_wait (&loaded, &mutex);
+		for (size_t i = 0; i < entry.paths.size(); i++) {
+			if (entry.paths[i] == path) {
+				image_matrix = entry.images[i];
+				entry.images[i] = NULL;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock (&mutex);
+	return (image_matrix);
+}
+
+ImageSampler::ImageSampler (const ImageMatrix &image_in, const featureset_t *featureset) : image (image_in) {
+	tiles_x = featureset->sampling_opts.tiles_x;
+	tiles_y = featureset->sampling_opts.tiles_y;
+	image_w = image_h = origin_x = origin_y = 0;
+}
+
+ImageSampler::~ImageSampler () {
+	clear ();
+}
+
+void ImageSampler::set_loaded_area (long image_w_in, long image_h_in, long origin_x_in, long origin_y_in) {
+	image_w = image_w_in;
+	image_h = image_h_in;
+	origin_x = origin_x_in;
+	origin_y = origin_y_in;
+}
+
+const ImageMatrix *ImageSampler::sample (int rot_index, int tile_index_x, int tile_index_y) {
+	const ImageMatrix *rot_matrix_p = &image;
+	if (rot_index > 0) {
+		if ((size_t)rot_index >= rotations.size()) rotations.resize (rot_index + 1, NULL);
+		if (!rotations[rot_index]) {
+			rotations[rot_index] = new ImageMatrix;
+			rotations[rot_index]->Rotate (image, 90.0 * rot_index);
+		}
+		rot_matrix_p = rotations[rot_index];
+	}
+	if (tiles_x * tiles_y == 1) return (rot_matrix_p);
+
+	long tile_x_size;
+	long tile_y_size;
+	long rot_w = rot_matrix_p->width, rot_h = rot_matrix_p->height;
+	if (image_w) {
+		rot_w = image_w;
+		rot_h = image_h;
+	}
+	// the rotation's own width and height are tiled, so rotations 1 and 3 of a non-square image or tiling stay within it
+	tile_x_size=(long)(rot_w/tiles_x);
+	tile_y_size=(long)(rot_h/tiles_y);
+	ImageMatrix *tile_matrix_p = new ImageMatrix;
+	tile_matrix_p->submatrix_view (*rot_matrix_p,
+		tile_index_x*tile_x_size-origin_x,tile_index_y*tile_y_size-origin_y,
+		(tile_index_x+1)*tile_x_size-1-origin_x,(tile_index_y+1)*tile_y_size-1-origin_y);
+	tiles.push_back (tile_matrix_p);
+	return (tile_matrix_p);
+}
+
+void ImageSampler::clear () {
+	for (size_t i = 0; i < tiles.size(); i++)
+		delete tiles[i];
+	tiles.clear();
+	for (size_t i = 0; i < rotations.size(); i++)
+		delete rotations[i];
+	rotations.clear();
+}
+
 /* LoadFromFilesDir
    load images from the specified path, assigning them to the specified class, giving them the specified value
      Both can be 0 if the class is unknown
@@ -1253,10 +1493,17 @@ int TrainingSet::LoadFromFilesDir(char *path, unsigned short sample_class, doubl
 		
 	// N.B.: A call to AddClass must already have occurred, otherwise AddSample called from AddImageFile will fail.
 
-	// Process the files in sort order
+	// Process the files in sort order, with the next ones loaded in the background
+	std::vector<std::string> paths_vec;
+	paths_vec.reserve (n_img_basenames);
+	for (file_index=0; file_index<n_img_basenames; file_index++)
+		paths_vec.push_back (std::string(path) + "/" + base_names_vec[file_index]);
+	int n_load_threads = featureset->preproc_opts.n_load_threads;
+	ImagePrefetcher prefetcher (paths_vec, featureset, n_load_threads, 2 * n_load_threads);
 	for (file_index=0; file_index<n_img_basenames; file_index++) {
 		sprintf(buffer,"%s/%s",path,base_names_vec[file_index].c_str());
-		res = AddImageFile(buffer, sample_class, sample_value, save_sigs, featureset, skip_sig_comparison_check);
+		prefetcher.advance (file_index);
+		res = AddImageFile(buffer, sample_class, sample_value, save_sigs, featureset, skip_sig_comparison_check, &prefetcher);
 		if (res < 0) return (res);
 		else files_in_class_count += res; // May be zero
 	}
@@ -1294,7 +1541,7 @@ int TrainingSet::LoadFromFilesDir(char *path, unsigned short sample_class, doubl
 */
 
  
-int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check ) {
+int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check, ImagePrefetcher *prefetcher ) {
 	int res=0;
 	int sample_index;
 	signatures *ImageSignatures;
@@ -1302,24 +1549,29 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	int sig_index,n_sigs=0;
 
 	std::vector<feature_vec_info_t> our_sigs;
-	feature_vec_info_t null_sig_info = {NULL,-1, -1, -1, false, false};
+	feature_vec_info_t null_sig_info = {NULL,-1, -1, -1, false, false, NULL};
 	
-	// get a feature calculation plan based on our featureset
-	const FeatureComputationPlan *feature_plan;
-	if (featureset->feature_opts.large_set) {
-		if (featureset->feature_opts.compute_colors) {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetLongColor();
-		} else {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetLong();
-		}
-	} else {
-		if (featureset->feature_opts.compute_colors) {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetColor();
-		} else {
-			feature_plan = StdFeatureComputationPlans::getFeatureSet();
+	// The pages of a multi-page TIFF are added as separate images (see ImageMatrix::PagePath())
+	std::string page_file;
+	int page, n_pages = 0;
+	if (!ImageMatrix::SplitPagePath (filename, page_file, page) && (n_pages = ImageMatrix::TIFFPages (filename)) > 1) {
+		for (page = 0; page < n_pages; page++) {
+			std::string page_path = ImageMatrix::PagePath (filename, page);
+			if (page_path.length() >= IMAGE_PATH_LENGTH) {
+				catError ("Path of page %d of '%s' is too long.\n",page,filename);
+				return (-1);
+			}
+			strcpy (buffer,page_path.c_str());
+			if ( (res = AddImageFile (buffer, sample_class, sample_value, save_sigs, featureset, skip_sig_comparison_check, prefetcher)) < 0) break;
 		}
+		return (res);
 	}
 
+	// get a feature calculation plan based on our featureset
+	const FeatureComputationPlan *feature_plan = featureset->feature_opts.plan;
+	if (!feature_plan)
+		feature_plan = StdFeatureComputationPlans::getFeatureSet (featureset->feature_opts.large_set, featureset->feature_opts.compute_colors);
+
 
 // pre-determine sig files for this image.
 // Primarily, this lets us pre-lock all the signature files for one image (see below).
@@ -1383,6 +1635,18 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 			ImageSignatures->sample_value=sample_value;
 			if (verbosity>=2) printf ("Sig '%s' read in.\n",ImageSignatures->GetFileName(buffer));
 			if ( (res=AddSample(ImageSignatures)) < 0) break;
+		// recompute it as well to report the feature drift from the saved sigs.
+			if (featureset->feature_opts.drift) {
+				our_sigs[n_sigs].sig = new signatures ();
+				strcpy (our_sigs[n_sigs].sig->full_path,filename);
+				strcpy (our_sigs[n_sigs].sig->sample_name,ImageSignatures->sample_name);
+				our_sigs[n_sigs].rot_index = featureset->samples[sample_index].rot_index;
+				our_sigs[n_sigs].tile_index_x = featureset->samples[sample_index].tile_index_x;
+				our_sigs[n_sigs].tile_index_y = featureset->samples[sample_index].tile_index_y;
+				our_sigs[n_sigs].drift_ref = ImageSignatures;
+				our_sigs.push_back (null_sig_info);
+				n_sigs++;
+			}
 		}
 	}
 	
@@ -1404,13 +1668,57 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	// Lazy loading could have been done while generating the sampling parameters above, but this lets us pre-obtain file locks
 	// for all the sigs we will calculate.  The code separation b/w sampling parameter setup and the sampling itself points to
 	// doing this in a more general way with functional programming (or some other technique).
-	ImageMatrix *rot_matrix_p=NULL, *tile_matrix_p=NULL;
-	ImageMatrix image_matrix, rot_matrix, tile_matrix;
-	int rot_matrix_indx=0;
+	// The samples are prepared first, then their features are computed together so that the samples (rather than the nodes
+	// of one sample's plan) are the jobs for the threads.  Sig files are saved on a background thread as the samples finish.
+	ImageMatrix image_matrix;
+	const ImageMatrix *tile_matrix_p=NULL;
+	ImageSampler sampler (image_matrix, featureset);
 	int tiles_x = featureset->sampling_opts.tiles_x, tiles_y = featureset->sampling_opts.tiles_y, tiles = tiles_x * tiles_y;
 	preproc_opts_t *preproc_opts = &(featureset->preproc_opts);
 	feature_opts_t *feature_opts = &(featureset->feature_opts);
 	int rot_index,tile_index_x,tile_index_y;
+	std::vector<bool> converted (n_sigs, false); // read from an old-style sig file instead of computed
+	std::vector<signatures *> compute_sigs;
+	std::vector<const ImageMatrix *> compute_matrices;
+	std::vector<signatures *> drift_sigs;
+	std::vector<const ImageMatrix *> drift_matrices;
+	SigFileWriter sig_writer (1);
+
+	// If the tiles we need are of an unrotated, unscaled image, only the area they cover is loaded (see LoadTIFF()).
+	// The tiles are still sized from the whole image (or its bounding rect), so they are the same as they would be if it was loaded.
+	rect load_rect = preproc_opts->bounding_rect;
+	long image_w = 0, image_h = 0, origin_x = 0, origin_y = 0;
+	bool load_tiles_only = false;
+	unsigned int file_w, file_h;
+	if (tiles != 1 && n_sigs > 0 && preproc_opts->mean <= 0 && !(preproc_opts->downsample > 0 && preproc_opts->downsample < 100)
+		&& ImageMatrix::ImageSize (filename, file_w, file_h)) {
+		rect area = {0, 0, (int)file_w, (int)file_h};
+		bool unrotated = true;
+		for (sig_index = 0; sig_index < n_sigs; sig_index++)
+			if (our_sigs[sig_index].rot_index != 0) unrotated = false;
+		if (load_rect.x >= 0) area = load_rect;
+		long tile_x_size = area.w / tiles_x, tile_y_size = area.h / tiles_y;
+		if (unrotated && tile_x_size > 0 && tile_y_size > 0 && area.x >= 0 && area.y >= 0
+			&& area.x + area.w <= (int)file_w && area.y + area.h <= (int)file_h) {
+			int first_x = tiles_x, first_y = tiles_y, last_x = 0, last_y = 0;
+			for (sig_index = 0; sig_index < n_sigs; sig_index++) {
+				first_x = MIN (first_x, our_sigs[sig_index].tile_index_x);
+				first_y = MIN (first_y, our_sigs[sig_index].tile_index_y);
+				last_x = MAX (last_x, our_sigs[sig_index].tile_index_x);
+				last_y = MAX (last_y, our_sigs[sig_index].tile_index_y);
+			}
+			image_w = area.w;
+			image_h = area.h;
+			origin_x = first_x * tile_x_size;
+			origin_y = first_y * tile_y_size;
+			load_rect.x = area.x + origin_x;
+			load_rect.y = area.y + origin_y;
+			load_rect.w = (last_x - first_x + 1) * tile_x_size;
+			load_rect.h = (last_y - first_y + 1) * tile_y_size;
+			load_tiles_only = true;
+		}
+	}
+
 	for (sig_index = 0; sig_index < n_sigs; sig_index++) {
 		ImageSignatures = our_sigs[sig_index].sig;
 		rot_index = our_sigs[sig_index].rot_index;
@@ -1426,36 +1734,25 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 		// One of these could be reachable if the image is not in the same directory as the sigs.
 		// There is no support for this now though - its an error for the image not to exist together with the sigs
 		// if we need to open the image to recalculate sigs (which we only need if one or more sigs is missing).
-			if ( (res = image_matrix.OpenImage(filename,preproc_opts->downsample,&(preproc_opts->bounding_rect),(double)preproc_opts->mean,(double)preproc_opts->stddev)) < 1) {
+		// A prefetched image is the whole image (or its bounding rect), so the tiles are taken from it as usual.
+			ImageMatrix *prefetched = prefetcher ? prefetcher->take (filename) : NULL;
+			if (prefetched) {
+				image_matrix.take (*prefetched);
+				delete prefetched;
+				res = 1;
+			} else if ( (res = image_matrix.OpenImage(filename,preproc_opts->downsample,&load_rect,(double)preproc_opts->mean,(double)preproc_opts->stddev)) < 1) {
 				catError ("Could not read image file '%s' to recalculate sigs.\n",filename);
 				res = -1; // make sure its negative for cleanup below
 				break;
+			} else if (load_tiles_only) {
+				sampler.set_loaded_area (image_w, image_h, origin_x, origin_y);
 			}
 		}
-		if (rot_index > 0) {
-			rot_matrix.Rotate (image_matrix, 90.0 * rot_index);
-			rot_matrix_indx = rot_index;
-			rot_matrix_p = &rot_matrix;
-		} else {
-			rot_matrix_p = &image_matrix;
-			rot_matrix_indx = 0;
-		}
-		if (tiles != 1) {
-			long tile_x_size;
-			long tile_y_size;
-			if (rot_index == 1 || rot_index == 3) {
-				tile_y_size=(long)(rot_matrix_p->width/tiles_x);
-				tile_x_size=(long)(rot_matrix_p->height/tiles_y);
-			} else {
-				tile_x_size=(long)(rot_matrix_p->width/tiles_x);
-				tile_y_size=(long)(rot_matrix_p->height/tiles_y);
-			}
-			tile_matrix.submatrix (*rot_matrix_p,
-				tile_index_x*tile_x_size,tile_index_y*tile_y_size,
-				(tile_index_x+1)*tile_x_size-1,(tile_index_y+1)*tile_y_size-1);
-			tile_matrix_p = &tile_matrix;
-		} else {
-			tile_matrix_p = rot_matrix_p;
+		tile_matrix_p = sampler.sample (rot_index, tile_index_x, tile_index_y);
+		if (our_sigs[sig_index].drift_ref) {
+			drift_sigs.push_back (ImageSignatures);
+			drift_matrices.push_back (tile_matrix_p);
+			continue;
 		}
 // 
 // 		// Dump the sample as a tiff
@@ -1475,6 +1772,7 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 		if ( (char_p = strrchr (old_sig_filename,'.')) ) *char_p = '\0';
 		else char_p = old_sig_filename+strlen(old_sig_filename);
 		sprintf (char_p,"_%d_%d.sig",tile_index_x,tile_index_y);
+		res = 0;
 		if( skip_sig_comparison_check || (res=ImageSignatures->CompareToFile(*tile_matrix_p,old_sig_filename,feature_opts->compute_colors,feature_opts->large_set)) ) {
 			ImageSignatures->LoadFromFile (old_sig_filename);
 			if (ImageSignatures->count < 1) {
@@ -1487,18 +1785,49 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 				ImageSignatures->sample_value=sample_value;
 
 				unlink (old_sig_filename);
+				res = 1;
 			}
 		}
 
 	// all hope is lost - compute sigs.
 		if (!res) {
-			ImageSignatures->compute_plan (*tile_matrix_p, feature_plan);
+			compute_sigs.push_back (ImageSignatures);
+			compute_matrices.push_back (tile_matrix_p);
+		} else {
+			converted[sig_index] = true;
+			sig_writer.save (ImageSignatures);
 		}
+	}
+
 	// we're saving sigs always now...
 	// But we're not releasing the lock yet - we'll release all the locks for the whole image later.
 	// This doesn't call close on our file, which would release the lock.
-		ImageSignatures->SaveToFile (1);
-		our_sigs[sig_index].saved = true;
+	// Sigs computed with a pruned plan are incomplete, so they are not saved, and the empty sig file is unlinked below.
+	if (res >= 0 && compute_sigs.size()) {
+		signatures::compute_plan (compute_sigs, compute_matrices, feature_plan, featureset->feature_opts.n_threads,
+			feature_opts->profile, feature_opts->cost_model, feature_plan->pruned ? NULL : &sig_writer);
+	}
+	if (res >= 0 && drift_sigs.size()) {
+		signatures::compute_plan (drift_sigs, drift_matrices, feature_plan, featureset->feature_opts.n_threads,
+			feature_opts->profile, feature_opts->cost_model);
+	}
+	sig_writer.finish ();
+	sampler.clear ();
+
+	// The samples are added in their original order
+	for (sig_index = 0; res >= 0 && sig_index < n_sigs; sig_index++) {
+		ImageSignatures = our_sigs[sig_index].sig;
+		if (our_sigs[sig_index].drift_ref) {
+			feature_opts->drift->add (*ImageSignatures, *(our_sigs[sig_index].drift_ref), feature_plan);
+			our_sigs[sig_index].saved = true; // the sig file is drift_ref's
+			continue;
+		}
+		if (converted[sig_index] || !feature_plan->pruned) {
+			our_sigs[sig_index].saved = true;
+		} else {
+		// the values are the same as they would be if read back from a sig file
+			ImageSignatures->RoundToFile ();
+		}
 		if ( (res=AddSample(ImageSignatures)) < 0) {
 			break;
 		}
@@ -1510,7 +1839,8 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	for (sig_index = 0; sig_index < n_sigs; sig_index++) {
 		if (our_sigs[sig_index].sig) {
 			our_sigs[sig_index].sig->FileClose ();
-			our_sigs[sig_index].sig->Clear ();
+			// unsaved sigs are kept, since AddAllSignatures() can't read them back in
+			if (our_sigs[sig_index].saved) our_sigs[sig_index].sig->Clear ();
 			if (!our_sigs[sig_index].saved) {
 				unlink (our_sigs[sig_index].sig->GetFileName(buffer));
 			}
@@ -1570,7 +1900,8 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 		// Make sure that the sample feature vector is compatible with the training set
 		// This check is redundant with the one in wndchrm.cpp
 		if ( (ts_selector->feature_vec_version && ts_selector->feature_vec_version != TestSet->samples[ tile_index ]->version) ||
-			(ts_selector->feature_vec_type && ts_selector->feature_vec_type != TestSet->samples[ tile_index ]->feature_vec_type) ) {
+			(ts_selector->feature_vec_type && ts_selector->feature_vec_type != TestSet->samples[ tile_index ]->feature_vec_type) ||
+			(ts_selector->plan_hash && TestSet->samples[ tile_index ]->plan_hash && ts_selector->plan_hash != TestSet->samples[ tile_index ]->plan_hash) ) {
 				fprintf (stderr, "ERROR: Classifying sample '%s' with feature vector version %d.%d to training set with feature vector versions %d.%d.\n",
 					TestSet->samples[ tile_index ]->GetFileName(last_path),
 					TestSet->samples[ tile_index ]->version, TestSet->samples[ tile_index ]->feature_vec_type,
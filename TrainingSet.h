@@ -73,6 +73,7 @@ typedef struct {
 	char normalize_base[16];
 	int mean;
 	int stddev;
+	int n_load_threads; // threads opening images ahead of the one being processed (see ImagePrefetcher, not part of the sample name)
 } preproc_opts_t;
 
 typedef struct {
@@ -88,6 +89,12 @@ typedef struct {
 	int compute_colors;
 	char large_set_base[16]; // CLI option+params
 	int large_set;
+	char plan_base[16]; // CLI option+params
+	int n_threads; // number of threads used to compute features for each sample (not part of the sample name)
+	const FeatureComputationPlan *plan; // if not NULL, used instead of the standard plan for large_set and compute_colors
+	ComputationPlanProfile *profile; // if not NULL, feature computation is profiled here
+	ComputationCostModel *cost_model; // if not NULL, used to schedule multi-threaded feature computation
+	FeatureDriftReport *drift; // if not NULL, samples read from sig files are also recomputed and compared here
 } feature_opts_t;
 
 typedef struct {
@@ -104,6 +111,64 @@ typedef struct {
 	} samples[MAX_SAMPLES_PER_IMAGE];	
 } featureset_t;
 
+// Opens and decodes the images in a list of files on background threads, so that reading and decoding the next images
+// overlaps with computing the features of the current one.  Images whose sig files all exist (computed, or locked by another
+// process computing them) are skipped without being opened.  The pages of a multi-page TIFF are loaded together.
+// Files are loaded at most depth files ahead of the current one (see advance()).  With no threads, nothing is loaded.
+class ImagePrefetcher {
+  public:
+	ImagePrefetcher (const std::vector<std::string> &paths_in, const featureset_t *featureset_in, size_t n_threads, size_t depth_in);
+	~ImagePrefetcher (); // stops the threads, and deletes the images that weren't taken
+	// paths[index] is the current file.  The images of the files before it that weren't taken are deleted.
+	void advance (size_t index);
+	// The image of path (the current file, or one of its pages), or NULL if it wasn't loaded.  The caller owns it.
+	ImageMatrix *take (const char *path);
+  private:
+	struct entry_t {
+		std::vector<std::string> paths; // the file, or its pages
+		std::vector<ImageMatrix *> images;
+		bool done;
+	};
+	std::vector<std::string> paths;
+	std::vector<entry_t> entries;
+	const featureset_t *featureset;
+	size_t depth, current, next_load;
+	bool stopping;
+	PlaneArena *arena;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded, advanced;
+	void loader ();
+	static void *loader_thread (void *prefetcher);
+	void load (const std::string &path, entry_t &entry) const;
+	bool needed (const std::string &path) const;
+	static void drop (entry_t &entry);
+	ImagePrefetcher(ImagePrefetcher const&);  // Don't Implement
+	void operator=(ImagePrefetcher const&); // Don't implement
+};
+
+// Makes the samples of one image for the rotations and tiles of a featureset.  Each rotation is made once, and kept
+// since it is either a sample itself or its tiles are views of it.  The samples are valid until clear() or the destructor.
+// If only the area of some tiles of an unrotated image was loaded, set_loaded_area() gives the size of the whole image
+// (or its bounding rect) that the tiles are sized from, and the origin of the loaded area in it.
+class ImageSampler {
+  public:
+	ImageSampler (const ImageMatrix &image_in, const featureset_t *featureset);
+	~ImageSampler (); // calls clear()
+	void set_loaded_area (long image_w_in, long image_h_in, long origin_x_in, long origin_y_in);
+	// The sample for a rotation (0 to 3) and tile of the image
+	const ImageMatrix *sample (int rot_index, int tile_index_x, int tile_index_y);
+	void clear (); // deletes the rotations and tiles
+  private:
+	const ImageMatrix &image;
+	int tiles_x, tiles_y;
+	long image_w, image_h, origin_x, origin_y; // image_w is 0 if the whole image was loaded
+	std::vector<ImageMatrix *> rotations;      // by rot_index, NULL until needed
+	std::vector<ImageMatrix *> tiles;
+	ImageSampler(ImageSampler const&);      // Don't Implement
+	void operator=(ImageSampler const&);    // Don't implement
+};
+
 
 // Set up our struct for keeping track of per-feature-group statistics.
 class FeatureGroup;
@@ -144,6 +209,7 @@ typedef struct {
 	int tile_index_y;
 	bool saved;
 	bool added;
+	const signatures *drift_ref; // if not NULL, sig is recomputed only to compare with these saved sigs
 } feature_vec_info_t;
 
 typedef std::vector<feature_stats_t> features_t;
@@ -183,6 +249,7 @@ public:
 	char name[256];                       /* Name of dataset - source_path from last '/' to last '.'    */
 	char source_path[256];                       /* Path we read this set from     */
 	int feature_vec_version, feature_vec_type; // from the signatures class
+	unsigned long plan_hash;                   // from the signatures class (0 if unknown)
    signatures **samples;                                           /* samples data                              */
    char SignatureNames[MAX_SIGNATURE_NUM][SIGNATURE_NAME_LENGTH];  /* names of the signatures (e.g. "MultiScale Histogram bin 3) */
    double SignatureWeights[MAX_SIGNATURE_NUM];                     /* weights of the samples                    */
@@ -203,7 +270,7 @@ public:
    TrainingSet(long samples_num, long class_num);                  /* constructor                               */
    ~TrainingSet();                                                 /* destructor                                */
    int AddAllSignatures();                                         /* load the sample feature values from corresponding files */
-	int AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check = 0);
+	int AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check = 0, ImagePrefetcher *prefetcher = NULL);
 	int LoadFromFilesDir(char *path, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check = 0);
 	int LoadFromPath(char *path, int save_sigs, featureset_t *featureset, int make_continuous, int skip_sig_comparison_check = 0);
    double ClassifyImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile,int rank, data_split *split, double *similarities);  /* classify one or more images */
@@ -32,6 +32,7 @@
 // wf.status should be checked for WORM_STALE, indicating an empty file without an active write-lock.
 
 #include "WORMfile.h"
+#include <algorithm> // std::swap
 #define OPEN_RETRIES 36
 #define MAX_WAIT_MULT 8192 // must be smaller than RAND_MAX, which is a minimum of 32767
 
@@ -117,6 +118,17 @@ FILE *WORMfile::fp () {
 	return (_fp);
 }
 
+// fcntl locks belong to the process rather than to an object, so the descriptors can simply trade places.
+void WORMfile::swap (WORMfile &other) {
+	std::swap (status, other.status);
+	std::swap (status_errno, other.status_errno);
+	path.swap (other.path);
+	std::swap (read_mode, other.read_mode);
+	std::swap (_fd, other._fd);
+	std::swap (_fp, other._fp);
+	std::swap (_read_mode, other._read_mode);
+}
+
 void WORMfile::finish (bool reopen) {
 
 	if (_fp < 0) return;
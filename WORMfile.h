@@ -87,6 +87,8 @@ public:
 	// so the status should be checked if reopen is true.
 	// N.B.: This must be called before calling the destructor if the file was opened for writing!
 	void finish (bool reopen = false);
+	// Exchanges the files (and their locks) of two WORMfiles.
+	void swap (WORMfile &other);
 
 private:
 	int _fd;
@@ -28,6 +28,7 @@
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 #include <vector>
+#include <algorithm>
 #include <math.h>
 #include <stdio.h>
 #include "cmatrix.h"
@@ -57,10 +58,17 @@
 #include <sys/stat.h>
 #include <sys/types.h> // for dev_t, ino_t
 #include <fcntl.h>     // for O_RDONLY
+#include <sys/mman.h>  // mmap
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ctype.h>  // isdigit
+#include <limits.h> // INT_MAX
 
 #include <stdlib.h>
 #include <string.h>
 #include <tiffio.h>
+#include <pthread.h>
 
 
 using namespace std;
@@ -77,125 +85,543 @@ extern int verbosity;
 
 
 
+// Tables for converting 8-bit RGB to gray and HSV, giving the same results as RGB2GRAY() and RGB2HSV().
+// v only depends on the max of the channels, and s on the max and min, so they're looked up.
+// The gray level is the sum of three per-channel products, in the same order as RGB2GRAY().
+// The hue computed in doubles depends on all three channels (a table would need 2^24 entries), so it is still computed,
+// but only for pixels that have a saturation.
+static byte rgb_v_table[256];
+static byte rgb_s_table[256][256]; // [max][min]
+static double rgb_gray_table[3][256];
+static pthread_once_t rgb_tables_once = PTHREAD_ONCE_INIT;
+static void InitRGBTables() {
+	for (int max = 0; max < 256; max++) {
+		double max_d = (double)max / 255;
+		rgb_v_table[max] = (byte)(max_d*240.0);
+		for (int min = 0; min <= max; min++) {
+			double delta = max_d - (double)min / 255;
+			rgb_s_table[max][min] = (max != 0 ? (byte)((delta / max_d)*240.0) : 0);
+		}
+	}
+	for (int i = 0; i < 256; i++) {
+		rgb_gray_table[0][i] = 0.2989*i;
+		rgb_gray_table[1][i] = 0.5870*i;
+		rgb_gray_table[2][i] = 0.1140*i;
+	}
+}
+
+// Converts a row of n interleaved 8-bit RGB pixels (spp bytes per pixel) to gray and HSV rows.
+static void RGB2HSV_row (const byte *rgb, const unsigned int spp, const unsigned int n, pixel_t *gray, byte *h_row, byte *s_row, byte *v_row) {
+	pthread_once (&rgb_tables_once, InitRGBTables);
+	for (unsigned int x = 0; x < n; x++, rgb += spp) {
+		const byte R = rgb[0], G = rgb[1], B = rgb[2];
+		const byte max = MAX (R, MAX (G, B)), min = MIN (R, MIN (G, B));
+		gray[x] = rgb_gray_table[0][R] + rgb_gray_table[1][G] + rgb_gray_table[2][B];
+		v_row[x] = rgb_v_table[max];
+		s_row[x] = rgb_s_table[max][min];
+		if (s_row[x] == 0) h_row[x] = 0;
+		else {
+			RGBcolor rgb_pixel = {R, G, B};
+			h_row[x] = RGB2HSV (rgb_pixel).h;
+		}
+	}
+}
+
+// TIFF decoding:  Images are decoded a strip or a tile (a block) at a time, and each block's samples are converted
+// into the planes as soon as it is decoded.  The blocks don't depend on each other, so they are handed out to
+// the decode threads (see SetDecodeThreads()), each of which reads the file through its own TIFF handle.
+static unsigned int tiff_decode_threads = 1;
+
+void ImageMatrix::SetDecodeThreads (unsigned int n_threads) {
+	tiff_decode_threads = (n_threads > 0 ? n_threads : 1);
+}
+
+// A stored resolution of a page:  the page's own directory, a reduced-resolution directory following it, or one of its SubIFDs.
+struct tiff_level_t {
+	tdir_t dir;
+	toff_t subifd;                                // 0 unless the level is a SubIFD of dir
+	uint32_t width, height;
+};
+
+static bool tiff_set_level (TIFF *tif, const tiff_level_t &level) {
+	return (level.subifd ? TIFFSetSubDirectory (tif, level.subifd) : TIFFSetDirectory (tif, level.dir));
+}
+
+// A directory marked as a reduced-resolution image (NewSubfileType bit 0) is a pyramid level rather than a page.
+static bool tiff_is_reduced (TIFF *tif) {
+	uint32_t subfile_type = 0;
+	TIFFGetField (tif, TIFFTAG_SUBFILETYPE, &subfile_type);
+	return ((subfile_type & FILETYPE_REDUCEDIMAGE) != 0);
+}
+
+static void tiff_level_size (TIFF *tif, tiff_level_t &level) {
+	level.width = level.height = 0;
+	TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &level.width);
+	TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &level.height);
+}
+
+// Finds the stored resolutions of a page, the full resolution first.  Returns false if the file has no such page.
+// This leaves the TIFF handle in any of the directories, so tiff_set_level() has to be called before reading a level.
+static bool tiff_page_levels (TIFF *tif, const int page, std::vector<tiff_level_t> &levels) {
+	const tdir_t n_dirs = TIFFNumberOfDirectories (tif);
+	int dir_page = -1;
+
+	levels.clear();
+	for (tdir_t dir = 0; dir < n_dirs && dir_page <= page; dir++) {
+		if (!TIFFSetDirectory (tif, dir)) break;
+		if (dir_page < 0 || !tiff_is_reduced (tif)) dir_page++;
+		if (dir_page != page) continue;
+
+		tiff_level_t level = {dir, 0, 0, 0};
+		tiff_level_size (tif, level);
+		levels.push_back (level);
+		uint16_t n_subifds = 0;
+		toff_t *subifd_offsets = NULL;
+		if (levels.size() == 1 && TIFFGetField (tif, TIFFTAG_SUBIFD, &n_subifds, &subifd_offsets)) {
+			// the offsets go away with the directory when the SubIFDs are read
+			std::vector<toff_t> subifds (subifd_offsets, subifd_offsets + n_subifds);
+			for (size_t i = 0; i < subifds.size(); i++) {
+				if (!TIFFSetSubDirectory (tif, subifds[i]) || !tiff_is_reduced (tif)) continue;
+				level.subifd = subifds[i];
+				tiff_level_size (tif, level);
+				levels.push_back (level);
+			}
+		}
+	}
+	return (!levels.empty());
+}
+
+// The area of a level that covers region (at full resolution), rounded outwards.
+static rect tiff_level_region (const rect &region, const tiff_level_t &full, const tiff_level_t &level) {
+	const double sx = (double)level.width / full.width, sy = (double)level.height / full.height;
+	const int x0 = (int)floor (region.x * sx), y0 = (int)floor (region.y * sy);
+	const int x1 = (int)MIN (ceil ((region.x + region.w) * sx), (double)level.width);
+	const int y1 = (int)MIN (ceil ((region.y + region.h) * sy), (double)level.height);
+	rect level_region = {x0, y0, x1 - x0, y1 - y0};
+	return (level_region);
+}
+
+struct tiff_decoder_t {
+	std::string path;
+	tiff_level_t level;                           // the directory being decoded
+	bool tiled;
+	unsigned int width, height, spp, bits;
+	unsigned int block_w, block_h, blocks_across; // block_w is the width for strips
+	size_t block_bytes;
+	std::vector<unsigned int> blocks;             // the blocks to decode: the ones intersecting the region
+	rect region;                                  // the part of the image that's loaded
+	// The planes the samples go to, all region.w pixels apart.  16-bit color samples are kept in rgb16 (interleaved),
+	// since they are scaled to bytes by the range of all of them.
+	pixel_t *pix;
+	level_t *levels;
+	byte *h, *s, *v;
+	unsigned short *rgb16;
+	pthread_mutex_t block_mutex;
+	unsigned int next_block;
+	bool failed;                                  // a block could not be decoded
+};
+
+// The top left corner of a block
+static inline void tiff_block_origin (const tiff_decoder_t &dec, const unsigned int block, unsigned int &x0, unsigned int &y0) {
+	x0 = (dec.tiled ? (block % dec.blocks_across) * dec.block_w : 0);
+	y0 = (dec.tiled ? (block / dec.blocks_across) : block) * dec.block_h;
+}
+
+// Converts the samples of a decoded block that are in the region into the planes.
+// Partial blocks at the right and bottom edges of the image are clipped too.
+static void tiff_convert_block (tiff_decoder_t &dec, const unsigned char *buf, const unsigned int block) {
+	unsigned int bx0, by0;
+	tiff_block_origin (dec, block, bx0, by0);
+	const unsigned int x0 = MAX (bx0, (unsigned int)dec.region.x), y0 = MAX (by0, (unsigned int)dec.region.y);
+	const unsigned int x1 = MIN (MIN (bx0 + dec.block_w, dec.width), (unsigned int)(dec.region.x + dec.region.w));
+	const unsigned int y1 = MIN (MIN (by0 + dec.block_h, dec.height), (unsigned int)(dec.region.y + dec.region.h));
+	if (x0 >= x1 || y0 >= y1) return;
+	const unsigned int n_cols = x1 - x0;
+	const size_t row_samples = (size_t)dec.block_w * dec.spp;
+	const size_t first_sample = (size_t)(x0 - bx0) * dec.spp;
+
+	for (unsigned int y = y0; y < y1; y++) {
+		const size_t offset = (size_t)(y - dec.region.y) * dec.region.w + (x0 - dec.region.x);
+		const size_t r = y - by0;
+		if (dec.bits == 8) {
+			const unsigned char *row = buf + r * row_samples + first_sample;
+			if (dec.spp == 3) {
+				RGB2HSV_row (row, dec.spp, n_cols, dec.pix + offset, dec.h + offset, dec.s + offset, dec.v + offset);
+				continue;
+			}
+			level_t *levels = dec.levels + offset;
+			for (unsigned int x = 0; x < n_cols; x++) levels[x] = row[x];
+		} else {
+			const unsigned short *row = (const unsigned short *)buf + r * row_samples + first_sample;
+			if (dec.spp == 3) {
+				memcpy (dec.rgb16 + 3 * offset, row, (size_t)n_cols * 3 * sizeof (unsigned short));
+				continue;
+			}
+			memcpy (dec.levels + offset, row, (size_t)n_cols * sizeof (level_t));
+		}
+		const level_t *levels = dec.levels + offset;
+		pixel_t *pix = dec.pix + offset;
+		for (unsigned int x = 0; x < n_cols; x++) pix[x] = levels[x];
+	}
+}
+
+// Decodes blocks until there are none left, or until one of them fails to decode (dec.failed).
+static void tiff_decode_blocks (tiff_decoder_t &dec, TIFF *tif) {
+	std::vector<unsigned char> buf (dec.block_bytes);
+	unsigned int next, block;
+
+	while (true) {
+		pthread_mutex_lock (&dec.block_mutex);
+		next = (dec.failed ? dec.blocks.size() : dec.next_block++);
+		pthread_mutex_unlock (&dec.block_mutex);
+		if (next >= dec.blocks.size()) break;
+		block = dec.blocks[next];
+
+		tsize_t n_bytes = (dec.tiled ? TIFFReadEncodedTile (tif, block, &buf[0], (tsize_t)dec.block_bytes)
+			: TIFFReadEncodedStrip (tif, block, &buf[0], (tsize_t)dec.block_bytes));
+		if (n_bytes < 0) {
+			pthread_mutex_lock (&dec.block_mutex);
+			dec.failed = true;
+			pthread_mutex_unlock (&dec.block_mutex);
+			break;
+		}
+		tiff_convert_block (dec, &buf[0], block);
+	}
+}
+
+static void *tiff_decode_thread (void *decoder) {
+	tiff_decoder_t &dec = *static_cast<tiff_decoder_t *>(decoder);
+	// If the file can't be opened again, the other threads decode this one's share.
+	TIFF *tif = TIFFOpen (dec.path.c_str(), "r");
+	if (tif) {
+		if (tiff_set_level (tif, dec.level)) tiff_decode_blocks (dec, tif);
+		TIFFClose (tif);
+	}
+	return (NULL);
+}
+
+std::string ImageMatrix::PagePath (const char *filename, const int page) {
+	char page_str[16];
+	snprintf (page_str, sizeof (page_str), "[%d]", page);
+	return (std::string (filename) + page_str);
+}
+
+bool ImageMatrix::SplitPagePath (const char *path, std::string &file, int &page) {
+	const char *page_p = strrchr (path, '[');
+	char *end_p;
+
+	file = path;
+	page = -1;
+	if (!page_p || !isdigit (page_p[1])) return (false);
+	long page_num = strtol (page_p + 1, &end_p, 10);
+	if (strcmp (end_p, "]") || page_num > INT_MAX) return (false);
+	file.assign (path, page_p - path);
+	page = (int)page_num;
+	return (true);
+}
+
+int ImageMatrix::TIFFPages (const char *filename) {
+	TIFF *tif;
+	int n_pages = 0;
+
+	if (!strstr(filename,".tif") && !strstr(filename,".TIF")) return (0);
+	TIFFSetWarningHandler(NULL);
+	if ( !(tif = TIFFOpen(filename, "r")) ) return (0);
+	do {
+		if (!n_pages || !tiff_is_reduced (tif)) n_pages++;
+	} while (TIFFReadDirectory (tif));
+	TIFFClose(tif);
+	return (n_pages);
+}
+
+int ImageMatrix::ImageSize (const char *filename, unsigned int &w, unsigned int &h, unsigned int *n_levels) {
+	TIFF *tif;
+	std::string file;
+	int page;
+	std::vector<tiff_level_t> levels;
+
+	SplitPagePath (filename, file, page);
+	if (!strstr(file.c_str(),".tif") && !strstr(file.c_str(),".TIF")) return (0);
+	TIFFSetWarningHandler(NULL);
+	if ( !(tif = TIFFOpen(file.c_str(), "r")) ) return (0);
+	if (!tiff_page_levels (tif, MAX (page, 0), levels)) {
+		TIFFClose(tif);
+		return (0);
+	}
+	TIFFClose(tif);
+	w = levels[0].width;
+	h = levels[0].height;
+	if (n_levels) *n_levels = levels.size();
+	return (1);
+}
+
 /* LoadTIFF
-   filename -char *- full path to the image file
+   filename -char *- full path to the image file, or a page path (see PagePath()).  Without a page, the first page is loaded.
+   roi -rect *- if not NULL, only this area of the image is loaded (clipped to the image), decoding only the strips
+                or tiles it intersects.  The result is the same as a submatrix() of the whole image.
+   scale -double- if less than 1, the image is loaded from its smallest pyramid level that is still at least scale times
+                  the size of the image (or roi, which is given at full resolution).  The result is at the level's resolution,
+                  so it still has to be downsampled to the exact size (see DownsampleTo()).
+   Returns 0 if the image can't be read, including when any of its strips or tiles can't be decoded.
 */
-int ImageMatrix::LoadTIFF(char *filename) {
-	unsigned int h,w,x=0,y=0;
-	unsigned short int spp=0,bps=0;
+int ImageMatrix::LoadTIFF(char *filename, const rect *roi, const double scale) {
+	uint32_t w = 0, h = 0, rows_per_strip = 0, tile_w = 0, tile_h = 0;
+	unsigned short int spp=0,bps=0,planar=PLANARCONFIG_CONTIG;
 	TIFF *tif = NULL;
-	unsigned char *buf8;
-	unsigned short *buf16;
-	RGBcolor rgb = {0,0,0};
-	ImageMatrix R_matrix, G_matrix, B_matrix;
-	Moments2 R_stats, G_stats, B_stats;
+	tiff_decoder_t dec;
+	std::vector<unsigned short> rgb16;
+	std::vector<tiff_level_t> resolutions;
+	std::string file;
+	int page;
 
+	SplitPagePath (filename, file, page);
 	TIFFSetWarningHandler(NULL);
-	if( (tif = TIFFOpen(filename, "r")) ) {
-		source = filename;
+	if (! (tif = TIFFOpen(file.c_str(), "r")) ) return (0);
+	source = filename;
+	if (!tiff_page_levels (tif, MAX (page, 0), resolutions)) {
+		TIFFClose(tif);
+		return (0);
+	}
 
-		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-		width = w;
-		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
-		height = h;
-		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
-		bits=bps;
-		if ( ! (bits == 8 || bits == 16) ) return (0); // only 8 and 16-bit images supported.
-		TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
-		if (!spp) spp=1;  /* assume one sample per pixel if nothing is specified */
-		// regardless of how the image comes in, the stored mode is HSV
-		if (spp == 3) {
-			ColorMode = cmHSV;
-			// If the bits are > 8, we do the read into doubles so that later
-			// we can scale the image to its actual signal range.
-			if (bits > 8) {
-				R_matrix.ColorMode = cmGRAY;
-				R_matrix.allocate (width, height);
-				G_matrix.ColorMode = cmGRAY;
-				G_matrix.allocate (width, height);
-				B_matrix.ColorMode = cmGRAY;
-				B_matrix.allocate (width, height);
-			}
-		} else {
-			ColorMode = cmGRAY;
+	w = resolutions[0].width;
+	h = resolutions[0].height;
+	rect region = {0, 0, (int)w, (int)h};
+	if (roi) {
+		if (roi->x < 0 || roi->y < 0 || (uint32_t)roi->x >= w || (uint32_t)roi->y >= h || roi->w < 1 || roi->h < 1) {
+			TIFFClose(tif);
+			return (0);
+		}
+		region.x = roi->x;
+		region.y = roi->y;
+		region.w = MIN ((uint32_t)roi->w, w - roi->x);
+		region.h = MIN ((uint32_t)roi->h, h - roi->y);
+	}
+	size_t level = 0;
+	if (scale < 1) {
+		const int min_w = (int)(scale * region.w), min_h = (int)(scale * region.h);
+		for (size_t i = 1; i < resolutions.size(); i++) {
+			rect level_region = tiff_level_region (region, resolutions[0], resolutions[i]);
+			if (level_region.w >= min_w && level_region.h >= min_h && level_region.w > 0 && level_region.h > 0
+				&& resolutions[i].width < resolutions[level].width) level = i;
 		}
-		if ( TIFFNumberOfDirectories(tif) > 1) return(0);   /* get the number of slices (Zs) */
+		if (level) {
+			region = tiff_level_region (region, resolutions[0], resolutions[level]);
+			w = resolutions[level].width;
+			h = resolutions[level].height;
+		}
+	}
+	if (!tiff_set_level (tif, resolutions[level])) {
+		TIFFClose(tif);
+		return (0);
+	}
 
-		/* allocate the data */
-		allocate (width, height);
-		writeablePixels pix_plane = WriteablePixels();
-		writeableColors clr_plane = WriteableColors();
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planar);
+	if (!spp) spp=1;  /* assume one sample per pixel if nothing is specified */
+	// only 8 and 16-bit gray or RGB images are supported, with RGB samples interleaved.
+	if ( ! (bps == 8 || bps == 16) || ! (spp == 1 || spp == 3) || (spp == 3 && planar != PLANARCONFIG_CONTIG) ) {
+		TIFFClose(tif);
+		return (0);
+	}
+	// The colors of 16-bit color images are scaled to the range of the whole image, so all of it is decoded,
+	// and the region is cropped from it afterwards.
+	rect crop = region;
+	if (spp == 3 && bps > 8) {
+		region.x = region.y = 0;
+		region.w = w;
+		region.h = h;
+	}
+	width = region.w;
+	height = region.h;
+	bits = bps;
+	// regardless of how the image comes in, the stored mode is HSV
+	ColorMode = (spp == 3 ? cmHSV : cmGRAY);
+
+	/* allocate the data */
+	allocate (width, height);
+	writeablePixels pix_plane = WriteablePixels();
+	writeableColors clr_plane = WriteableColors();
+	// grayscale samples are kept as they are in the levels, as well as in the pixels
+	if (spp == 1) allocate_levels (width, height);
+	if (spp == 3 && bits > 8) rgb16.resize ((size_t)width * height * 3);
+
+	dec.path = file;
+	dec.level = resolutions[level];
+	dec.tiled = TIFFIsTiled (tif);
+	dec.width = w;
+	dec.height = h;
+	dec.region = region;
+	dec.spp = spp;
+	dec.bits = bits;
+	if (dec.tiled) {
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_w);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_h);
+		dec.block_w = tile_w;
+		dec.block_h = tile_h;
+		dec.blocks_across = (tile_w ? (w + tile_w - 1) / tile_w : 0);
+		dec.block_bytes = TIFFTileSize (tif);
+	} else {
+		if (!TIFFGetField(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip) || rows_per_strip > h) rows_per_strip = h;
+		dec.block_w = w;
+		dec.block_h = rows_per_strip;
+		dec.blocks_across = 1;
+		dec.block_bytes = TIFFStripSize (tif);
+	}
+	// the planes were just allocated, so their rows are width (region.w) apart
+	dec.pix = pix_plane.data();
+	dec.levels = _lvl_plane.data();
+	dec.h = &clr_plane.h.coeffRef (0, 0);
+	dec.s = &clr_plane.s.coeffRef (0, 0);
+	dec.v = &clr_plane.v.coeffRef (0, 0);
+	dec.rgb16 = (rgb16.empty() ? NULL : &rgb16[0]);
+	if (width && height && (!dec.block_w || !dec.block_h || dec.block_w * spp * (bits / 8) * (size_t)dec.block_h > dec.block_bytes)) {
+		TIFFClose(tif);
+		return (0);
+	}
+	// the blocks intersecting the region, in the order they are in the image
+	if (width && height) {
+		const unsigned int last_x = region.x + region.w - 1, last_y = region.y + region.h - 1;
+		for (unsigned int block_y = region.y / dec.block_h; block_y <= last_y / dec.block_h; block_y++)
+			for (unsigned int block_x = region.x / dec.block_w; block_x <= last_x / dec.block_w; block_x++)
+				dec.blocks.push_back (block_y * dec.blocks_across + block_x);
+	}
+	pthread_mutex_init (&dec.block_mutex, NULL);
+	dec.next_block = 0;
+	dec.failed = false;
+
+	// This thread decodes blocks along with the others, through the TIFF handle that's already open.
+	std::vector<pthread_t> decode_threads;
+	unsigned int n_threads = MIN (tiff_decode_threads, dec.blocks.size());
+	for (unsigned int i = 1; i < n_threads; i++) {
+		pthread_t thread_id;
+		if (pthread_create (&thread_id, NULL, tiff_decode_thread, &dec) == 0) decode_threads.push_back (thread_id);
+	}
+	tiff_decode_blocks (dec, tif);
+	for (size_t i = 0; i < decode_threads.size(); i++) pthread_join (decode_threads[i], NULL);
+	pthread_mutex_destroy (&dec.block_mutex);
+	TIFFClose(tif);
+	if (dec.failed) return (0);
 
-		/* read TIFF header and determine image size */
-		buf8 = (unsigned char *)_TIFFmalloc(TIFFScanlineSize(tif)*spp);
-		buf16 = (unsigned short *)_TIFFmalloc( (tsize_t)sizeof(unsigned short)*TIFFScanlineSize(tif)*spp );
-		for (y = 0; y < height; y++) {
-			int col;
-			if (bits==8) TIFFReadScanline(tif, buf8, y);
-			else TIFFReadScanline(tif, buf16, y);
-			x=0;col=0;
-			while (x<width) {
-				unsigned char byte_data;
-				unsigned short short_data;
-				double val=0;
-				int sample_index;
-				for (sample_index=0;sample_index<spp;sample_index++) {
-					byte_data=buf8[col+sample_index];
-					short_data=buf16[col+sample_index];
-					if (bits==8) val=(double)byte_data;
-					else val=(double)(short_data);
-					if (spp==3 && bits > 8) {  /* RGB image */
-						if (sample_index==0) R_matrix.WriteablePixels()(y,x) = R_stats.add (val);
-						if (sample_index==1) G_matrix.WriteablePixels()(y,x) = G_stats.add (val);
-						if (sample_index==2) B_matrix.WriteablePixels()(y,x) = B_stats.add (val);
-					} else if (spp == 3) {
-						if (sample_index==0) rgb.r = (unsigned char)(R_stats.add (val));
-						if (sample_index==1) rgb.g = (unsigned char)(G_stats.add (val));
-						if (sample_index==2) rgb.b = (unsigned char)(B_stats.add (val));
-					}
-				}
-				if (spp == 3 && bits == 8) {
-					pix_plane (y, x) = stats.add (RGB2GRAY (rgb));
-					clr_plane (y, x) = RGB2HSV(rgb);
-				} else if (spp == 1) {
-					pix_plane (y, x) = stats.add (val);
-				}
-				x++;
-				col+=spp;
-			}
-		}
+	finish_decoding (spp, rgb16);
+
+	if (crop.w != region.w || crop.h != region.h) {
+		ImageMatrix block;
+		block.submatrix (*this, crop.x, crop.y, crop.x + crop.w - 1, crop.y + crop.h - 1);
+		take (block);
+	}
+	return(1);
+}
+
+// Finishes the planes of samples converted by tiff_convert_block(): gray images get their stats from the levels,
+// and 16-bit color samples (rgb16, interleaved) are scaled to bytes by their range and converted to the color planes.
+void ImageMatrix::finish_decoding (const unsigned int spp, const std::vector<unsigned short> &rgb16) {
+	unsigned int x, y;
+
+	if (spp == 1) {
+		// the stats are accumulated in the same order as the pixels, which needs a single thread
+		const level_t *levels = _lvl_plane.data();
+		for (size_t i = 0; i < (size_t)width * height; i++) stats.add (levels[i]);
+	} else if (bits > 8) {
 		// Do the conversion to unsigned chars based on the input signal range
 		// i.e. scale global RGB min-max to 0-255
-		if (spp == 3 && bits > 8) {
-			size_t a, num = width*height;
-			double RGB_min=0, RGB_max=0, RGB_scale=0;
-			R_matrix.finish();
-			G_matrix.finish();
-			B_matrix.finish();
-			// Get the min and max for all 3 channels
-			if (R_stats.min() <= G_stats.min() && R_stats.min() <= B_stats.min()) RGB_min = R_stats.min();
-			else if (G_stats.min() <= R_stats.min() && G_stats.min() <= B_stats.min()) RGB_min = G_stats.min();
-			else if (B_stats.min() <= R_stats.min() && B_stats.min() <= G_stats.min()) RGB_min = B_stats.min();
-			if (R_stats.max() >= G_stats.max() && R_stats.max() >= B_stats.max()) RGB_max = R_stats.max();
-			else if (G_stats.max() >= R_stats.max() && G_stats.max() >= B_stats.max()) RGB_max = G_stats.max();
-			else if (B_stats.max() >= R_stats.max() && B_stats.max() >= G_stats.max()) RGB_max = B_stats.max();
-			// Scale the clrData to the global min / max.
-			RGB_scale = (255.0/(RGB_max-RGB_min));
-			for (a = 0; a < num; a++) {
-				rgb.r = (unsigned char)( (R_matrix.ReadablePixels().array().coeff(a) - RGB_min) * RGB_scale);
-				rgb.g = (unsigned char)( (G_matrix.ReadablePixels().array().coeff(a) - RGB_min) * RGB_scale);
-				rgb.b = (unsigned char)( (B_matrix.ReadablePixels().array().coeff(a) - RGB_min) * RGB_scale);
-				pix_plane (y, x) = stats.add (RGB2GRAY (rgb));
-				clr_plane (y, x) = RGB2HSV(rgb);
-			}
+		double RGB_min=0, RGB_max=0, RGB_scale=0;
+		if (!rgb16.empty()) {
+			RGB_min = *std::min_element (rgb16.begin(), rgb16.end());
+			RGB_max = *std::max_element (rgb16.begin(), rgb16.end());
 		}
-		_TIFFfree(buf8);
-		_TIFFfree(buf16);
-		TIFFClose(tif);
+		// Scale the clrData to the global min / max.
+		RGB_scale = (255.0/(RGB_max-RGB_min));
+		std::vector<byte> rgb_row (3 * width);
+		for (y = 0; y < height; y++) {
+			const unsigned short *samples = &rgb16[(size_t)y * width * 3];
+			for (x = 0; x < 3 * width; x++)
+				rgb_row[x] = (unsigned char)( ((double)samples[x] - RGB_min) * RGB_scale);
+			if (width) RGB2HSV_row (&rgb_row[0], 3, width, &_pix_plane.coeffRef (y, 0),
+				&_clr_plane.h.coeffRef (y, 0), &_clr_plane.s.coeffRef (y, 0), &_clr_plane.v.coeffRef (y, 0));
+		}
+	}
+	if (spp == 3) UpdateStats();
+}
 
-	} else return(0);
+/* LoadRawFrame
+   Reads the next frame of a stream of raw images (e.g. from stdin or a named pipe).  Each frame is a header line:
+     WNDRAW <width> <height> <bits> <channels> [<name>]
+   followed by width * height * channels samples of bits/8 bytes each, in the machine's byte order, one row after another
+   from the top, with the channels of each pixel together.  bits is 8 or 16, and channels is 1 (gray) or 3 (RGB), as in LoadTIFF().
+   The name (the rest of the line) becomes the source, and is optional.
+   Returns 1 if a frame was read, 0 at the end of the stream, or -1 for a bad header or a frame cut short.
+*/
+#define RAW_FRAME_HEADER_LENGTH 1024
+int ImageMatrix::LoadRawFrame (FILE *fp) {
+	char header[RAW_FRAME_HEADER_LENGTH], name[RAW_FRAME_HEADER_LENGTH];
+	unsigned int w, h, bps, spp, y;
+	tiff_decoder_t dec;
+	std::vector<unsigned short> rgb16;
+
+	if (!fgets (header, sizeof (header), fp)) return (0);
+	*name = '\0';
+	if (sscanf (header, "WNDRAW %u %u %u %u %[^\r\n]", &w, &h, &bps, &spp, name) < 4) return (-1);
+	if ( ! (bps == 8 || bps == 16) || ! (spp == 1 || spp == 3) || w < 1 || h < 1) return (-1);
+
+	source = name;
+	width = w;
+	height = h;
+	bits = bps;
+	ColorMode = (spp == 3 ? cmHSV : cmGRAY);
+	allocate (width, height);
+	writeablePixels pix_plane = WriteablePixels();
+	writeableColors clr_plane = WriteableColors();
+	if (spp == 1) allocate_levels (width, height);
+	if (spp == 3 && bits > 8) rgb16.resize ((size_t)width * height * 3);
+
+	// The frame is converted the same way as the strips of a TIFF, one row to a strip
+	rect region = {0, 0, (int)w, (int)h};
+	dec.tiled = false;
+	dec.width = w;
+	dec.height = h;
+	dec.region = region;
+	dec.spp = spp;
+	dec.bits = bps;
+	dec.block_w = w;
+	dec.block_h = 1;
+	dec.blocks_across = 1;
+	dec.block_bytes = (size_t)w * spp * (bps / 8);
+	dec.pix = pix_plane.data();
+	dec.levels = _lvl_plane.data();
+	dec.h = &clr_plane.h.coeffRef (0, 0);
+	dec.s = &clr_plane.s.coeffRef (0, 0);
+	dec.v = &clr_plane.v.coeffRef (0, 0);
+	dec.rgb16 = (rgb16.empty() ? NULL : &rgb16[0]);
+
+	std::vector<unsigned char> row (dec.block_bytes);
+	for (y = 0; y < h; y++) {
+		if (fread (&row[0], 1, dec.block_bytes, fp) != dec.block_bytes) return (-1);
+		tiff_convert_block (dec, &row[0], y);
+	}
+	finish_decoding (spp, rgb16);
+	return (1);
+}
 
-	return(1);
+// Reads a raw frame (see LoadRawFrame()) and preprocesses it as OpenImage() does.
+int ImageMatrix::OpenRawFrame (FILE *fp, int downsample, rect *bounding_rect, double mean, double stddev) {
+	int res = LoadRawFrame (fp);
+
+	if (res > 0) {
+		if (bounding_rect && bounding_rect->x >= 0) {
+			ImageMatrix block;
+			block.submatrix (*this, (unsigned int)bounding_rect->x, (unsigned int)bounding_rect->y,
+				(unsigned int)bounding_rect->x+bounding_rect->w-1, (unsigned int)bounding_rect->y+bounding_rect->h-1
+			);
+			take (block);
+		}
+		if (downsample>0 && downsample<100)
+			Downsample(*this, ((double)downsample)/100.0,((double)downsample)/100.0);
+		if (mean>0)
+			normalize(-1,-1,-1,mean,stddev);
+	}
+	finish();
+	return (res);
 }
 
 /*  SaveTiff
@@ -245,21 +671,233 @@ int ImageMatrix::SaveTiff(char *filename) {
 	return(1);
 }
 
+// Plane file layout: a plane_file_header_t, then the pixel plane starting at pix_offset (a page boundary),
+// then the h, s and v planes one after the other (if the image has color), each width * height bytes,
+// then the levels (if the image has them) starting at lvl_offset.
+// The header is in the byte order of the machine that wrote it, and files from other machines fail the header checks.
+#define PLANE_FILE_MAGIC "WNDPLN2"
+struct plane_file_header_t {
+	char magic[8];
+	uint32_t header_bytes;             // sizeof (plane_file_header_t)
+	uint32_t pixel_bytes;              // sizeof (pixel_t) of the build that wrote the file
+	uint32_t width, height;
+	uint32_t bits, color_mode;
+	uint64_t pix_offset, clr_offset, lvl_offset, file_bytes; // lvl_offset is 0 if there are no levels
+	int64_t source_size, source_mtime; // of the image the planes were decoded from (0 if none)
+};
+
+// the levels start at the next 16-byte boundary after the color planes
+static inline uint64_t plane_file_lvl_offset (const uint64_t clr_offset, const uint64_t n_pixels, const bool has_color) {
+	return (((clr_offset + (has_color ? n_pixels * 3 : 0)) + 15) & ~(uint64_t)15);
+}
+
+int ImageMatrix::SavePlanes (const char *path, const struct stat *source_st) const {
+	plane_file_header_t header;
+	size_t page_size = (size_t)sysconf (_SC_PAGESIZE);
+	unsigned int y;
+
+	memset (&header, 0, sizeof (header));
+	strncpy (header.magic, PLANE_FILE_MAGIC, sizeof (header.magic));
+	header.header_bytes = sizeof (header);
+	header.pixel_bytes = sizeof (pixel_t);
+	header.width = width;
+	header.height = height;
+	header.bits = bits;
+	header.color_mode = ColorMode;
+	header.pix_offset = ((sizeof (header) + page_size - 1) / page_size) * page_size;
+	header.clr_offset = header.pix_offset + (uint64_t)width * height * sizeof (pixel_t);
+	header.file_bytes = header.clr_offset + (ColorMode != cmGRAY ? (uint64_t)width * height * 3 : 0);
+	if (has_levels()) {
+		header.lvl_offset = plane_file_lvl_offset (header.clr_offset, (uint64_t)width * height, ColorMode != cmGRAY);
+		header.file_bytes = header.lvl_offset + (uint64_t)width * height * sizeof (level_t);
+	}
+	if (source_st) {
+		header.source_size = source_st->st_size;
+		header.source_mtime = source_st->st_mtime;
+	}
+
+	// The file is written under a temporary name and renamed into place,
+	// so that other processes never map a partial file, and mappings of a previous file are left alone.
+	std::string tmp_path = std::string (path) + ".XXXXXX";
+	std::vector<char> tmp_path_buf (tmp_path.begin(), tmp_path.end());
+	tmp_path_buf.push_back ('\0');
+	int fd = mkstemp (&tmp_path_buf[0]);
+	if (fd < 0) return (0);
+	fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	FILE *fp = fdopen (fd, "w");
+	if (!fp) {
+		close (fd);
+		unlink (&tmp_path_buf[0]);
+		return (0);
+	}
+
+	// The rows are written one at a time, since the planes may be a view's
+	bool ok = (fwrite (&header, sizeof (header), 1, fp) == 1 && fseeko (fp, (off_t)header.pix_offset, SEEK_SET) == 0);
+	readOnlyPixels pix_plane = ReadablePixels();
+	for (y = 0; ok && y < height; y++)
+		ok = (fwrite (&(pix_plane.coeffRef (y, 0)), sizeof (pixel_t), width, fp) == width);
+	if (ColorMode != cmGRAY) {
+		readOnlyColors clr_plane = ReadableColors();
+		for (y = 0; ok && y < height; y++) ok = (fwrite (&(clr_plane.h.coeffRef (y, 0)), 1, width, fp) == width);
+		for (y = 0; ok && y < height; y++) ok = (fwrite (&(clr_plane.s.coeffRef (y, 0)), 1, width, fp) == width);
+		for (y = 0; ok && y < height; y++) ok = (fwrite (&(clr_plane.v.coeffRef (y, 0)), 1, width, fp) == width);
+	}
+	if (has_levels()) {
+		readOnlyLevels lvl_plane = ReadableLevels();
+		if (ok) ok = (fseeko (fp, (off_t)header.lvl_offset, SEEK_SET) == 0);
+		for (y = 0; ok && y < height; y++) ok = (fwrite (&(lvl_plane.coeffRef (y, 0)), sizeof (level_t), width, fp) == width);
+	}
+	if (fclose (fp) != 0) ok = false;
+
+	if (ok && rename (&tmp_path_buf[0], path) == 0) return (1);
+	unlink (&tmp_path_buf[0]);
+	return (0);
+}
+
+int ImageMatrix::MapPlanes (const char *path, const struct stat *source_st) {
+	plane_file_header_t header;
+	struct stat file_st;
+	void *map_ptr = MAP_FAILED;
+
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) return (0);
+	uint64_t n_pixels = 0;
+	bool ok = (fstat (fd, &file_st) == 0 && read (fd, &header, sizeof (header)) == (ssize_t)sizeof (header));
+	if (ok) {
+		n_pixels = (uint64_t)header.width * header.height;
+		ok = (!strncmp (header.magic, PLANE_FILE_MAGIC, sizeof (header.magic))
+			&& header.header_bytes == sizeof (header) && header.pixel_bytes == sizeof (pixel_t)
+			&& (header.color_mode == cmRGB || header.color_mode == cmHSV || header.color_mode == cmGRAY)
+			&& header.pix_offset >= sizeof (header) && header.pix_offset % sizeof (pixel_t) == 0
+			&& header.clr_offset == header.pix_offset + n_pixels * sizeof (pixel_t)
+			&& (header.lvl_offset == 0 || header.lvl_offset == plane_file_lvl_offset (header.clr_offset, n_pixels, header.color_mode != cmGRAY))
+			&& header.file_bytes == (header.lvl_offset ? header.lvl_offset + n_pixels * sizeof (level_t)
+				: header.clr_offset + (header.color_mode != cmGRAY ? n_pixels * 3 : 0))
+			&& (uint64_t)file_st.st_size == header.file_bytes);
+	}
+	// a stale cache of an image that has since changed
+	if (ok && source_st)
+		ok = (header.source_size == (int64_t)source_st->st_size && header.source_mtime == (int64_t)source_st->st_mtime);
+	// Copy-on-write, so the planes can be changed (e.g. normalized) without changing the file.
+	if (ok) map_ptr = mmap (NULL, header.file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd); // the mapping keeps its own reference to the file
+	if (map_ptr == MAP_FAILED) return (0);
+
+	free_planes();
+	ColorMode = (enum ColorModes)header.color_mode;
+	bits = header.bits;
+	stats.reset();
+	has_median = false;
+	remap_pix_plane ((pixel_t *)((char *)map_ptr + header.pix_offset), header.width, header.height);
+	if (ColorMode != cmGRAY) remap_clr_plane ((byte *)map_ptr + header.clr_offset, header.width, header.height);
+	if (header.lvl_offset) new (&_lvl_plane) levelData ((level_t *)((char *)map_ptr + header.lvl_offset),
+		header.height, header.width, planeStride (header.width));
+	_map_ptr = map_ptr;
+	_map_bytes = header.file_bytes;
+	if (verbosity > 7) fprintf (stdout, "mapped plane file %s at %p (%d,%d)\n", path, map_ptr, width, height);
+	return (1);
+}
+
+static std::string plane_cache_dir;
+
+void ImageMatrix::SetPlaneCacheDir (const std::string &dir) {
+	plane_cache_dir = dir;
+}
+
+const std::string &ImageMatrix::PlaneCacheDir () {
+	return (plane_cache_dir);
+}
+
+// The plane file caching an image in the plane cache directory is named after the image,
+// with a hash of its full path so that images with the same name in different directories don't collide.
+static std::string plane_cache_path (const char *image_file_name) {
+	std::string file;
+	int page;
+	ImageMatrix::SplitPagePath (image_file_name, file, page);
+	char *real_path = realpath (file.c_str(), NULL);
+	std::string full_path = real_path ? real_path : file;
+	free (real_path);
+	if (page >= 0) full_path = ImageMatrix::PagePath (full_path.c_str(), page);
+	uint64_t hash = 14695981039346656037ULL; // 64-bit FNV-1a
+	for (const char *c = full_path.c_str(); *c; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ULL;
+	}
+
+	const char *base_name = strrchr (image_file_name, '/');
+	base_name = base_name ? base_name + 1 : image_file_name;
+	char hash_str[17];
+	snprintf (hash_str, sizeof (hash_str), "%016llx", (unsigned long long)hash);
+	return (plane_cache_dir + "/" + base_name + "-" + hash_str + ".planes");
+}
+
 int ImageMatrix::OpenImage(char *image_file_name, int downsample, rect *bounding_rect, double mean, double stddev) {  
 	int res=0;
-	if (strstr(image_file_name,".tif") || strstr(image_file_name,".TIF")) {  
-		res=LoadTIFF(image_file_name);
+	struct stat image_st;
+	std::string cache_path, file;
+	int page;
+	bool cropped = false;
+	unsigned int image_w = 0, image_h = 0, n_levels = 1;
+	double scale = 1.0;
+
+	// Pyramid TIFFs are downsampled from their smallest level that is still larger than the result, which skips decoding
+	// the full resolution.  The cached planes are at full resolution, so the plane cache isn't used for these.
+	if (downsample>0 && downsample<100 && ImageSize (image_file_name, image_w, image_h, &n_levels) && n_levels > 1)
+		scale = ((double)downsample)/100.0;
+
+	SplitPagePath (image_file_name, file, page);
+	if (strstr(image_file_name,".planes")) {
+		res=MapPlanes(image_file_name);
+		if (res) UpdateStats();
+	} else if (plane_cache_dir.length() && scale == 1.0 && stat (file.c_str(), &image_st) == 0) {
+		cache_path = plane_cache_path (image_file_name);
+		res=MapPlanes (cache_path.c_str(), &image_st);
+		if (res) UpdateStats();
+		if (res && verbosity > 5) std::cout << "mapped cached planes of " << image_file_name << " from " << cache_path << std::endl;
+	}
+
+	if (!res && (strstr(image_file_name,".tif") || strstr(image_file_name,".TIF"))) {
+		// Without a plane cache, only the strips or tiles under the bounding rectangle are decoded.
+		// The stats are left to be computed from the area's pixels, as they are for a submatrix() of the whole image.
+		if (!cache_path.length() && ((bounding_rect && bounding_rect->x >= 0) || scale < 1.0)) {
+			cropped = (bounding_rect && bounding_rect->x >= 0);
+			res=LoadTIFF(image_file_name, cropped ? bounding_rect : NULL, scale);
+			if (res) {
+				stats.reset();
+				has_median = false;
+			}
+		} else res=LoadTIFF(image_file_name);
+		// The decoded planes are swapped for a mapping of their cached copy, so that they needn't stay in memory.
+		// If the cache can't be written, the decoded planes are used as they are.
+		if (res && cache_path.length()) {
+			Moments2 decoded_stats = stats;
+			if (SavePlanes (cache_path.c_str(), &image_st) && MapPlanes (cache_path.c_str(), &image_st))
+				stats = decoded_stats;
+			else if (verbosity > 1) std::cout << "Could not cache the planes of " << image_file_name << " in " << cache_path << std::endl;
+		}
 	}
 
 	// add the image only if it was loaded properly
 	if (res) {
 		// compute features only from an area of the image
-		if (bounding_rect && bounding_rect->x >= 0) {
-			submatrix (*this, (unsigned int)bounding_rect->x, (unsigned int)bounding_rect->y,
+		// submatrix() reallocates before reading, so the block is copied out and its planes taken back
+		if (bounding_rect && bounding_rect->x >= 0 && !cropped) {
+			ImageMatrix block;
+			block.submatrix (*this, (unsigned int)bounding_rect->x, (unsigned int)bounding_rect->y,
 				(unsigned int)bounding_rect->x+bounding_rect->w-1, (unsigned int)bounding_rect->y+bounding_rect->h-1
 			);
+			take (block);
 		}
-		if (downsample>0 && downsample<100)  /* downsample by a given factor */
+		// A pyramid level is downsampled to the size the full resolution would have been downsampled to.
+		if (scale < 1.0) {
+			if (bounding_rect && bounding_rect->x >= 0) {
+				image_w = MIN ((unsigned int)bounding_rect->w, image_w - bounding_rect->x);
+				image_h = MIN ((unsigned int)bounding_rect->h, image_h - bounding_rect->y);
+			}
+			if (width != image_w || height != image_h)
+				DownsampleTo (*this, (unsigned int)(scale*image_w), (unsigned int)(scale*image_h));
+			else Downsample(*this, scale, scale);
+		} else if (downsample>0 && downsample<100)  /* downsample by a given factor */
 			Downsample(*this, ((double)downsample)/100.0,((double)downsample)/100.0);   /* downsample the image */
 		if (mean>0)  /* normalize to a given mean and standard deviation */
 			normalize(-1,-1,-1,mean,stddev);
@@ -277,6 +915,10 @@ void ImageMatrix::init() {
 	width      = 0;
 	height     = 0;
 	_is_pix_writeable = _is_clr_writeable = false;
+	_is_view = false;
+	_pix_arena = _clr_arena = _lvl_arena = NULL;
+	_map_ptr = NULL;
+	_map_bytes = 0;
 
 	stats.reset();
 	has_median = false;
@@ -290,11 +932,11 @@ void ImageMatrix::init() {
 // The object is created new at the same memory location it was before, so no new allocation happens
 // This allows us to call Eigen's Map constructor with new parameters without actually re-allocating the object
 // N.B.: THis does not do any memory allocation or deallocation, it simply assigns the passed in memory to an Eigen object.
-void ImageMatrix::remap_pix_plane(double *ptr, const unsigned int w, const unsigned int h) {
+void ImageMatrix::remap_pix_plane(pixel_t *ptr, const unsigned int w, const unsigned int h, const unsigned int stride) {
 	width  = 0;
 	height = 0;
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
-	new (&_pix_plane) pixData(ptr, h, w);
+	new (&_pix_plane) pixData(ptr, h, w, planeStride (stride ? stride : w));
 	width  = (unsigned int)_pix_plane.cols();
 	height = (unsigned int)_pix_plane.rows();
 	// FIXME: Should check here if the pointer is different than what it was.
@@ -304,12 +946,12 @@ void ImageMatrix::remap_pix_plane(double *ptr, const unsigned int w, const unsig
 	stats.reset();
 }
 // Same as above for the color plane.
-void ImageMatrix::remap_clr_plane(HSVcolor *ptr, const unsigned int w, const unsigned int h) {
+void ImageMatrix::remap_clr_plane(byte *ptr, const unsigned int w, const unsigned int h, const unsigned int stride, const size_t channel_offset) {
 	if (ColorMode == cmGRAY) return;
 	width  = 0;
 	height = 0;
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
-	new (&_clr_plane) clrData(ptr, h, w);
+	_clr_plane.remap (ptr, h, w, stride, channel_offset);
 	width  = (unsigned int)_clr_plane.cols();
 	height = (unsigned int)_clr_plane.rows();
 	// FIXME: Should check here if the pointer is different than what it was.
@@ -317,17 +959,146 @@ void ImageMatrix::remap_clr_plane(HSVcolor *ptr, const unsigned int w, const uns
 	_is_clr_writeable = true;
 }
 
+// Per-thread counters of allocated and copied plane bytes.
+// These are only ever touched by their own thread, so they need no locking.
+struct plane_bytes_t {
+	size_t allocated, copied;
+	plane_bytes_t () : allocated (0), copied (0) {}
+};
+static pthread_key_t plane_bytes_key;
+static pthread_once_t plane_bytes_once = PTHREAD_ONCE_INIT;
+static void plane_bytes_free (void *counter) { delete (plane_bytes_t *)counter; }
+static void plane_bytes_init () { pthread_key_create (&plane_bytes_key, plane_bytes_free); }
+
+static plane_bytes_t *plane_bytes_counter () {
+	pthread_once (&plane_bytes_once, plane_bytes_init);
+	plane_bytes_t *counter = (plane_bytes_t *)pthread_getspecific (plane_bytes_key);
+	if (!counter) {
+		counter = new plane_bytes_t;
+		pthread_setspecific (plane_bytes_key, counter);
+	}
+	return (counter);
+}
+
+size_t ImageMatrix::thread_alloc_bytes () {
+	return (plane_bytes_counter()->allocated);
+}
+
+size_t ImageMatrix::thread_copy_bytes () {
+	return (plane_bytes_counter()->copied);
+}
+
+// The current PlaneArena of each thread.
+static pthread_key_t current_arena_key;
+static pthread_once_t current_arena_once = PTHREAD_ONCE_INIT;
+static void current_arena_init () { pthread_key_create (&current_arena_key, NULL); }
+
+PlaneArena *PlaneArena::current () {
+	pthread_once (&current_arena_once, current_arena_init);
+	return (static_cast<PlaneArena *>(pthread_getspecific (current_arena_key)));
+}
+
+void PlaneArena::set_current (PlaneArena *arena) {
+	pthread_once (&current_arena_once, current_arena_init);
+	pthread_setspecific (current_arena_key, arena);
+}
+
+PlaneArena::PlaneArena (size_t max_cached_bytes_in) {
+	max_cached_bytes = max_cached_bytes_in;
+	n_cached_bytes = 0;
+	pthread_mutex_init (&arena_mutex, NULL);
+}
+
+PlaneArena::~PlaneArena () {
+	trim();
+	if (current() == this) set_current (NULL);
+	pthread_mutex_destroy (&arena_mutex);
+}
+
+void *PlaneArena::allocate (size_t bytes) {
+	void *ptr = NULL;
+
+	pthread_mutex_lock (&arena_mutex);
+	free_buffers_t::iterator it = free_buffers.find (bytes);
+	if (it != free_buffers.end()) {
+		ptr = it->second;
+		free_buffers.erase (it);
+		n_cached_bytes -= bytes;
+	}
+	pthread_mutex_unlock (&arena_mutex);
+
+	if (!ptr) ptr = Eigen::internal::aligned_malloc (bytes);
+	return (ptr);
+}
+
+void PlaneArena::release (void *ptr, size_t bytes) {
+	std::vector<void *> evicted;
+
+	if (!ptr) return;
+	pthread_mutex_lock (&arena_mutex);
+	if (bytes > max_cached_bytes) {
+		evicted.push_back (ptr);
+	} else {
+		free_buffers.insert (std::make_pair (bytes, ptr));
+		n_cached_bytes += bytes;
+	// the largest buffers are the most expensive to keep around
+		while (n_cached_bytes > max_cached_bytes) {
+			free_buffers_t::iterator largest = --free_buffers.end();
+			n_cached_bytes -= largest->first;
+			evicted.push_back (largest->second);
+			free_buffers.erase (largest);
+		}
+	}
+	pthread_mutex_unlock (&arena_mutex);
+
+	for (size_t i = 0; i < evicted.size(); i++)
+		Eigen::internal::aligned_free (evicted[i]);
+}
+
+void PlaneArena::trim () {
+	pthread_mutex_lock (&arena_mutex);
+	for (free_buffers_t::iterator it = free_buffers.begin(); it != free_buffers.end(); ++it)
+		Eigen::internal::aligned_free (it->second);
+	free_buffers.clear();
+	n_cached_bytes = 0;
+	pthread_mutex_unlock (&arena_mutex);
+}
+
+size_t PlaneArena::cached_bytes () const {
+	pthread_mutex_lock (&arena_mutex);
+	size_t bytes = n_cached_bytes;
+	pthread_mutex_unlock (&arena_mutex);
+	return (bytes);
+}
+
+void *PlaneArena::allocate (PlaneArena *arena, size_t bytes) {
+	if (arena) return (arena->allocate (bytes));
+	return (Eigen::internal::aligned_malloc (bytes));
+}
+
+void PlaneArena::release (PlaneArena *arena, void *ptr, size_t bytes) {
+	if (arena) arena->release (ptr, bytes);
+	else Eigen::internal::aligned_free (ptr);
+}
+
 // If the image are changed size, then reallocate.
 // If the image changed color mode, reallocate.
 // Ensure that anything that's reallocated is deallocated first.
 void ImageMatrix::allocate (unsigned int w, unsigned int h) {
 
+	// A view's planes belong to another matrix, and mapped planes to their file, so it needs its own.
+	if (_is_view || _map_ptr) free_planes();
+	// the levels of the old pixels
+	if (_lvl_plane.data()) free_levels();
+
 	if ((unsigned int) _pix_plane.cols() != w || (unsigned int)_pix_plane.rows() != h) {
 		// These throw exceptions, which we don't catch (catch in main?)
 		// FIXME: We could check for shrinkage and simply remap instead of allocating.
 		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
-		if (_pix_plane.data()) Eigen::aligned_allocator<double>().deallocate (_pix_plane.data(), _pix_plane.size());
-		remap_pix_plane (Eigen::aligned_allocator<double>().allocate (w * h), w, h);
+		if (_pix_plane.data()) PlaneArena::release (_pix_arena, _pix_plane.data(), _pix_plane.size() * sizeof(pixel_t));
+		_pix_arena = PlaneArena::current();
+		remap_pix_plane (static_cast<pixel_t *>(PlaneArena::allocate (_pix_arena, (size_t)w * h * sizeof(pixel_t))), w, h);
+		plane_bytes_counter()->allocated += (size_t)w * h * sizeof(pixel_t);
 		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "allocated grayscale %p (%d,%d)\n",(void *)_pix_plane.data(), w, h);
 	} else {
 		// No re-allocation necessary since size didn't change
@@ -339,7 +1110,7 @@ void ImageMatrix::allocate (unsigned int w, unsigned int h) {
 	// cleanup the color plane if it changed size, or if we have a gray image.
 	if ( ColorMode == cmGRAY || (_pix_plane.data() && ((unsigned int)_clr_plane.cols() != w || (unsigned int)_clr_plane.rows() != h)) ) {
 		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "  deallocating color %p\n",(void *)_clr_plane.data());
-		if (_clr_plane.data()) Eigen::aligned_allocator<HSVcolor>().deallocate (_clr_plane.data(), _clr_plane.size());
+		if (_clr_plane.data()) PlaneArena::release (_clr_arena, const_cast<byte *>(_clr_plane.data()), _clr_plane.size() * sizeof(HSVcolor));
 		remap_clr_plane (NULL, 0, 0);
 	}
 
@@ -347,11 +1118,30 @@ void ImageMatrix::allocate (unsigned int w, unsigned int h) {
 	if (ColorMode != cmGRAY && ! (_clr_plane.data()) ) {
 		// These throw exceptions, which we don't catch (catch in main?)
 		// FIXME: We could check for shrinkage and simply remap instead of allocating.
-		remap_clr_plane (Eigen::aligned_allocator<HSVcolor>().allocate (w * h), w, h);
+		_clr_arena = PlaneArena::current();
+		remap_clr_plane (static_cast<byte *>(PlaneArena::allocate (_clr_arena, (size_t)w * h * sizeof(HSVcolor))), w, h);
+		plane_bytes_counter()->allocated += (size_t)w * h * sizeof(HSVcolor);
 		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "  allocated color %p (%d,%d)\n",(void *)_clr_plane.data(), w, h);
 	}
 }
 
+// The levels are allocated like the pixel plane, and are only ever allocated for a matrix that owns its pixels.
+void ImageMatrix::allocate_levels (unsigned int w, unsigned int h) {
+	assert (!_is_view && !_map_ptr && !_lvl_plane.data());
+	_lvl_arena = PlaneArena::current();
+	new (&_lvl_plane) levelData (static_cast<level_t *>(PlaneArena::allocate (_lvl_arena, (size_t)w * h * sizeof(level_t))),
+		h, w, planeStride (w));
+	plane_bytes_counter()->allocated += (size_t)w * h * sizeof(level_t);
+}
+
+// Mapped levels are left in their mapping, which free_planes() unmaps.
+void ImageMatrix::free_levels () {
+	if (!_is_view && !_map_ptr && _lvl_plane.data())
+		PlaneArena::release (_lvl_arena, _lvl_plane.data(), _lvl_plane.size() * sizeof(level_t));
+	new (&_lvl_plane) levelData (NULL, 0, 0, planeStride (0));
+	_lvl_arena = NULL;
+}
+
 void ImageMatrix::copyFields(const ImageMatrix &copy) {
 	width = copy.width;
 	height = copy.height;
@@ -369,8 +1159,16 @@ void ImageMatrix::copyData(const ImageMatrix &copy) {
 
 	allocate(copy.width, copy.height);
 	WriteablePixels() = copy.ReadablePixels();
+	plane_bytes_counter()->copied += (size_t)width * height * sizeof(pixel_t);
 	if (ColorMode != cmGRAY) {
 		WriteableColors() = copy.ReadableColors();
+		plane_bytes_counter()->copied += (size_t)width * height * sizeof(HSVcolor);
+	}
+	// Matrices whose planes can't be moved (e.g. shared memory ones) manage their own planes, and don't get levels.
+	if (copy.has_levels() && planes_are_movable()) {
+		allocate_levels (width, height);
+		_lvl_plane = copy.ReadableLevels();
+		plane_bytes_counter()->copied += (size_t)width * height * sizeof(level_t);
 	}
 	stats = old_stats;
 	has_median = old_has_median;
@@ -387,19 +1185,99 @@ void ImageMatrix::submatrix (const ImageMatrix &matrix, const unsigned int x1, c
 	// verify that the image size is OK
 	x0 = (x1 < 0 ? 0 : x1);
 	y0 = (y1 < 0 ? 0 : y1);
-	unsigned int new_width  = (x2 >= matrix.width  ? matrix.width  : x2 - x0 + 1);
-	unsigned int new_height = (y2 >= matrix.height ? matrix.height : y2 - y0 + 1);
+	// blocks reaching past the right or bottom edge are clipped to it
+	unsigned int new_width  = (x0 >= matrix.width  ? 0 : x2 >= matrix.width  ? matrix.width  - x0 : x2 - x0 + 1);
+	unsigned int new_height = (y0 >= matrix.height ? 0 : y2 >= matrix.height ? matrix.height - y0 : y2 - y0 + 1);
 
 	copyFields (matrix);
 	allocate (new_width, new_height);
 	// Copy the Eigen matrixes
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
 	WriteablePixels() = matrix.ReadablePixels().block(y0,x0,height,width);
+	plane_bytes_counter()->copied += (size_t)width * height * sizeof(pixel_t);
 	if (ColorMode != cmGRAY) {
-		WriteableColors() = matrix.ReadableColors().block(y0,x0,height,width);
+		writeableColors clr_plane = WriteableColors();
+		clr_plane.h = matrix.ReadableColors().h.block(y0,x0,height,width);
+		clr_plane.s = matrix.ReadableColors().s.block(y0,x0,height,width);
+		clr_plane.v = matrix.ReadableColors().v.block(y0,x0,height,width);
+		plane_bytes_counter()->copied += (size_t)width * height * sizeof(HSVcolor);
+	}
+	if (matrix.has_levels() && planes_are_movable()) {
+		allocate_levels (width, height);
+		_lvl_plane = matrix.ReadableLevels().block(y0,x0,height,width);
+		plane_bytes_counter()->copied += (size_t)width * height * sizeof(level_t);
 	}
 }
 
+void ImageMatrix::take (ImageMatrix &other) {
+	if (&other == this) return;
+	if (!other.planes_are_movable()) {
+		copy (other);
+		if (!other._is_pix_writeable) WriteablePixelsFinish();
+		if (!other._is_clr_writeable) WriteableColorsFinish();
+		return;
+	}
+	free_planes();
+	take_planes (other);
+}
+
+void ImageMatrix::take_planes (ImageMatrix &other) {
+	copyFields (other);
+	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
+	remap_pix_plane (other._pix_plane.data(), other._pix_plane.cols(), other._pix_plane.rows(), other._pix_plane.outerStride());
+	if (other._clr_plane.data()) {
+		remap_clr_plane (const_cast<byte *>(other._clr_plane.data()), other._clr_plane.cols(), other._clr_plane.rows(),
+			other._clr_plane.outerStride(), other._clr_plane.channel_offset());
+	}
+	new (&_lvl_plane) levelData (other._lvl_plane.data(), other._lvl_plane.rows(), other._lvl_plane.cols(),
+		planeStride (other._lvl_plane.outerStride()));
+	_is_view = other._is_view;
+	_pix_arena = other._pix_arena;
+	_clr_arena = other._clr_arena;
+	_lvl_arena = other._lvl_arena;
+	_map_ptr = other._map_ptr;
+	_map_bytes = other._map_bytes;
+	_is_pix_writeable = other._is_pix_writeable;
+	_is_clr_writeable = other._is_clr_writeable;
+
+	// other no longer owns anything, so free_planes() just resets its maps
+	other._is_view = true;
+	other.free_planes();
+	other.stats.reset();
+	other.has_median = false;
+}
+
+void ImageMatrix::submatrix_view (const ImageMatrix &matrix, const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2) {
+	unsigned int x0, y0;
+
+	// same bounds as submatrix()
+	x0 = (x1 < 0 ? 0 : x1);
+	y0 = (y1 < 0 ? 0 : y1);
+	// blocks reaching past the right or bottom edge are clipped to it
+	unsigned int new_width  = (x0 >= matrix.width  ? 0 : x2 >= matrix.width  ? matrix.width  - x0 : x2 - x0 + 1);
+	unsigned int new_height = (y0 >= matrix.height ? 0 : y2 >= matrix.height ? matrix.height - y0 : y2 - y0 + 1);
+
+	free_planes();
+	copyFields (matrix);
+	_is_view = true;
+	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
+	// The const_cast is OK, since the view is read-only
+	remap_pix_plane (const_cast<pixel_t *>(&(matrix.ReadablePixels().coeffRef (y0, x0))), new_width, new_height,
+		matrix.ReadablePixels().outerStride());
+	if (ColorMode != cmGRAY) {
+		remap_clr_plane (const_cast<byte *>(&(matrix.ReadableColors().h.coeffRef (y0, x0))), new_width, new_height,
+			matrix.ReadableColors().outerStride(), matrix.ReadableColors().channel_offset());
+	}
+	if (matrix.has_levels()) {
+		new (&_lvl_plane) levelData (const_cast<level_t *>(&(matrix.ReadableLevels().coeffRef (y0, x0))), new_height, new_width,
+			planeStride (matrix.ReadableLevels().outerStride()));
+	}
+	// a view's stats are computed from its own pixels, as they are for a submatrix() copy
+	stats.reset();
+	has_median = false;
+	finish();
+}
+
 /*
 * There is only one simple constructor implemented (no copy constructors or other constructors).
 * The reason for this is that a SharedImageMatrix subclass needs to override the allocate() method to make it shareable.
@@ -423,13 +1301,32 @@ void ImageMatrix::submatrix (const ImageMatrix &matrix, const unsigned int x1, c
 */
 ImageMatrix::~ImageMatrix() {
 	finish();
-	if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
-	if (_pix_plane.data()) Eigen::aligned_allocator<double>().deallocate (_pix_plane.data(), _pix_plane.size());
-	remap_pix_plane (NULL, 0, 0);
+	free_planes();
+}
 
-	if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "deallocating color %p\n",(void *)_clr_plane.data());
-	if (_clr_plane.data()) Eigen::aligned_allocator<HSVcolor>().deallocate (_clr_plane.data(), _clr_plane.size());
-	remap_clr_plane (NULL, 0, 0);
+// Deallocates the planes unless they belong to another matrix (i.e. this is a view), and maps them to NULL.
+// Planes mapped from a plane file are unmapped instead.
+// The maps are reset directly, since remap_clr_plane() leaves the color plane alone for cmGRAY.
+void ImageMatrix::free_planes() {
+	if (!_is_view && _map_ptr) {
+		if (verbosity > 7) fprintf (stdout, "unmapping plane file %p\n", _map_ptr);
+		munmap (_map_ptr, _map_bytes);
+	} else if (!_is_view) {
+		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
+		if (_pix_plane.data()) PlaneArena::release (_pix_arena, _pix_plane.data(), _pix_plane.size() * sizeof(pixel_t));
+
+		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "deallocating color %p\n",(void *)_clr_plane.data());
+		if (_clr_plane.data()) PlaneArena::release (_clr_arena, const_cast<byte *>(_clr_plane.data()), _clr_plane.size() * sizeof(HSVcolor));
+	}
+	free_levels();
+	new (&_pix_plane) pixData(NULL, 0, 0, planeStride (0));
+	_clr_plane.remap (NULL, 0, 0);
+	width  = 0;
+	height = 0;
+	_is_view = false;
+	_pix_arena = _clr_arena = NULL;
+	_map_ptr = NULL;
+	_map_bytes = 0;
 }
 
 // This is a general transform method that applies the specified transform to the specified ImageMatrix,
@@ -456,7 +1353,8 @@ void ImageMatrix::to8bits(const ImageMatrix &matrix_IN) {
 
 	double scale255 = (255.0/(max_val - min_val));
 
-	WriteablePixels() = ( (matrix_IN.ReadablePixels().array() - min_val) * scale255 ).unaryExpr (Moments2func(stats));
+	WriteablePixels() = (matrix_IN.ReadablePixels().array() - min_val) * scale255;
+	UpdateStats();
 }
 
 /* flipV
@@ -469,7 +1367,10 @@ void ImageMatrix::flipV() {
 
 	WriteablePixels() = ReadablePixels().rowwise().reverse();
 	if (ColorMode != cmGRAY) {
-		WriteableColors() = ReadableColors().rowwise().reverse();
+		writeableColors clr_plane = WriteableColors();
+		clr_plane.h = ReadableColors().h.rowwise().reverse();
+		clr_plane.s = ReadableColors().s.rowwise().reverse();
+		clr_plane.v = ReadableColors().v.rowwise().reverse();
 	}
 	// on its own, this operation doesn't affect the stats
 	stats = old_stats;
@@ -484,7 +1385,10 @@ void ImageMatrix::flipH() {
 
 	WriteablePixels() = ReadablePixels().colwise().reverse();
 	if (ColorMode != cmGRAY) {
-		WriteableColors() = ReadableColors().colwise().reverse();
+		writeableColors clr_plane = WriteableColors();
+		clr_plane.h = ReadableColors().h.colwise().reverse();
+		clr_plane.s = ReadableColors().s.colwise().reverse();
+		clr_plane.v = ReadableColors().v.colwise().reverse();
 	}
 	// on its own, this operation doesn't affect the stats
 	stats = old_stats;
@@ -493,156 +1397,169 @@ void ImageMatrix::flipH() {
 
 void ImageMatrix::invert() {
 	double max_val = max(), min_val = min();
-	WriteablePixels() = (max_val - ReadablePixels().array() + min_val).unaryExpr (Moments2func(stats));
+	WriteablePixels() = max_val - ReadablePixels().array() + min_val;
+	UpdateStats();
+}
+
+void ImageMatrix::invert (const ImageMatrix &matrix_IN) {
+	Moments2 in_stats;
+	matrix_IN.GetStats (in_stats);
+	double max_val = in_stats.max(), min_val = in_stats.min();
+
+	copyFields (matrix_IN);
+	allocate (matrix_IN.width, matrix_IN.height);
+	WriteablePixels() = max_val - matrix_IN.ReadablePixels().array() + min_val;
+	if (ColorMode != cmGRAY) WriteableColors() = matrix_IN.ReadableColors();
+	UpdateStats();
+}
+
+// The input samples that Downsample() averages into each output sample along one axis.
+// Output sample i is the sum of weights[offset[i]+k] * input[first[i]+k] for k < count[i], divided by the step.
+// The positions are accumulated step by step, and the partial samples are weighted the same way
+// as in the original per-pixel loops, so the sums come out bit for bit the same.
+struct area_taps_t {
+	std::vector<unsigned int> first, count, offset;
+	std::vector<double> weights;
+};
+
+static void area_taps (const unsigned int old_n, const unsigned int new_n, const double step, area_taps_t &taps) {
+	double x = 0, frac;
+	unsigned int i, a;
+
+	taps.first.assign (new_n, 0);
+	taps.count.assign (new_n, 0);
+	taps.offset.assign (new_n, 0);
+	taps.weights.clear();
+	for (i = 0; i < new_n; i++, x += step) {
+		taps.offset[i] = taps.weights.size();
+		if (! (x < old_n)) continue;
+
+		/* the leftmost fraction of a sample */
+		a = (unsigned int)(floor(x));
+		frac = ceil(x)-x;
+		taps.first[i] = (unsigned int)(ceil(x));
+		if (frac > 0 && a < old_n) {
+			taps.first[i] = a;
+			taps.weights.push_back (frac);
+		}
+		/* the middle full samples */
+		for (a = (unsigned int)(ceil(x)); a < floor(x+step); a++)
+			if (a < old_n) taps.weights.push_back (1.0);
+		/* the right fraction of a sample */
+		frac = x+step - floor(x+step);
+		if (frac > 0 && a < old_n) taps.weights.push_back (frac);
+		taps.count[i] = taps.weights.size() - taps.offset[i];
+	}
+}
+
+// Averages one row of samples along x.  The result is rounded to T, as the x pass always has been.
+template <typename T> static void area_average_row (const T *in, const area_taps_t &taps, const double step, T *out) {
+	for (size_t i = 0; i < taps.count.size(); i++) {
+		const T *samples = in + taps.first[i];
+		const double *weights = taps.count[i] ? &(taps.weights[taps.offset[i]]) : NULL;
+		double sum = 0;
+		for (unsigned int k = 0; k < taps.count[i]; k++)
+			sum += samples[k] * weights[k];
+		out[i] = (T)(sum/step);
+	}
 }
 
 /* Downsample
    down sample an image
    x_ratio, y_ratio -double- (0 to 1) the size of the new image comparing to the old one
-   FIXME: Since this is done in-place, there is potential for aliasing (i.e. new pixel values interfering with old pixel values)
+   The image is averaged over the area of each new pixel, first along x and then along y.
+   The rows are streamed: each input row is averaged along x once, and added into the one or two output rows it overlaps,
+   so there is no intermediate image.  matrix_IN may be this matrix.
 */
 void ImageMatrix::Downsample (const ImageMatrix &matrix_IN, double x_ratio, double y_ratio) {
-	double x,y,dx,dy,frac;
-	unsigned int new_x,new_y,a;
-	HSVcolor hsv;
-
+	double dx,dy;
 
 	if (x_ratio>1) x_ratio=1;
 	if (y_ratio>1) y_ratio=1;
 	dx=1/x_ratio;
 	dy=1/y_ratio;
 
-	if (dx == 1 && dy == 1) return;   /* nothing to scale */
-
-	ImageMatrix copy_matrix;
-	copy_matrix.copyFields (matrix_IN);
-	copy_matrix.allocate (matrix_IN.width, matrix_IN.height);
-	writeablePixels copy_pix_x = copy_matrix.WriteablePixels();
-	writeableColors copy_clr_x = copy_matrix.WriteableColors();
-
-	readOnlyPixels pix_plane_x = matrix_IN.ReadablePixels();
-	readOnlyColors clr_plane_x = matrix_IN.ReadableColors();
- 	unsigned int new_width = (unsigned int)(x_ratio*matrix_IN.width), new_height = (unsigned int)(y_ratio*matrix_IN.height),
- 		old_width = matrix_IN.width, old_height = matrix_IN.height;
-
-	// first downsample x
-	for (new_y = 0; new_y < old_height; new_y++) {
-		x = 0;
-		new_x = 0;
-		while (x < old_width) {
-			double sum_i = 0;
-			double sum_h = 0;
-			double sum_s = 0;
-			double sum_v = 0;
-
-			/* the leftmost fraction of pixel */
-			a = (unsigned int)(floor(x));
-			frac = ceil(x)-x;
-			if (frac > 0 && a < old_width) {
-				sum_i += pix_plane_x(new_y,a) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_x(new_y,a).h * frac;
-					sum_s += clr_plane_x(new_y,a).s * frac;
-					sum_v += clr_plane_x(new_y,a).v * frac;
-				}
-			} 
-
-			/* the middle full pixels */
-			for (a = (unsigned int)(ceil(x)); a < floor(x+dx); a++) {
-				if (a < old_width) {
-					sum_i += pix_plane_x(new_y,a);
-					if (ColorMode != cmGRAY) {
-						sum_h += clr_plane_x(new_y,a).h;
-						sum_s += clr_plane_x(new_y,a).s;
-						sum_v += clr_plane_x(new_y,a).v;
-					}
-				}
-			}
-			/* the right fraction of pixel */
-			frac = x+dx - floor(x+dx);
-			if (frac > 0 && a < old_width) {
-				sum_i += pix_plane_x(new_y,a) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_x(new_y,a).h * frac;
-					sum_s += clr_plane_x(new_y,a).s * frac;
-					sum_v += clr_plane_x(new_y,a).v * frac;
-				}
-			}
+	if (dx == 1 && dy == 1) {   /* nothing to scale */
+		if (&matrix_IN != this) copy (matrix_IN);
+		return;
+	}
 
-			copy_pix_x (new_y,new_x) = sum_i/(dx);
-			if (ColorMode != cmGRAY) {
-				hsv.h = (byte)(sum_h/(dx));
-				hsv.s = (byte)(sum_s/(dx));
-				hsv.v = (byte)(sum_v/(dx));
-				copy_clr_x (new_y, new_x) = hsv;
-			}
+	downsample_area (matrix_IN, (unsigned int)(x_ratio*matrix_IN.width), (unsigned int)(y_ratio*matrix_IN.height), dx, dy);
+}
 
-			x+=dx;
-			new_x++;
-		}
+// Downsamples to exactly new_width x new_height (e.g. from a pyramid level, whose size isn't an exact multiple of the result).
+void ImageMatrix::DownsampleTo (const ImageMatrix &matrix_IN, unsigned int new_width, unsigned int new_height) {
+	if (new_width > matrix_IN.width) new_width = matrix_IN.width;
+	if (new_height > matrix_IN.height) new_height = matrix_IN.height;
+	if (new_width == matrix_IN.width && new_height == matrix_IN.height) {   /* nothing to scale */
+		if (&matrix_IN != this) copy (matrix_IN);
+		return;
 	}
+	downsample_area (matrix_IN, new_width, new_height,
+		(double)matrix_IN.width / MAX (new_width, 1U), (double)matrix_IN.height / MAX (new_height, 1U));
+}
 
-	allocate (new_width, new_height);
-	writeablePixels copy_pix_y = WriteablePixels();
-	writeableColors copy_clr_y = WriteableColors();
-
-	readOnlyPixels pix_plane_y = copy_matrix.ReadablePixels();
-	readOnlyColors clr_plane_y = copy_matrix.ReadableColors();
-
-	/* downsample y */
-	for (new_x = 0; new_x < new_width; new_x++) {
-		y = 0;
-		new_y = 0;
-		while (y < old_height) {
-			double sum_i = 0;
-			double sum_h = 0;
-			double sum_s = 0;
-			double sum_v = 0;
-
-			a = (unsigned int)(floor(y));
-			frac = ceil(y) - y;
-			// take also the part of the leftmost pixel (if needed)
-			if (frac > 0 && a < old_height) {
-				sum_i += pix_plane_y(a,new_x) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_y(a,new_x).h * frac;
-					sum_s += clr_plane_y(a,new_x).s * frac;
-					sum_v += clr_plane_y(a,new_x).v * frac;
+void ImageMatrix::downsample_area (const ImageMatrix &matrix_IN, unsigned int new_width, unsigned int new_height, double dx, double dy) {
+	unsigned int y,a,k;
+	unsigned int old_width = matrix_IN.width, old_height = matrix_IN.height;
+	area_taps_t x_taps, y_taps;
+	area_taps (old_width, new_width, dx, x_taps);
+	area_taps (old_height, new_height, dy, y_taps);
+
+	// The input planes have to stay put until the end, so downsampling in place goes through a separate matrix
+	ImageMatrix in_place;
+	ImageMatrix &matrix_OUT = (&matrix_IN == this ? in_place : *this);
+	matrix_OUT.copyFields (matrix_IN);
+	matrix_OUT.allocate (new_width, new_height);
+	bool color = matrix_OUT.ColorMode != cmGRAY;
+
+	readOnlyPixels in_pix = matrix_IN.ReadablePixels();
+	readOnlyColors in_clr = matrix_IN.ReadableColors();
+	writeablePixels out_pix = matrix_OUT.WriteablePixels();
+	writeableColors out_clr = matrix_OUT.WriteableColors();
+
+	// one input row averaged along x (the last one that was needed), and the sums of the output row along y
+	ArenaBuffer<pixel_t> row_pix (new_width);
+	ArenaBuffer<double> sum_pix (new_width);
+	ArenaBuffer<byte> row_clr (color ? 3 * new_width : 0);
+	ArenaBuffer<double> sum_clr (color ? 3 * new_width : 0);
+	typedef Eigen::Map<Eigen::Array<pixel_t, 1, Eigen::Dynamic> > pixel_row_t;
+	typedef Eigen::Map<Eigen::Array<byte, 1, Eigen::Dynamic> > byte_row_t;
+	typedef Eigen::Map<Eigen::Array<double, 1, Eigen::Dynamic> > sum_row_t;
+	pixel_row_t row_pix_a (row_pix, new_width);
+	sum_row_t sum_pix_a (sum_pix, new_width);
+	byte_row_t row_clr_a (row_clr, color ? 3 * new_width : 0);
+	sum_row_t sum_clr_a (sum_clr, color ? 3 * new_width : 0);
+	unsigned int row_y = old_height; // the input row in row_pix/row_clr (none yet)
+
+	for (y = 0; y < new_height; y++) {
+		sum_pix_a.setZero();
+		if (color) sum_clr_a.setZero();
+		for (k = 0; k < y_taps.count[y]; k++) {
+			a = y_taps.first[y] + k;
+			double weight = y_taps.weights[y_taps.offset[y] + k];
+			// consecutive output rows share at most one input row, which is the last one averaged
+			if (a != row_y) {
+				area_average_row (&(in_pix.coeffRef (a, 0)), x_taps, dx, (pixel_t *)row_pix);
+				if (color) {
+					area_average_row (&(in_clr.h.coeffRef (a, 0)), x_taps, dx, (byte *)row_clr);
+					area_average_row (&(in_clr.s.coeffRef (a, 0)), x_taps, dx, (byte *)row_clr + new_width);
+					area_average_row (&(in_clr.v.coeffRef (a, 0)), x_taps, dx, (byte *)row_clr + 2 * new_width);
 				}
+				row_y = a;
 			}
-			for (a = (unsigned int)(ceil(y)); a < floor(y+dy); a++) {
-				if (a < old_height) {
-					sum_i += pix_plane_y(a,new_x);
-					if (ColorMode != cmGRAY) {
-						sum_h += clr_plane_y(a,new_x).h;
-						sum_s += clr_plane_y(a,new_x).s;
-						sum_v += clr_plane_y(a,new_x).v;
-					}
-				}
-			}
-			frac=y+dy-floor(y+dy);
-			if (frac > 0 && a < old_height) {
-				sum_i += pix_plane_y(a,new_x) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_y(a,new_x).h * frac;
-					sum_s += clr_plane_y(a,new_x).s * frac;
-					sum_v += clr_plane_y(a,new_x).v * frac;
-				}
-			}
-			if (new_x < new_width && new_y < new_height) {
-				copy_pix_y (new_y,new_x) = stats.add (sum_i/dy);
-				if (ColorMode != cmGRAY) {
-					hsv.h = (byte)(sum_h/(dy));
-					hsv.s = (byte)(sum_s/(dy));
-					hsv.v = (byte)(sum_v/(dy));
-					copy_clr_y (new_y, new_x) = hsv;
-				}
-			}
-
-			y+=dy;
-			new_y++;
+			sum_pix_a += row_pix_a.cast<double>() * weight;
+			if (color) sum_clr_a += row_clr_a.cast<double>() * weight;
+		}
+		out_pix.row (y) = (sum_pix_a / dy).cast<pixel_t>().matrix();
+		if (color) {
+			out_clr.h.row (y) = (sum_clr_a.segment (0, new_width) / dy).cast<byte>().matrix();
+			out_clr.s.row (y) = (sum_clr_a.segment (new_width, new_width) / dy).cast<byte>().matrix();
+			out_clr.v.row (y) = (sum_clr_a.segment (2 * new_width, new_width) / dy).cast<byte>().matrix();
 		}
 	}
+	matrix_OUT.UpdateStats();
+	if (&matrix_OUT != this) take (matrix_OUT);
 }
 
 
@@ -675,17 +1592,38 @@ void ImageMatrix::Rotate(const ImageMatrix &matrix_IN, double angle) {
 	// a 180 is simply a reverse of the matrix
 	// a 90 is m.transpose().rowwise.reverse()
 	// a 270 is m.transpose()
+	// the color planes are rotated along with the pixels, since the new planes may be recycled from the arena
+	bool color = ColorMode != cmGRAY;
+	readOnlyColors in_clr = matrix_IN.ReadableColors();
 	switch ((int)angle) {
 		case 90:
 			WriteablePixels() = matrix_IN.ReadablePixels().transpose().rowwise().reverse();
+			if (color) {
+				writeableColors clr_plane = WriteableColors();
+				clr_plane.h = in_clr.h.transpose().rowwise().reverse();
+				clr_plane.s = in_clr.s.transpose().rowwise().reverse();
+				clr_plane.v = in_clr.v.transpose().rowwise().reverse();
+			}
 		break;
 
 		case 180:
 			WriteablePixels() = matrix_IN.ReadablePixels().reverse();
+			if (color) {
+				writeableColors clr_plane = WriteableColors();
+				clr_plane.h = in_clr.h.reverse();
+				clr_plane.s = in_clr.s.reverse();
+				clr_plane.v = in_clr.v.reverse();
+			}
 		break;
 
 		case 270:
 			WriteablePixels() = matrix_IN.ReadablePixels().transpose();
+			if (color) {
+				writeableColors clr_plane = WriteableColors();
+				clr_plane.h = in_clr.h.transpose();
+				clr_plane.s = in_clr.s.transpose();
+				clr_plane.v = in_clr.v.transpose();
+			}
 		break;
 	}
 	
@@ -694,6 +1632,119 @@ void ImageMatrix::Rotate(const ImageMatrix &matrix_IN, double angle) {
 	has_median = old_has_median;
 }
 
+// Computes the stats a row at a time:  Each row is reduced with Eigen's vectorized minCoeff/maxCoeff/sum,
+// then its squared deviations are summed while it's still in cache, and the row is combined with the previous ones
+// using Moments2::add_block().  Rows containing NaNs or values outside of Moments2's range are added one pixel at a time
+// so that those pixels are skipped the same way Moments2::add() skips them.
+// N.B.: The sums are done in double.  With float pixels, cast<double>() isn't vectorized by Eigen.
+static void plane_stats (readOnlyPixels pix_plane, Moments2 &moments2) {
+	moments2.reset();
+	for (unsigned int y = 0; y < pix_plane.rows(); y++) {
+		const size_t n = pix_plane.cols();
+		if (n == 0) break;
+		double row_min = pix_plane.row(y).minCoeff();
+		double row_max = pix_plane.row(y).maxCoeff();
+		double row_mean = pix_plane.row(y).cast<double>().sum() / n;
+		if (std::isnan (row_mean) || row_max > MAX_VAL || row_min < MIN_VAL) {
+			for (unsigned int x = 0; x < n; x++) moments2.add (pix_plane (y, x));
+		} else {
+			double row_M2 = (pix_plane.row(y).cast<double>().array() - row_mean).square().sum();
+			moments2.add_block (n, row_min, row_max, row_mean, row_M2);
+		}
+	}
+}
+
+// Histogram bin of a pixel value.  This is monotonic in val, which get_median() relies on.
+static inline unsigned long pixel_bin (const double val, const double h_min, const double h_scale, const unsigned long nbins) {
+	unsigned long bin = (unsigned long)(( (val - h_min)*h_scale));
+	if (bin >= nbins) bin = nbins-1;
+	return (bin);
+}
+
+// Counts the pixels in each histogram bin.
+// Consecutive pixels are counted in separate copies of the bins, so that runs of pixels falling in the same bin
+// don't stall on the same counter.  The copies are summed at the end.
+#define HIST_LANES 4
+static void plane_histogram (readOnlyPixels pix_plane, const double h_min, const double h_scale,
+	const unsigned long nbins, std::vector<size_t> &counts) {
+	std::vector<size_t> lanes (HIST_LANES * nbins, 0);
+	size_t *lane0 = &lanes[0], *lane1 = lane0 + nbins, *lane2 = lane1 + nbins, *lane3 = lane2 + nbins;
+	const unsigned int w = pix_plane.cols();
+
+	for (unsigned int y = 0; y < pix_plane.rows(); y++) {
+		const pixel_t *row = pix_plane.data() + y * pix_plane.outerStride();
+		unsigned int x = 0;
+		for (; x + HIST_LANES <= w; x += HIST_LANES) {
+			lane0[pixel_bin (row[x  ], h_min, h_scale, nbins)]++;
+			lane1[pixel_bin (row[x+1], h_min, h_scale, nbins)]++;
+			lane2[pixel_bin (row[x+2], h_min, h_scale, nbins)]++;
+			lane3[pixel_bin (row[x+3], h_min, h_scale, nbins)]++;
+		}
+		for (; x < w; x++) lane0[pixel_bin (row[x], h_min, h_scale, nbins)]++;
+	}
+
+	counts.resize (nbins);
+	for (unsigned long bin = 0; bin < nbins; bin++)
+		counts[bin] = lane0[bin] + lane1[bin] + lane2[bin] + lane3[bin];
+}
+
+// The range of an image's levels.  The pixels are the levels, so valid cached stats have it already.
+void ImageMatrix::level_range (level_t &lo, level_t &hi) const {
+	readOnlyLevels lvl_plane = ReadableLevels();
+	const unsigned int w = lvl_plane.cols();
+
+	if (stats.n() > 0 && stats.n() == (size_t)width * height) {
+		lo = (level_t)stats.min();
+		hi = (level_t)stats.max();
+		return;
+	}
+	lo = (level_t)-1;
+	hi = 0;
+	for (unsigned int y = 0; y < lvl_plane.rows(); y++) {
+		const level_t *row = lvl_plane.data() + y * lvl_plane.outerStride();
+		for (unsigned int x = 0; x < w; x++) {
+			lo = MIN (lo, row[x]);
+			hi = MAX (hi, row[x]);
+		}
+	}
+}
+
+// Counts the pixels at each level from lo to lo + n_levels - 1 (which must hold all of them), in lanes like plane_histogram()
+static void count_levels (readOnlyLevels lvl_plane, const level_t lo, const size_t n_levels, std::vector<size_t> &counts) {
+	std::vector<unsigned int> lanes (HIST_LANES * n_levels, 0);
+	unsigned int *lane0 = &lanes[0], *lane1 = lane0 + n_levels, *lane2 = lane1 + n_levels, *lane3 = lane2 + n_levels;
+	const unsigned int w = lvl_plane.cols();
+
+	for (unsigned int y = 0; y < lvl_plane.rows(); y++) {
+		const level_t *row = lvl_plane.data() + y * lvl_plane.outerStride();
+		unsigned int x = 0;
+		for (; x + HIST_LANES <= w; x += HIST_LANES) {
+			lane0[row[x  ] - lo]++;
+			lane1[row[x+1] - lo]++;
+			lane2[row[x+2] - lo]++;
+			lane3[row[x+3] - lo]++;
+		}
+		for (; x < w; x++) lane0[row[x] - lo]++;
+	}
+
+	counts.resize (n_levels);
+	for (size_t level = 0; level < n_levels; level++)
+		counts[level] = (size_t)lane0[level] + lane1[level] + lane2[level] + lane3[level];
+}
+
+// The same bins as plane_histogram() from the levels:  Only integers are touched per pixel,
+// and each level's bin is computed once rather than once per pixel.
+static void level_histogram (readOnlyLevels lvl_plane, const level_t lo, const level_t hi,
+	const double h_min, const double h_scale, const unsigned long nbins, std::vector<size_t> &counts) {
+	std::vector<size_t> level_counts;
+	const size_t n_levels = (size_t)hi - lo + 1;
+
+	count_levels (lvl_plane, lo, n_levels, level_counts);
+	counts.assign (nbins, 0);
+	for (size_t level = 0; level < n_levels; level++)
+		if (level_counts[level]) counts[pixel_bin ((double)(lo + level), h_min, h_scale, nbins)] += level_counts[level];
+}
+
 // This pair of methods makes median-finding with and without caching for regular and const ImageMatrix objects
 double ImageMatrix::update_median () {
 	if (has_median) return _median;
@@ -703,23 +1754,80 @@ double ImageMatrix::update_median () {
 	return _median;
 }
 
+// The median is found without copying the image:  A histogram over [min,max] locates the bin(s) holding
+// the middle rank(s), and only the pixels in those bins are copied and partially sorted.
+// The result is exactly the same as sorting all of the pixels.
+#define MEDIAN_BINS 4096
 double ImageMatrix::get_median () const {
+	if (has_median) return _median;
+
 	double median;
 	size_t num = width * height;
-	std::vector<double> v (num);
-
+	size_t half = num / 2;
 	readOnlyPixels pix_plane = ReadablePixels();
-	for (size_t i = 0; i < num; i++) v[i] = pix_plane.array().coeff(i);
-    size_t half = num / 2;
+
+	// With levels, the counts of each level give the values at the middle rank(s) directly.
+	if (has_levels() && num > 0) {
+		level_t lo, hi;
+		std::vector<size_t> level_counts;
+		level_range (lo, hi);
+		count_levels (ReadableLevels(), lo, (size_t)hi - lo + 1, level_counts);
+
+		size_t rank = (num % 2 == 0 ? half - 1 : half), below = 0, level = 0;
+		while (below + level_counts[level] <= rank) below += level_counts[level++];
+		median = (double)(lo + level);
+		if (num % 2 == 0) {
+			while (below + level_counts[level] <= half) below += level_counts[level++];
+			median = (median + (double)(lo + level)) / 2.0;
+		}
+		return (median);
+	}
+
+	Moments2 local_stats;
+	GetStats (local_stats);
+	if (num > 0 && local_stats.n() == num && !(local_stats.max() > local_stats.min()))
+		return (local_stats.min());
+
+	std::vector<double> v;
+	size_t rank_lo = (num % 2 == 0 && num > 0 ? half - 1 : half);
+	const double h_min = local_stats.min();
+	const double h_scale = (double)MEDIAN_BINS / (local_stats.max() - local_stats.min());
+	if (num > 0 && local_stats.n() == num && !std::isinf (h_scale)) {
+		std::vector<size_t> counts;
+		plane_histogram (pix_plane, h_min, h_scale, MEDIAN_BINS, counts);
+
+		// the bins holding rank_lo and half, and the number of pixels below the first one
+		unsigned long bin_lo = 0, bin_hi;
+		size_t below = 0;
+		while (below + counts[bin_lo] <= rank_lo) below += counts[bin_lo++];
+		bin_hi = bin_lo;
+		size_t below_hi = below;
+		while (below_hi + counts[bin_hi] <= half) below_hi += counts[bin_hi++];
+
+		v.reserve (below_hi + counts[bin_hi] - below);
+		for (unsigned int y = 0; y < height; y++) {
+			for (unsigned int x = 0; x < width; x++) {
+				unsigned long bin = pixel_bin (pix_plane (y, x), h_min, h_scale, MEDIAN_BINS);
+				if (bin >= bin_lo && bin <= bin_hi) v.push_back (pix_plane (y, x));
+			}
+		}
+		rank_lo -= below;
+	} else {
+		// NaNs or out-of-range values - the same as before, with all of the pixels.
+		v.resize (num);
+		size_t i = 0;
+		for (unsigned int y = 0; y < height; y++)
+			for (unsigned int x = 0; x < width; x++)
+				v[i++] = pix_plane (y, x);
+	}
+	if (v.empty()) return (0);
+
+	nth_element(v.begin(), v.begin()+rank_lo, v.end());
+	median = v[rank_lo];
 	if (num % 2 == 0) {
-		nth_element(v.begin(), v.begin()+half, v.end());
-		median = v[half];
-		nth_element(v.begin(), v.begin()+half-1, v.end());
-		median += (v[half-1]);
+		// the next rank is the smallest of the values after rank_lo
+		median += *std::min_element (v.begin()+rank_lo+1, v.end());
 		median /= 2.0;
-	} else {
-		nth_element(v.begin(), v.begin()+half, v.end());
-		median = v[half];
 	}
 
 	return median;
@@ -727,13 +1835,7 @@ double ImageMatrix::get_median () const {
 
 // This updates the sats and caches them in a non-const ImageMatrix.
 void ImageMatrix::UpdateStats() {
-	stats.reset();
-	// note that sum() is there to force the evaluation of all of the coefficients.
-	// hopefully the compiler won't optimize this away since we ignore the return.
-	// Its not necessary to use sum() if using unaryExpr as part of an Eigen expression that gets assigned to something
-	// e.g. invert and compute stats in one pass:
-	// WriteablePixels() = (max_val - ReadablePixels().array() + min_val).unaryExpr (Moments2func(stats));
-	ReadablePixels().unaryExpr (Moments2func(stats)).sum();
+	plane_stats (ReadablePixels(), stats);
 }
 
 // This calculates sats and puts them in an externally supplied stats object, keeping the ImageMatrix const
@@ -742,12 +1844,7 @@ void ImageMatrix::GetStats (Moments2 &moments2) const {
 	if (stats.n() == width*height)
 		moments2 = stats;
 	else {
-		// note that sum() is there to force the evaluation of all of the coefficients.
-		// hopefully the compiler won't optimize this away since we ignore the return.
-		// Its not necessary to use sum() if using unaryExpr as part of an Eigen expression that gets assigned to something
-		// e.g. invert and compute stats in one pass:
-		// WriteablePixels() = (max_val - ReadablePixels().array() + min_val).unaryExpr (Moments2func(stats));
-		ReadablePixels().unaryExpr (Moments2func(moments2)).sum();
+		plane_stats (ReadablePixels(), moments2);
 		// std::cout << "cache miss n=" << moments2.n() << std::endl;
 	}
 }
@@ -780,7 +1877,13 @@ void ImageMatrix::normalize(double n_min, double n_max, long n_range, double n_m
 
     /* normalize to n_mean and n_std */
 	if (n_mean > 0) {
-		double d_mean = mean() - n_mean, std_fact = (n_std > 0 ? n_std : 0)/std();
+		// The mean and std are added up a pixel at a time, in the order they were before plane_stats() reduced by row.
+		// The row-wise stats can differ in the last bit, which would change the features of every normalized image.
+		Moments2 pix_stats;
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				pix_stats.add (pix_plane (y,x));
+		double d_mean = pix_stats.mean() - n_mean, std_fact = (n_std > 0 ? n_std : 0)/pix_stats.std();
 		double max_range = pow((double)2,bits)-1;
 		for (y = 0; y < height; y++) {
 			for (x = 0; x < width; x++) {
@@ -795,40 +1898,157 @@ void ImageMatrix::normalize(double n_min, double n_max, long n_range, double n_m
 	}	   
 }
 
-/* convolve
+/* 2D correlation engine
+   The kernel is applied in one of three ways, all with zero borders:
+   - separable (rank 1) kernels as a row pass followed by a column pass.
+   - other small kernels directly, adding each kernel tap times a row segment of the input to a row of the output.
+     Only the segments that stay inside the image are added, so there are no per-pixel bounds checks, and Eigen vectorizes them.
+   - large kernels by multiplying the spectra of the zero-padded input and kernel from FFTW.
 */
-void ImageMatrix::convolve(const pixDataMat &filter) {
-	unsigned long x, y, xx, yy;
-	long i, j;
-	long height2=filter.rows()/2;
-	long width2=filter.cols()/2;
-	double tmp;
-
-	std::string tmp_string;
-	ImageMatrix temp;
-	temp.copy (*this);
-	temp.finish();
-	readOnlyPixels copy_pix_plane = temp.ReadablePixels();
-	writeablePixels pix_plane = WriteablePixels();
-	for (x = 0; x < width; ++x) {
-		for (y = 0; y < height; ++y) {
-			tmp=0.0;
-			for (i = -width2; i <= width2; ++i) {
-				xx=x+i;
-				if (xx < width && xx >= 0) {
-					for(j = -height2; j <= height2; ++j) {
-						yy=y+j;
-						if (yy >= 0 && yy < height) {
-							tmp += filter (j+height2, i+width2) * copy_pix_plane(yy,xx);
-						}
-					}
-				}
+// The FFTW planner is not thread-safe (only fftw_execute is), so plan creation and destruction are serialized
+// for concurrent plan executors.
+static pthread_mutex_t fftw_planner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Relative cost of an FFT correlation per padded pixel per log2 of the padded size,
+// versus one multiply-add per kernel tap and pixel for the direct correlation.
+#define CORRELATE_FFT_COST 5.0
+
+// FFTW is fastest for sizes that are products of small primes
+static unsigned int fft_good_size (unsigned int n) {
+	for (;; n++) {
+		unsigned int m = n;
+		while (m % 2 == 0) m /= 2;
+		while (m % 3 == 0) m /= 3;
+		while (m % 5 == 0) m /= 5;
+		while (m % 7 == 0) m /= 7;
+		if (m == 1) return (n);
+	}
+}
+
+// If the kernel is the outer product of a column and a row, sets them and returns true.
+static bool separable_kernel (const pixDataMat &kernel, pixDataMat &col, pixDataMat &row) {
+	pixDataMat::Index piv_y, piv_x;
+	double max_abs = kernel.cwiseAbs().maxCoeff (&piv_y, &piv_x);
+	if (!(max_abs > 0)) return (false);
+
+	col = kernel.col (piv_x);
+	row = kernel.row (piv_y) / kernel (piv_y, piv_x);
+	return ( (kernel - col * row).cwiseAbs().maxCoeff() <= 16 * DBL_EPSILON * max_abs);
+}
+
+static void correlate_direct (readOnlyPixels in, const pixDataMat &kernel, const int anchor_y, const int anchor_x, writeablePixels out) {
+	const int w = in.cols(), h = in.rows(), kh = kernel.rows(), kw = kernel.cols();
+
+	out.setZero();
+	for (int y = 0; y < h; y++) {
+		for (int j = 0; j < kh; j++) {
+			const int yy = y + j - anchor_y;
+			if (yy < 0 || yy >= h) continue;
+			for (int i = 0; i < kw; i++) {
+				const pixel_t k = kernel (j, i);
+				if (k == 0) continue;
+				// out(y,x) gets in(yy,x + i - anchor_x) for the x where that is inside the row
+				const int x0 = std::max (0, anchor_x - i), x1 = std::min (w, w + anchor_x - i);
+				if (x1 > x0) out.row(y).segment (x0, x1 - x0) += k * in.row(yy).segment (x0 + i - anchor_x, x1 - x0);
 			}
-			pix_plane (y,x) = stats.add(tmp);
 		}
 	}
 }
 
+static void correlate_fft (readOnlyPixels in, const pixDataMat &kernel, const int anchor_y, const int anchor_x, writeablePixels out) {
+	const int w = in.cols(), h = in.rows(), kh = kernel.rows(), kw = kernel.cols();
+	// padding each dimension to at least the size of the full correlation turns the circular convolution into a linear one
+	const int pw = fft_good_size (w + kw - 1), ph = fft_good_size (h + kh - 1), half_pw = pw/2+1;
+	fftw_plan in_plan, kernel_plan, inverse_plan;
+
+	double *in_pad = (double*) fftw_malloc (sizeof(double) * pw*ph);
+	double *kernel_pad = (double*) fftw_malloc (sizeof(double) * pw*ph);
+	fftw_complex *in_f = (fftw_complex*) fftw_malloc (sizeof(fftw_complex) * half_pw*ph);
+	fftw_complex *kernel_f = (fftw_complex*) fftw_malloc (sizeof(fftw_complex) * half_pw*ph);
+	pthread_mutex_lock (&fftw_planner_mutex);
+	in_plan = fftw_plan_dft_r2c_2d (ph, pw, in_pad, in_f, FFTW_ESTIMATE);
+	kernel_plan = fftw_plan_dft_r2c_2d (ph, pw, kernel_pad, kernel_f, FFTW_ESTIMATE);
+	inverse_plan = fftw_plan_dft_c2r_2d (ph, pw, in_f, in_pad, FFTW_ESTIMATE);
+	pthread_mutex_unlock (&fftw_planner_mutex);
+
+	// The input goes at the origin, and the kernel is flipped to turn the convolution into a correlation
+	Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > in_pad_plane (in_pad, ph, pw);
+	Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> > kernel_pad_plane (kernel_pad, ph, pw);
+	in_pad_plane.setZero();
+	in_pad_plane.topLeftCorner (h, w) = in.cast<double>();
+	kernel_pad_plane.setZero();
+	kernel_pad_plane.topLeftCorner (kh, kw) = kernel.cast<double>().colwise().reverse().rowwise().reverse();
+
+	fftw_execute (in_plan);
+	fftw_execute (kernel_plan);
+	const double scale = 1.0 / ((double)pw * ph);
+	for (int i = 0; i < half_pw*ph; i++) {
+		double re = in_f[i][0] * kernel_f[i][0] - in_f[i][1] * kernel_f[i][1];
+		double im = in_f[i][0] * kernel_f[i][1] + in_f[i][1] * kernel_f[i][0];
+		in_f[i][0] = re * scale;
+		in_f[i][1] = im * scale;
+	}
+	fftw_execute (inverse_plan);
+
+	// the full correlation starts kh-1-anchor_y rows and kw-1-anchor_x columns before the output
+	out = in_pad_plane.block (kh - 1 - anchor_y, kw - 1 - anchor_x, h, w).cast<pixel_t>();
+
+	pthread_mutex_lock (&fftw_planner_mutex);
+	fftw_destroy_plan (in_plan);
+	fftw_destroy_plan (kernel_plan);
+	fftw_destroy_plan (inverse_plan);
+	pthread_mutex_unlock (&fftw_planner_mutex);
+	fftw_free (in_pad);
+	fftw_free (kernel_pad);
+	fftw_free (in_f);
+	fftw_free (kernel_f);
+}
+
+void correlate2D (readOnlyPixels in, const pixDataMat &kernel, const unsigned int anchor_y, const unsigned int anchor_x, writeablePixels out) {
+	const unsigned int w = in.cols(), h = in.rows(), kh = kernel.rows(), kw = kernel.cols();
+	assert (anchor_y < kh && anchor_x < kw && "Kernel anchor outside of the kernel");
+	assert (out.cols() == in.cols() && out.rows() == in.rows());
+	if (w == 0 || h == 0) return;
+
+	pixDataMat col, row;
+	if (kh > 1 && kw > 1 && separable_kernel (kernel, col, row)) {
+		ImageMatrix rows_pass;
+		rows_pass.allocate (w, h);
+		correlate_direct (in, row, 0, anchor_x, rows_pass.WriteablePixels());
+		correlate_direct (rows_pass.ReadablePixels(), col, anchor_y, 0, out);
+		return;
+	}
+
+	double direct_cost = (double)w * h * (kernel.array() != 0).count();
+	double padded_size = (double)fft_good_size (w + kw - 1) * fft_good_size (h + kh - 1);
+	if (CORRELATE_FFT_COST * padded_size * log2 (padded_size) < direct_cost)
+		correlate_fft (in, kernel, anchor_y, anchor_x, out);
+	else
+		correlate_direct (in, kernel, anchor_y, anchor_x, out);
+}
+
+/* convolve
+   Correlates the image with the filter centered on each pixel, with zero borders.
+   N.B.: The filter is not flipped, so this is a correlation despite the name.
+*/
+void ImageMatrix::convolve(const pixDataMat &filter) {
+	assert (_is_pix_writeable && "Attempt to write to read-only pixels");
+	// The filter is applied into a new matrix, which then replaces this one's planes.
+	// The colors aren't filtered, so the new matrix gets them last, if at all.
+	ImageMatrix result;
+	result.copyFields (*this);
+	result.ColorMode = cmGRAY;
+	result.allocate (width, height);
+	correlate2D (ReadablePixels(), filter, filter.rows()/2, filter.cols()/2, result.WriteablePixels());
+	if (ColorMode != cmGRAY) {
+		result.ColorMode = ColorMode;
+		result.allocate (width, height);
+		result.WriteableColors() = ReadableColors();
+		plane_bytes_counter()->copied += (size_t)width * height * sizeof(HSVcolor);
+	}
+	take (result);
+}
+
 /* find the basic color statistics
    hue_avg_p -double *- average hue
    hue_std_p -double *- standard deviation of the hue
@@ -847,7 +2067,6 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 	unsigned int a, x, y, pixel_index=0;
 	unsigned long color_index=0;
 	double max_val,pixel_num;
-	double certainties[COLORS_NUM+1];
 	byte h, s, v;
 	readOnlyColors clr_plane = ReadableColors();
 
@@ -861,10 +2080,11 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 		for (a=0;a<=COLORS_NUM;a++)
 			colors[a]=0;
 	for (y = 0; y < height; y++) {
+		const byte *h_row = &clr_plane.h.coeffRef (y, 0), *s_row = &clr_plane.s.coeffRef (y, 0), *v_row = &clr_plane.v.coeffRef (y, 0);
 		for (x = 0; x < width; x++) {
-			h = clr_plane(y,x).h;
-			s = clr_plane(y,x).s;
-			v = clr_plane(y,x).v;
+			h = h_row[x];
+			s = s_row[x];
+			v = v_row[x];
 			// This is Welford's cumulative mean+variance algorithm as reported by Knuth
 			pixel_index++;
 			// h
@@ -880,7 +2100,7 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 			val_avg += delta/pixel_index;
 			M2v += delta * (v - val_avg);
 
-			color_index=FindColor(h,s,v,certainties);
+			color_index=FindColorIndex(h,s,v);
 			colors[color_index]+=1;
 		}
 	}
@@ -920,11 +2140,9 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 */
 void ImageMatrix::ColorTransform (const ImageMatrix &matrix_IN) {  
 	unsigned int x,y; //,base_color;
-	double cb_intensity;
 	double max_range = pow((double)2,8)-1;
-	HSVcolor hsv_pixel;
+	double cb_intensity[COLORS_NUM+1];
 	unsigned long color_index=0;   
-	double certainties[COLORS_NUM+1];
 
 	copyFields (matrix_IN);
 	// The result is an intensity image, so eliminate the color plane
@@ -933,40 +2151,34 @@ void ImageMatrix::ColorTransform (const ImageMatrix &matrix_IN) {
 	writeablePixels out_plane = WriteablePixels();
 	readOnlyColors clr_plane = matrix_IN.ReadableColors();
 
+	// the greyscale value of each color index
+	for (color_index = 0; color_index <= COLORS_NUM; color_index++)
+		cb_intensity[color_index] = int( ( max_range * color_index ) / COLORS_NUM );
+
 	// find the colors
 	for( y = 0; y < height; y++ ) {
+		const byte *h_row = &clr_plane.h.coeffRef (y, 0), *s_row = &clr_plane.s.coeffRef (y, 0), *v_row = &clr_plane.v.coeffRef (y, 0);
 		for( x = 0; x < width; x++ ) { 
-			hsv_pixel = clr_plane (y, x);
-			color_index = FindColor( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, certainties );
-			// convert the color index to a greyscale value
-			cb_intensity = int( ( max_range * color_index ) / COLORS_NUM );
-			out_plane (y, x) = stats.add (cb_intensity);
+			color_index = FindColorIndex( h_row[x], s_row[x], v_row[x] );
+			out_plane (y, x) = cb_intensity[color_index];
 		}
 	}
+	UpdateStats();
 }
 
 void ImageMatrix::HueTransform (const ImageMatrix &matrix_IN) {  
-	unsigned int x,y; //,base_color;
-
 	copyFields (matrix_IN);
 	// The result is an intensity image, so eliminate the color plane
 	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
-	writeablePixels out_plane = WriteablePixels();
-	readOnlyColors clr_plane = matrix_IN.ReadableColors();
-
-	// find the colors
-	for( y = 0; y < height; y++ ) {
-		for( x = 0; x < width; x++ ) { 
-			out_plane (y, x) = stats.add (clr_plane (y, x).h);
-		}
-	}
+	WriteablePixels() = matrix_IN.ReadableColors().h.cast<pixel_t>();
+	UpdateStats();
 }
 
 /* get image histogram */
 void ImageMatrix::histogram(double *bins,unsigned short nbins, bool imhist, const Moments2 &in_stats) const {
-	unsigned long a, bin, num = width*height;
-	double val,  h_min = INF, h_max = -INF, h_scale;
+	double h_min = INF, h_max = -INF, h_scale;
+	level_t lo = 0, hi = 0;
 	readOnlyPixels pix_plane = ReadablePixels();
 
 	/* find the minimum and maximum */
@@ -976,6 +2188,10 @@ void ImageMatrix::histogram(double *bins,unsigned short nbins, bool imhist, cons
 	} else if (in_stats.n() > 0) {
 		h_min = in_stats.min();
 		h_max = in_stats.max();
+	} else if (has_levels()) {
+		level_range (lo, hi);
+		h_min = lo;
+		h_max = hi;
 	} else {
 		// to keep this const method from modifying the object, we use GetStats on a local Moments2 object
 		Moments2 local_stats;
@@ -986,22 +2202,23 @@ void ImageMatrix::histogram(double *bins,unsigned short nbins, bool imhist, cons
 	if (h_max-h_min > 0) h_scale = (double)nbins / double(h_max-h_min);
 	else h_scale = 0;
 
-	// initialize the bins
-	memset(bins, 0, nbins * sizeof (double));
-
-   // build the histogram
-	for (a = 0; a < num; a++) {
-		val = pix_plane.array().coeff(a);
-		bin = (unsigned long)(( (val - h_min)*h_scale));
-		if (bin >= nbins) bin = nbins-1;
-		bins[bin] += 1.0;
+	// build the histogram
+	std::vector<size_t> counts;
+	if (has_levels()) {
+		if (imhist || in_stats.n() > 0) level_range (lo, hi);
+		level_histogram (ReadableLevels(), lo, hi, h_min, h_scale, nbins, counts);
+	} else {
+		plane_histogram (pix_plane, h_min, h_scale, nbins, counts);
 	}
+	for (unsigned long bin = 0; bin < nbins; bin++)
+		bins[bin] = (double)counts[bin];
 
 	return;
 }
 
 /* fft 2 dimensional transform */
 // http://www.fftw.org/doc/
+// See fftw_planner_mutex above
 double ImageMatrix::fft2 (const ImageMatrix &matrix_IN) {
 	fftw_plan p;
 	unsigned int half_height = matrix_IN.height/2+1;
@@ -1013,7 +2230,9 @@ double ImageMatrix::fft2 (const ImageMatrix &matrix_IN) {
 
 	double *in = (double*) fftw_malloc(sizeof(double) * width*height);
  	fftw_complex *out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * width*height);
+	pthread_mutex_lock (&fftw_planner_mutex);
 	p = fftw_plan_dft_r2c_2d(width,height,in,out, FFTW_MEASURE); // FFTW_ESTIMATE: deterministic
+	pthread_mutex_unlock (&fftw_planner_mutex);
 	unsigned int x,y;
  	for (x=0;x<width;x++)
  		for (y=0;y<height;y++)
@@ -1040,7 +2259,9 @@ double ImageMatrix::fft2 (const ImageMatrix &matrix_IN) {
  			out_plane (y,x) = stats.add (out_plane (height - y, width - x));
 
 	// clean up
+	pthread_mutex_lock (&fftw_planner_mutex);
 	fftw_destroy_plan(p);
+	pthread_mutex_unlock (&fftw_planner_mutex);
 	fftw_free(in);
 	fftw_free(out);
 
@@ -1114,7 +2335,6 @@ void ImageMatrix::ChebyshevFourierTransform2D(double *coeff) const {
 	const ImageMatrix *const_matrix;
 	if( (width * height) > (300 * 300) ) {
 		matrix = new ImageMatrix;
-		matrix->copy (*this);
 		matrix->Downsample(*this, MIN( 300.0/(double)width, 300.0/(double)height ), MIN( 300.0/(double)width, 300.0/(double)height ) );  /* downsample for avoiding memory problems */
 		const_matrix = matrix;
 	} else {
@@ -1288,23 +2508,32 @@ void ImageMatrix::EdgeStatistics(unsigned long *EdgeArea, double *MagMean, doubl
 	double *MagHist, double *DirecMean, double *DirecMedian, double *DirecVar, double *DirecHist,
 	double *DirecHomogeneity, double *DiffDirecHist, unsigned int nbins) const {
 
-	unsigned int a,bin_index;
-	double min_val,max_val,sum, level;
-
 	ImageMatrix GradientMagnitude;
 	GradientMagnitude.PrewittMagnitude2D (*this);
-
-	readOnlyPixels GM_pix_plane = GradientMagnitude.ReadablePixels();
 	ImageMatrix GradientDirection;
 	GradientDirection.PrewittDirection2D (*this);
 
+	GradientStatistics (GradientMagnitude, GradientDirection, EdgeArea, MagMean, MagMedian, MagVar,
+		MagHist, DirecMean, DirecMedian, DirecVar, DirecHist, DirecHomogeneity, DiffDirecHist, nbins);
+}
+
+void ImageMatrix::GradientStatistics (const ImageMatrix &GradientMagnitude, const ImageMatrix &GradientDirection,
+	unsigned long *EdgeArea, double *MagMean, double *MagMedian, double *MagVar,
+	double *MagHist, double *DirecMean, double *DirecMedian, double *DirecVar, double *DirecHist,
+	double *DirecHomogeneity, double *DiffDirecHist, unsigned int nbins) {
+
+	unsigned int bin_index;
+	double sum, level;
+	Moments2 GM_stats, GD_stats;
+
+	readOnlyPixels GM_pix_plane = GradientMagnitude.ReadablePixels();
+
 	/* find gradient statistics */
-	*MagMedian = GradientMagnitude.update_median();
-	*MagMean   = GradientMagnitude.mean();
-	*MagVar    = GradientMagnitude.var();
-	min_val   = GradientMagnitude.min();
-	max_val   = GradientMagnitude.max();
-	GradientMagnitude.histogram (MagHist, nbins, false);
+	*MagMedian = GradientMagnitude.get_median();
+	GradientMagnitude.GetStats (GM_stats);
+	*MagMean   = GM_stats.mean();
+	*MagVar    = GM_stats.var();
+	GradientMagnitude.histogram (MagHist, nbins, false, GM_stats);
 
 	/* find the edge area (number of edge pixels) */
 	*EdgeArea = 0;
@@ -1313,17 +2542,15 @@ void ImageMatrix::EdgeStatistics(unsigned long *EdgeArea, double *MagMean, doubl
 	level = *MagMean;
 	// level = min_val + ((max_val-min_val)/2.0);   // level=duplicate->OtsuBinaryMaskTransform()   // level=MagMean
 
-	for (a = 0; a < GradientMagnitude.height*GradientMagnitude.width; a++)
-		if (GM_pix_plane.array().coeff(a) > level) (*EdgeArea)+=1; /* find the edge area */
+	*EdgeArea = (GM_pix_plane.array() > level).count(); /* find the edge area */
 //   GradientMagnitude->OtsuBinaryMaskTransform();
 
 	/* find direction statistics */
-	*DirecMedian = GradientDirection.update_median();
-	*DirecMean   = GradientDirection.mean();
-	*DirecVar    = GradientDirection.var();
-	min_val      = GradientDirection.min();
-	max_val      = GradientDirection.max();
-	GradientDirection.histogram (DirecHist, nbins, false);
+	*DirecMedian = GradientDirection.get_median();
+	GradientDirection.GetStats (GD_stats);
+	*DirecMean   = GD_stats.mean();
+	*DirecVar    = GD_stats.var();
+	GradientDirection.histogram (DirecHist, nbins, false, GD_stats);
 
 	/* Calculate statistics about edge difference direction
 	   Histogram created by computing differences amongst histogram bins at angle and angle+pi
@@ -1471,9 +2698,10 @@ double ImageMatrix::OtsuBinaryMaskTransform (const ImageMatrix &matrix_IN) {
 	OtsuGlobalThreshold = matrix_IN.Otsu();
 
 	/* classify the pixels by the threshold */
-	for (unsigned int a = 0; a < width*height; a++)
-		if (in_plane.array().coeff(a) > OtsuGlobalThreshold) (out_plane.array())(a) = stats.add (1);
-		else (out_plane.array())(a) = stats.add (0);
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+			if (in_plane (y, x) > OtsuGlobalThreshold) out_plane (y, x) = stats.add (1);
+			else out_plane (y, x) = stats.add (0);
 
 	return(OtsuGlobalThreshold);
 }
@@ -1528,13 +2756,24 @@ void ImageMatrix::FeatureStatistics(unsigned long *count, long *Euler, double *c
 	double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
 	double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
 ) const {
+	ImageMatrix BWImage;
+
+	BWImage.OtsuBinaryMaskTransform(*this);
+	BWImage.BinaryMaskStatistics (count, Euler, centroid_x, centroid_y, AreaMin, AreaMax,
+		AreaMean, AreaMedian, AreaVar, area_histogram, DistMin, DistMax,
+		DistMean, DistMedian, DistVar, dist_histogram, nbins);
+}
+
+void ImageMatrix::BinaryMaskStatistics(unsigned long *count, long *Euler, double *centroid_x, double *centroid_y, unsigned long *AreaMin, unsigned long *AreaMax,
+	double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
+	double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
+) {
 	unsigned long object_index, bin;
 	double sum_areas,sum_dists;
-	ImageMatrix BWImage;
+	ImageMatrix &BWImage = *this;
 	unsigned long *object_areas;
 	double *centroid_dists, sum_dist, hist_scale;
 
-	BWImage.OtsuBinaryMaskTransform(*this);
 	BWImage.centroid(centroid_x,centroid_y);
 	*count = BWImage.BWlabel(8);
 	*Euler=EulerNumber(BWImage,8);
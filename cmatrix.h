@@ -37,9 +37,16 @@
 #undef NDEBUG
 #include <assert.h>
 #include <string> // for source field
+#include <vector>
+#include <stdio.h> // FILE for raw frame streams
+#include <map>
+#include <new> // for placement new
+#include <pthread.h>
+#include <sys/stat.h> // struct stat for plane files
 #include "Eigen/Dense"
 #include "colors/FuzzyCalc.h"
 #include "statistics/Moments.h"
+#include "config.h" // for WNDCHRM_FLOAT_PIXELS
 //#define min(a,b) (((a) < (b)) ? (a) : (b))
 //#define max(a,b) (((a) < (b)) ? (b) : (a))
 
@@ -57,25 +64,81 @@ typedef struct {
 typedef struct {
 	byte h,s,v;
 } HSVcolor;
-typedef Eigen::Matrix< HSVcolor, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > MatrixXhsv;
-typedef MatrixXhsv clrDataMat;
 
-// the meaning of the color channels is specified by ColorMode, but it uses the HSVcolor structure for storage
+// the meaning of the color channels is specified by ColorMode, but they are named for HSV (see clrPlanes)
 // All color modes other than cmGRAY contain color planes as well as intensity planes
 enum ColorModes { cmRGB, cmHSV, cmGRAY };
 
 
-typedef Eigen::Matrix< double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > pixDataMat;
-typedef Eigen::Map< pixDataMat, Eigen::Aligned > pixDataMap;
-typedef Eigen::Map< clrDataMat, Eigen::Aligned > clrDataMap;
+// The storage type of the pixel planes.
+// Configuring with --enable-float-pixels stores pixels as 32-bit floats, halving the memory (and memory bandwidth) used by
+// the pixel planes of images and their transforms.  Features are still computed and reported as doubles.
+// The feature drift this causes can be measured against .sig files computed by a double-pixel build with the -V option.
+#ifdef WNDCHRM_FLOAT_PIXELS
+typedef float pixel_t;
+#else
+typedef double pixel_t;
+#endif
+typedef Eigen::Matrix< pixel_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > pixDataMat;
+// The planes are maps with a row stride, so that an ImageMatrix can also be a view of a block of another one's planes
+// (see submatrix_view()).  The rows of a view are not necessarily aligned, and the planes can't be indexed linearly.
+typedef Eigen::OuterStride<> planeStride;
+typedef Eigen::Map< pixDataMat, Eigen::Unaligned, planeStride > pixDataMap;
 typedef pixDataMap pixData;
-typedef clrDataMap clrData;
+
+typedef Eigen::Matrix< byte, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > clrChannelMat;
+typedef Eigen::Map< clrChannelMat, Eigen::Unaligned, planeStride > clrChannel;
+// The color data is stored as three separate byte planes (structure of arrays) in one block of memory:
+// all of the h values, then all of the s values, then all of the v values.
+// Loops over a channel read contiguous bytes, and whole-channel Eigen expressions vectorize.
+// The channels always have the same size and stride.  Like Eigen maps, assigning copies the values.
+class clrPlanes {
+public:
+	clrChannel h, s, v;
+	clrPlanes () : h (NULL,0,0,planeStride(0)), s (NULL,0,0,planeStride(0)), v (NULL,0,0,planeStride(0)) {}
+	// maps the channels to ptr, ptr + channel_offset and ptr + 2 * channel_offset
+	// stride is the distance between rows (0 for cols), and channel_offset 0 means stride * rows.
+	void remap (byte *ptr, const unsigned int rows, const unsigned int cols, unsigned int stride = 0, size_t channel_offset = 0) {
+		if (!stride) stride = cols;
+		if (!channel_offset) channel_offset = (size_t)stride * rows;
+		new (&h) clrChannel (ptr, rows, cols, planeStride (stride));
+		new (&s) clrChannel (ptr ? ptr + channel_offset : NULL, rows, cols, planeStride (stride));
+		new (&v) clrChannel (ptr ? ptr + 2 * channel_offset : NULL, rows, cols, planeStride (stride));
+	}
+	clrChannel::Index rows() const { return h.rows(); }
+	clrChannel::Index cols() const { return h.cols(); }
+	clrChannel::Index size() const { return h.size(); } // in pixels, each of which is sizeof(HSVcolor) bytes
+	clrChannel::Index outerStride() const { return h.outerStride(); }
+	size_t channel_offset() const { return s.data() - h.data(); }
+	const byte *data() const { return h.data(); }
+	HSVcolor operator() (const unsigned int y, const unsigned int x) const {
+		HSVcolor hsv = {h (y, x), s (y, x), v (y, x)};
+		return (hsv);
+	}
+	void set (const unsigned int y, const unsigned int x, const HSVcolor hsv) {
+		h (y, x) = hsv.h; s (y, x) = hsv.s; v (y, x) = hsv.v;
+	}
+	clrPlanes &operator= (const clrPlanes &other) {
+		h = other.h; s = other.s; v = other.v;
+		return (*this);
+	}
+private:
+	clrPlanes (const clrPlanes &);  // Don't Implement
+};
+typedef clrPlanes clrData;
+
+// The integer intensity levels of a grayscale image read from an 8 or 16-bit file (see ReadableLevels()).
+// 8-bit images use the same 16-bit levels, so that each algorithm needs only one integer version.
+typedef unsigned short level_t;
+typedef Eigen::Matrix< level_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > levelDataMat;
+typedef Eigen::Map< levelDataMat, Eigen::Unaligned, planeStride > levelData;
 
 typedef const pixData &readOnlyPixels;
 typedef const clrData &readOnlyColors;
+typedef const levelData &readOnlyLevels;
 typedef pixData &writeablePixels;
 typedef clrData &writeableColors;
-typedef struct {
+typedef struct rect {
 	int x,y,w,h;
 } rect;
 
@@ -160,13 +223,77 @@ static inline double RGB2GRAY(const RGBcolor rgb) {
 
 //---------------------------------------------------------------------------
 
+// A cache of aligned buffers for pixel planes and kernel scratch space, shared by the threads that use it.
+// Released buffers are kept, and handed out again for requests of the same size.  Once the first sample has been
+// processed, the planes and scratch buffers of the following samples of the same size don't come from the heap.
+// Each thread has a current arena (NULL if none, meaning the heap is used).  Executors make the arena that was current
+// when they were constructed current for their worker threads.
+class PlaneArena {
+public:
+	void *allocate (size_t bytes);
+	void release (void *ptr, size_t bytes);
+	void trim ();                          // frees all of the cached buffers
+	size_t cached_bytes () const;
+	size_t max_cached_bytes;               // the largest cached buffers are freed to stay under this
+
+	// the calling thread's current arena
+	static PlaneArena *current ();
+	static void set_current (PlaneArena *arena);
+	// allocate from / release to arena, or the heap if arena is NULL
+	static void *allocate (PlaneArena *arena, size_t bytes);
+	static void release (PlaneArena *arena, void *ptr, size_t bytes);
+
+	PlaneArena (size_t max_cached_bytes_in = 1024 * 1024 * 1024);
+	~PlaneArena ();
+private:
+	typedef std::multimap<size_t, void *> free_buffers_t;
+	free_buffers_t free_buffers;
+	size_t n_cached_bytes;
+	mutable pthread_mutex_t arena_mutex;
+	PlaneArena(PlaneArena const&);     // Don't Implement
+	void operator=(PlaneArena const&); // Don't implement
+};
+
+// A scratch array of n T's from the calling thread's current arena, released when it goes out of scope.
+template <typename T> class ArenaBuffer {
+public:
+	ArenaBuffer (size_t n) : arena (PlaneArena::current()), bytes (n * sizeof (T)) {
+		ptr = static_cast<T *>(PlaneArena::allocate (arena, bytes));
+	}
+	~ArenaBuffer () { PlaneArena::release (arena, ptr, bytes); }
+	operator T * () { return ptr; }
+private:
+	PlaneArena *arena;
+	size_t bytes;
+	T *ptr;
+	ArenaBuffer(ArenaBuffer const&);    // Don't Implement
+	void operator=(ArenaBuffer const&); // Don't implement
+};
+
 class ImageMatrix {
 private:
 	pixData _pix_plane;                              // pixel plane data  
 	clrData _clr_plane;                              // 3-channel color data
 	bool _is_pix_writeable;
 	bool _is_clr_writeable;
+	bool _is_view;                                   // the planes belong to another ImageMatrix (see submatrix_view())
+	levelData _lvl_plane;                            // integer levels of the pixels (see ReadableLevels())
+	PlaneArena *_pix_arena, *_clr_arena, *_lvl_arena; // where the planes were allocated (NULL for the heap)
+	void *_map_ptr;                                  // the plane file mapping holding the planes (see MapPlanes()), or NULL
+	size_t _map_bytes;
 	double _median;
+	void free_planes();
+	void allocate_levels (unsigned int w, unsigned int h);
+	void free_levels ();
+	// area-averages matrix_IN to new_width x new_height, dx x dy input pixels to each output pixel
+	void downsample_area (const ImageMatrix &matrix_IN, unsigned int new_width, unsigned int new_height, double dx, double dy);
+	// the stats and color planes of samples converted from a TIFF or raw frame (see LoadTIFF())
+	void finish_decoding (const unsigned int spp, const std::vector<unsigned short> &rgb16);
+protected:
+	// Maps other's planes into this matrix and leaves other empty, without releasing anything this matrix held.
+	void take_planes (ImageMatrix &other);
+	// false if the planes can't be handed to another matrix (e.g. they are in shared memory), so take() copies them instead.
+	virtual bool planes_are_movable () const { return (true); }
 public:
 	std::string source;                             // path of image source file
 	enum ColorModes ColorMode;                       // can be cmRGB, cmHSV or cmGRAY
@@ -174,13 +301,20 @@ public:
 	unsigned int width,height;                               // width and height of the picture
 	Moments2 stats;        // min, max, mean, std computed in single pass, median in separate pass
 	bool has_median;                     // if the median has been computed
-	const double *data_ptr() const { return _pix_plane.data(); }
-	double *writable_data_ptr() { return _pix_plane.data(); }	
+	// N.B.: The pixels are contiguous only if this is not a view.
+	const pixel_t *data_ptr() const { assert (!_is_view); return _pix_plane.data(); }
+	pixel_t *writable_data_ptr() { assert (!_is_view); return _pix_plane.data(); }	
+	// memory used by the pixel and color planes (none if they belong to another matrix)
+	size_t mem_bytes() const { return (_is_view ? 0 : _pix_plane.size() * sizeof(pixel_t) + _clr_plane.size() * sizeof(HSVcolor)
+		+ _lvl_plane.size() * sizeof(level_t)); }
+	bool is_view() const { return _is_view; }
 	
 	inline writeablePixels WriteablePixels() {
 		assert(_is_pix_writeable && "Attempt to write to read-only pixels");
 		has_median = false;
 		stats.reset();
+		// the levels would no longer match the pixels
+		if (_lvl_plane.data()) free_levels();
 		return _pix_plane;
 	}
 	inline writeableColors WriteableColors() {
@@ -201,6 +335,15 @@ public:
 		assert(!_is_pix_writeable && "Attempt to read from write-only pixels");
 		return _clr_plane;
 	}
+	// A grayscale image read from an 8 or 16-bit file also keeps its pixels as integer levels (pixel == level),
+	// which the algorithms that only need quantized values (histograms, the median, Otsu, Haralick) read instead.
+	// Views, copies and plane files of the image have the levels too.  Changing the pixels (WriteablePixels()) or
+	// allocating new ones drops them, so transforms have none.
+	bool has_levels() const { return (_lvl_plane.data() != NULL); }
+	inline readOnlyLevels ReadableLevels() const {
+		return _lvl_plane;
+	}
+	void level_range (level_t &lo, level_t &hi) const; // the lowest and highest level (only if has_levels())
 	void finish() {
 		WriteablePixelsFinish();
 		WriteableColorsFinish();
@@ -211,23 +354,68 @@ public:
 	void WriteableColorsFinish () {
 		_is_clr_writeable = false;
 	}
-	int LoadTIFF(char *filename);                   // load from TIFF file
+	// load from TIFF file (only the roi area if not NULL, and from a pyramid level if scale < 1, see LoadTIFF())
+	int LoadTIFF(char *filename, const rect *roi = NULL, const double scale = 1.0);
+	// The size of a TIFF image, read from its header without decoding it.  Returns 0 for other files or on errors.
+	// If n_levels is not NULL, it is set to the number of stored resolutions of the image (1 if it isn't a pyramid).
+	static int ImageSize (const char *filename, unsigned int &w, unsigned int &h, unsigned int *n_levels = NULL);
+	// The pages of multi-page TIFFs (z-stacks, time series, channels) are opened as separate images through page paths:
+	// "<file>[<page>]", with the pages counted from 0.  Reduced-resolution directories are the pyramid levels of the page
+	// before them rather than pages of their own.  TIFFPages() returns the number of pages in a TIFF file (0 for other files).
+	// SplitPagePath() sets page to -1 and file to path if path isn't a page path, and returns false.
+	static int TIFFPages (const char *filename);
+	static std::string PagePath (const char *filename, const int page);
+	static bool SplitPagePath (const char *path, std::string &file, int &page);
 	int SaveTiff(char *filename);                   // save a matrix in TIF format
+	// Streams of raw frames: a "WNDRAW <width> <height> <bits> <channels> [<name>]" header line followed by the samples
+	// (see LoadRawFrame()).  Both return 1 if a frame was read, 0 at the end of the stream, and -1 on errors.
+	// OpenRawFrame() preprocesses the frame with the same parameters as OpenImage().
+	int LoadRawFrame (FILE *fp);
+	int OpenRawFrame (FILE *fp, int downsample, rect *bounding_rect, double mean, double stddev);
 	virtual int OpenImage(char *image_file_name,            // load an image of any supported format
 		int downsample, rect *bounding_rect,
 		double mean, double stddev);
+	// Plane files hold the decoded planes of an image (pixel_t pixels, then h, s and v bytes, then the levels) after a small header,
+	// laid out so that they can be memory-mapped in place.  SavePlanes() returns 1 on success, 0 on errors.
+	// MapPlanes() maps a plane file copy-on-write, so the pixels are paged in from the file only as they are read,
+	// and changes to them stay in memory.  It returns 0 if the file can't be mapped, e.g. if it was written by a build
+	// with a different pixel_t.  If source_st is not NULL, the file must have been saved from an image of that size and mtime.
+	int SavePlanes (const char *path, const struct stat *source_st = NULL) const;
+	int MapPlanes (const char *path, const struct stat *source_st = NULL);
+	bool is_mapped() const { return (_map_ptr != NULL); }
+	// If the plane cache directory is set, OpenImage() maps the planes of images it has decoded before from plane files
+	// in that directory, and saves the planes of other images there (and maps them) after decoding them.
+	// An empty dir (the default) turns the cache off.  This should be set before any images are opened.
+	static void SetPlaneCacheDir (const std::string &dir);
+	static const std::string &PlaneCacheDir ();
+	// The number of threads LoadTIFF() decodes the strips or tiles of an image with (1 by default).
+	static void SetDecodeThreads (unsigned int n_threads);
 	// constructor helpers
 	void init();
-	void remap_pix_plane (double *ptr, const unsigned int w, const unsigned int h);
-	void remap_clr_plane (HSVcolor *ptr, const unsigned int w, const unsigned int h);
+	// stride is the distance between rows in elements (0 for w)
+	void remap_pix_plane (pixel_t *ptr, const unsigned int w, const unsigned int h, const unsigned int stride = 0);
+	// channel_offset is the distance between the color channels in bytes (0 for stride * h, see clrPlanes)
+	void remap_clr_plane (byte *ptr, const unsigned int w, const unsigned int h, const unsigned int stride = 0, const size_t channel_offset = 0);
 	virtual void allocate (unsigned int w, unsigned int h);
+	// Running total of bytes allocated for pixel and color planes by the calling thread (used for profiling).
+	static size_t thread_alloc_bytes ();
+	// Running total of pixel and color bytes copied from other matrices by the calling thread (copyData(), submatrix()).
+	static size_t thread_copy_bytes ();
 	void copyFields(const ImageMatrix &copy);
 	void copyData(const ImageMatrix &copy);
 	void copy(const ImageMatrix &copy);
+	// Takes over other's planes and fields without copying the pixels, leaving other empty.
+	// There are no move constructors in C++98, so this stands in for a move assignment.
+	// Views stay views of the same planes.
+	virtual void take (ImageMatrix &other);
 	void submatrix(const ImageMatrix &matrix,
 		const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2);
+	// Same as submatrix(), but maps the block of matrix's planes without copying them, making a read-only view.
+	// matrix must not be changed or deleted while the view is in use.  Calling allocate() gives the view its own planes.
+	void submatrix_view(const ImageMatrix &matrix,
+		const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2);
 	// N.B.: See note in implementation
-	ImageMatrix () : _pix_plane (NULL,0,0), _clr_plane (NULL,0,0) {
+	ImageMatrix () : _pix_plane (NULL,0,0,planeStride(0)), _lvl_plane (NULL,0,0,planeStride(0)) {
 		init();
 	};
 	virtual ~ImageMatrix();                                 // destructor
@@ -239,7 +427,9 @@ public:
 	void flipV();                                   // flip an image around a vertical axis (left to right)
 	void flipH();                                   // flip an image around a horizontal axis (upside down)
 	void invert();                                  // invert the intensity of an image
+	void invert (const ImageMatrix &matrix_IN);     // the inverted intensity of matrix_IN, without changing it
 	void Downsample (const ImageMatrix &matrix_IN, double x_ratio, double y_ratio);// down sample an image
+	void DownsampleTo (const ImageMatrix &matrix_IN, unsigned int new_width, unsigned int new_height); // down sample to a size
 	void Rotate (const ImageMatrix &matrix_IN, double angle);              // rotate an image by 90,180,270 degrees
 	void convolve(const pixDataMat &filter);
 	double update_median ();
@@ -289,6 +479,11 @@ public:
 	void EdgeStatistics (unsigned long *EdgeArea, double *MagMean, double *MagMedian, double *MagVar,
 		double *MagHist, double *DirecMean, double *DirecMedian, double *DirecVar, double *DirecHist,
 		double *DirecHomogeneity, double *DiffDirecHist, unsigned int nbins) const;
+	// EdgeStatistics using pre-computed (e.g. cached) PrewittMagnitude2D and PrewittDirection2D images
+	static void GradientStatistics (const ImageMatrix &GradientMagnitude, const ImageMatrix &GradientDirection,
+		unsigned long *EdgeArea, double *MagMean, double *MagMedian, double *MagVar,
+		double *MagHist, double *DirecMean, double *DirecMedian, double *DirecVar, double *DirecHist,
+		double *DirecHomogeneity, double *DiffDirecHist, unsigned int nbins);
 	void RadonTransform2D(double *vec) const;
 	double OtsuBinaryMaskTransform (const ImageMatrix &matrix_IN);
 	unsigned long BWlabel(int level);
@@ -297,6 +492,12 @@ public:
 		double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
 		double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
 	) const;
+	// FeatureStatistics for an image that is already a binary mask (e.g. a cached OtsuBinaryMaskTransform).
+	// The objects are labeled in place, so the mask is changed.
+	void BinaryMaskStatistics(unsigned long *count, long *Euler, double *centroid_x, double *centroid_y, unsigned long *AreaMin, unsigned long *AreaMax,
+		double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
+		double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
+	);
 	void GaborFilters2D(double *ratios) const;
 	void HaralickTexture2D(double distance, double *out) const;
 	void TamuraTexture2D(double *vec) const;
@@ -304,9 +505,14 @@ public:
 
 	// disable the copy constructor
 private:
-    ImageMatrix(const ImageMatrix &matrix) : _pix_plane (NULL,0,0), _clr_plane (NULL,0,0) {
+    ImageMatrix(const ImageMatrix &matrix) : _pix_plane (NULL,0,0), _lvl_plane (NULL,0,0) {
 		assert(false && "Attempt to use copy constructor");
 	};
 };
 
+// 2D correlation with zero borders, the same size as the input (which out must not alias):
+// out(y,x) = sum over j,i of kernel(j,i) * in(y + j - anchor_y, x + i - anchor_x)
+// Separable kernels are applied as two 1D passes, and large kernels through FFTW.
+void correlate2D (readOnlyPixels in, const pixDataMat &kernel, const unsigned int anchor_y, const unsigned int anchor_x, writeablePixels out);
+
 #endif
@@ -33,6 +33,7 @@
 #include <string.h>
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "FuzzyCalc.h"
 
@@ -42,6 +43,8 @@ trapez_function color_functions[50];
 color_type colors[COLORS_NUM+1];
 
 int rules_loaded=0;
+/* the rules are parsed in-place from rulesfile, which must only happen once even with concurrent callers */
+static pthread_once_t rules_once = PTHREAD_ONCE_INIT;
 
 char rulesfile[]="\ncolor_functions:\n\
 \n\
@@ -593,7 +596,7 @@ int LoadColorsFunctions(char *filename) {
 		}
 		if (strstr(p_line,"rules:")) {
 			*(strchr(p_line,'\0'))='\n';
-			return(1);
+			break;
 		}
 		if (colorfunctions && strlen(p_line) > 4) {
 			p_line=strtok(p_line," \n\t");
@@ -799,21 +802,24 @@ double CalculateRules2(double hue, double saturation, double value, int color) {
 	return(lower_sum);
 }
 //---------------------------------------------------------------------------
+static void InitRules() {
+	char *ColorFunctionsStart,*RulesStart;
+
+	SetColors();
+	ColorFunctionsStart=strstr(rulesfile,"color_functions:");
+	RulesStart=strstr(rulesfile,"rules:");
+	if (!LoadColorsFunctions(ColorFunctionsStart) || !LoadRules(RulesStart)) {
+		printf("Could not load rules \n");
+		return;
+	}
+	rules_loaded=1;
+}
+//---------------------------------------------------------------------------
 long FindColor(short hue, short saturation, short value, double *color_certainties) {
 	double max_membership,membership;
 	int color_index,res;
-	if (!rules_loaded) {
-		char *ColorFunctionsStart,*RulesStart;
-
-		SetColors();
-		ColorFunctionsStart=strstr(rulesfile,"color_functions:");
-		RulesStart=strstr(rulesfile,"rules:");
-		if (!LoadColorsFunctions(ColorFunctionsStart) || !LoadRules(RulesStart)) {
-			printf("Could not load rules \n");
-			return(-1);
-		}
-		rules_loaded=1;
-	}
+	pthread_once (&rules_once, InitRules);
+	if (!rules_loaded) return(-1);
 
 	max_membership = 0;
 	res = COLOR_LIGHT_GREY;
@@ -830,5 +836,26 @@ long FindColor(short hue, short saturation, short value, double *color_certainti
 	return(res);
 }
 //---------------------------------------------------------------------------
+// FindColor() evaluates the fuzzy rules of every color for each pixel, but its result only depends on the three bytes.
+// The results are kept in a table covering all of the hue, saturation, value combinations (16 MB, only the pages
+// that get used are touched), which is filled in as colors are first looked up.
+// Threads looking up the same new color may both compute it, but they store the same value.
+static unsigned char *color_table = NULL; // color index + 1, or 0 if not computed yet
+static pthread_once_t color_table_once = PTHREAD_ONCE_INIT;
+static void InitColorTable() {
+	color_table = (unsigned char *)calloc (1 << 24, 1);
+}
+long FindColorIndex(unsigned char hue, unsigned char saturation, unsigned char value) {
+	long res;
+	pthread_once (&color_table_once, InitColorTable);
+	if (!color_table) return (FindColor (hue, saturation, value, NULL));
+
+	size_t entry = ((size_t)hue << 16) | ((size_t)saturation << 8) | value;
+	if (color_table[entry]) return (color_table[entry] - 1);
+	res = FindColor (hue, saturation, value, NULL);
+	if (res >= 0) color_table[entry] = (unsigned char)(res + 1);
+	return (res);
+}
+//---------------------------------------------------------------------------
 
 
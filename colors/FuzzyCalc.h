@@ -193,6 +193,7 @@ double light_value(double value);
 
 double CalculateRules2(double hue,double saturation,double value);
 long FindColor(short hue, short saturation, short value, double *certainties);
+long FindColorIndex(unsigned char hue, unsigned char saturation, unsigned char value); // same as FindColor, from a table
 int color2num(char *color);
 int saturation2num(char *saturation);
 int value2num(char *value);
@@ -36,6 +36,9 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h> // apparently, for close() only?
+#include <assert.h>
+#include <algorithm>
+#include <iomanip>
 #define OUR_EPSILON FLT_EPSILON*6
 #define FLOAT_EQ(x,v) (((v - FLT_EPSILON) < x) && (x <( v + FLT_EPSILON)))
 #define OUR_EQ(x,v) (((v - OUR_EPSILON) < x) && (x <( v + OUR_EPSILON)))
@@ -61,6 +64,7 @@ signatures::signatures() {
 	data.clear();
 	version = 0;
 	feature_vec_type = StdFeatureComputationPlans::fv_unknown;
+	plan_hash = 0;
 	count=0;
 	allocated = 0;
 	sample_class=0;
@@ -94,6 +98,7 @@ signatures *signatures::duplicate() {
 	wf = NULL;
 	new_samp->version = version;
 	new_samp->feature_vec_type = feature_vec_type;
+	new_samp->plan_hash = plan_hash;
 	return(new_samp);
 }
 
@@ -154,6 +159,7 @@ void signatures::Clear() {
 	allocated = 0;
 	count = 0;
 	feature_vec_type = StdFeatureComputationPlans::fv_unknown;
+	plan_hash = 0;
 }
 
 int signatures::IsNeeded(long start_index, long group_length)
@@ -164,15 +170,31 @@ int signatures::IsNeeded(long start_index, long group_length)
    return(0);
 }
 
-void signatures::compute_plan (const ImageMatrix &matrix, const FeatureComputationPlan *plan) {
-	FeatureComputationPlanExecutor executor (plan);
+// If there is both a profile and a cost model, the cost model is re-calibrated from the timings profiled so far
+// before being used to schedule the concurrent executor.
+void signatures::compute_plan (const ImageMatrix &matrix, const FeatureComputationPlan *plan, size_t n_threads,
+	ComputationPlanProfile *profile, ComputationCostModel *cost_model) {
 	
+	set_plan (plan);
+	if (n_threads > 1) {
+		FeatureComputationPlanConcurrentExecutor executor (plan, n_threads);
+		executor.profile = profile;
+		if (cost_model && profile) cost_model->calibrate (*profile);
+		executor.cost_model = cost_model;
+		executor.run(&matrix, data, 0);
+	} else {
+		FeatureComputationPlanExecutor executor (plan);
+		executor.profile = profile;
+		executor.run(&matrix, data, 0);
+	}
+}
+
+void signatures::set_plan (const FeatureComputationPlan *plan) {
 	version = CURRENT_FEATURE_VERSION;
 	feature_vec_type = plan->feature_vec_type;
+	plan_hash = plan->plan_hash;
 	
 	Resize (plan->n_features);
-	executor.run(&matrix, data, 0);
-	
 	// update the feature count and the max_count;
 	count = plan->n_features;
 	if (count > max_sigs) max_sigs = count;
@@ -188,6 +210,160 @@ void signatures::compute_plan (const ImageMatrix &matrix, const FeatureComputati
 	}
 }
 
+// state for batch_row_finished()
+struct batch_rows_t {
+	const std::vector<signatures *> *sigs;
+	const std::vector<double> *feature_mat;
+	size_t n_features;
+	SigFileWriter *writer;
+};
+// Called by the batch executor's threads as each row is done.  Each row belongs to a different signatures object.
+static void batch_row_finished (size_t row, void *rows_arg) {
+	batch_rows_t *rows = static_cast<batch_rows_t *>(rows_arg);
+	signatures *sig = (*rows->sigs)[row];
+	const double *row_p = &(*rows->feature_mat)[row * rows->n_features];
+	std::copy (row_p, row_p + rows->n_features, sig->data.begin());
+	if (rows->writer) rows->writer->save (sig);
+}
+
+void signatures::compute_plan (const std::vector<signatures *> &sigs, const std::vector<const ImageMatrix *> &matrices,
+	const FeatureComputationPlan *plan, size_t n_threads,
+	ComputationPlanProfile *profile, ComputationCostModel *cost_model, SigFileWriter *writer) {
+
+	assert (sigs.size() == matrices.size() && "Different numbers of signatures and samples for compute_plan()");
+	for (size_t i = 0; i < sigs.size(); i++)
+		sigs[i]->set_plan (plan);
+
+	std::vector<double> feature_mat (sigs.size() * plan->n_features);
+	batch_rows_t rows = {&sigs, &feature_mat, plan->n_features, writer};
+	FeatureComputationPlanBatchExecutor executor (plan, n_threads);
+	executor.profile = profile;
+	if (cost_model && profile) cost_model->calibrate (*profile);
+	executor.cost_model = cost_model;
+	executor.row_finished = batch_row_finished;
+	executor.row_finished_arg = &rows;
+	executor.run (matrices, feature_mat, 0);
+}
+
+SigFileWriter::SigFileWriter (int save_feature_names_in) {
+	save_feature_names = save_feature_names_in;
+	finishing = false;
+	pthread_mutex_init (&queue_mutex, NULL);
+	pthread_cond_init (&queued, NULL);
+	threaded = (pthread_create (&writer_tid, NULL, writer_thread, this) == 0);
+}
+
+SigFileWriter::~SigFileWriter () {
+	finish ();
+	pthread_cond_destroy (&queued);
+	pthread_mutex_destroy (&queue_mutex);
+}
+
+void *SigFileWriter::writer_thread (void *sig_writer) {
+	static_cast<SigFileWriter *>(sig_writer)->writer();
+	return (NULL);
+}
+
+void SigFileWriter::writer () {
+	signatures *sig;
+
+	pthread_mutex_lock (&queue_mutex);
+	while (true) {
+		while (queue.empty() && !finishing)
+			pthread_cond_wait (&queued, &queue_mutex);
+		if (queue.empty()) break;
+		sig = queue.front();
+		queue.pop_front();
+		pthread_mutex_unlock (&queue_mutex);
+
+		sig->SaveToFile (save_feature_names);
+
+		pthread_mutex_lock (&queue_mutex);
+	}
+	pthread_mutex_unlock (&queue_mutex);
+}
+
+void SigFileWriter::save (signatures *sig) {
+	if (!threaded) {
+		sig->SaveToFile (save_feature_names);
+		return;
+	}
+	pthread_mutex_lock (&queue_mutex);
+	queue.push_back (sig);
+	pthread_cond_signal (&queued);
+	pthread_mutex_unlock (&queue_mutex);
+}
+
+void SigFileWriter::finish () {
+	if (!threaded) return;
+	pthread_mutex_lock (&queue_mutex);
+	finishing = true;
+	pthread_cond_signal (&queued);
+	pthread_mutex_unlock (&queue_mutex);
+	pthread_join (writer_tid, NULL);
+	threaded = false;
+}
+
+void FeatureDriftReport::add (const signatures &computed, const signatures &saved, const FeatureComputationPlan *plan) {
+	if (computed.count != saved.count || (saved.plan_hash && saved.plan_hash != computed.plan_hash)) {
+		n_skipped++;
+		return;
+	}
+	n_samples++;
+
+	for (int i = 0; i < computed.count; i++) {
+		std::string feature = plan->getFeatureNameByIndex (i);
+		std::string group = feature.substr (0, feature.rfind (" ["));
+		std::map<std::string, size_t>::iterator it = group_index.find (group);
+		if (it == group_index.end()) {
+			group_drift_t new_group = {group, 0, 0, 0, ""};
+			it = group_index.insert (std::make_pair (group, groups.size())).first;
+			groups.push_back (new_group);
+		}
+		group_drift_t &drift = groups[it->second];
+
+	// round to what SaveToFile() writes, so that the sig file precision isn't reported as drift
+		double diff = fabs (signatures::FileValue (computed.data[i]) - saved.data[i]);
+		double rel = diff / std::max (fabs (saved.data[i]), 1e-6);
+		drift.n_values++;
+		if (diff > drift.max_abs) drift.max_abs = diff;
+		if (rel > drift.max_rel) {
+			drift.max_rel = rel;
+			drift.max_feature = feature;
+		}
+	}
+}
+
+static bool by_max_rel (const FeatureDriftReport::group_drift_t &a, const FeatureDriftReport::group_drift_t &b) {
+	return (a.max_rel > b.max_rel);
+}
+
+std::vector<FeatureDriftReport::group_drift_t> FeatureDriftReport::sorted_drift () const {
+	std::vector<group_drift_t> sorted (groups);
+	std::stable_sort (sorted.begin(), sorted.end(), by_max_rel);
+	return (sorted);
+}
+
+void FeatureDriftReport::print_summary (std::ostream &out, size_t max_rows) const {
+	std::vector<group_drift_t> drift = sorted_drift();
+	if (max_rows == 0 || max_rows > drift.size()) max_rows = drift.size();
+
+	std::ios_base::fmtflags old_flags = out.flags();
+	std::streamsize old_precision = out.precision();
+	out << "Feature drift from saved sigs (" << n_samples << " samples compared";
+	if (n_skipped) out << ", " << n_skipped << " computed with a different plan skipped";
+	out << "):" << std::endl;
+	out << std::scientific << std::setprecision (2);
+	out << std::setw(12) << "max rel" << std::setw(12) << "max abs" << "  feature group (feature with max rel)" << std::endl;
+	for (size_t i = 0; i < max_rows; i++) {
+		out << std::setw(12) << drift[i].max_rel << std::setw(12) << drift[i].max_abs << "  " << drift[i].name;
+		if (drift[i].max_rel > 0) out << " (" << drift[i].max_feature << ")";
+		out << std::endl;
+	}
+	out.flags (old_flags);
+	out.precision (old_precision);
+}
+
 
 /* normalize
    normalize the signature values using the maximum and minimum values of the training set
@@ -246,20 +422,33 @@ int signatures::SaveToFile (int save_feature_names) {
 	FILE *wf_fp = wf->fp();
 
 	if ( NamesTrainingSet && ((TrainingSet *)(NamesTrainingSet))->is_continuous ) {
-		fprintf(wf_fp,"%f\t%d.%d\n",sample_value,version,feature_vec_type);  /* save the continouos value */
+		fprintf(wf_fp,"%f\t%d.%d",sample_value,version,feature_vec_type);  /* save the continouos value */
 	} else {
-		fprintf(wf_fp,"%d\t%d.%d\n",sample_class,version,feature_vec_type);  /* save the class index */
+		fprintf(wf_fp,"%d\t%d.%d",sample_class,version,feature_vec_type);  /* save the class index */
 	}
+	if (plan_hash) fprintf(wf_fp,"\t%08lx",plan_hash);
+	fprintf(wf_fp,"\n");
 	fprintf(wf_fp,"%s\n",full_path);
 	for (sig_index=0; sig_index < count; sig_index++) {
 		if (save_feature_names && NamesTrainingSet)
-			fprintf(wf_fp,"%f\t%s\n",data[sig_index],((TrainingSet *)NamesTrainingSet)->SignatureNames[sig_index]);
+			fprintf(wf_fp,SIG_VALUE_FORMAT "\t%s\n",data[sig_index],((TrainingSet *)NamesTrainingSet)->SignatureNames[sig_index]);
 		else
-			fprintf(wf_fp,"%f\n",data[sig_index]);
+			fprintf(wf_fp,SIG_VALUE_FORMAT "\n",data[sig_index]);
 	}
    return(1);
 }
 
+double signatures::FileValue (double value) {
+	char val_buf[64];
+	snprintf (val_buf, sizeof (val_buf), SIG_VALUE_FORMAT, value);
+	return (atof (val_buf));
+}
+
+void signatures::RoundToFile () {
+	for (long i = 0; i < count; i++)
+		data[i] = FileValue (data[i]);
+}
+
 
 int signatures::LoadFromFile(char *filename) {
 	char buffer[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1];
@@ -284,13 +473,14 @@ void signatures::LoadFromFilep (FILE *value_file) {
 	int version_maj = 0, version_min = 0;
 	double val;
 
-	/* read the class or value and version */
+	/* read the class or value, version and optional plan hash */
+	plan_hash = 0;
 	fgets(buffer,sizeof(buffer),value_file);
 	if (NamesTrainingSet && ((TrainingSet *)(NamesTrainingSet))->is_continuous) {
-		sscanf (buffer, "%lf%*[\t ]%d.%d", &sample_value, &version_maj, &version_min);
+		sscanf (buffer, "%lf%*[\t ]%d.%d%*[\t ]%lx", &sample_value, &version_maj, &version_min, &plan_hash);
 		sample_class = 1;
 	} else {
-		sscanf (buffer, "%hu%*[\t ]%d.%d", &sample_class, &version_maj, &version_min);
+		sscanf (buffer, "%hu%*[\t ]%d.%d%*[\t ]%lx", &sample_class, &version_maj, &version_min, &plan_hash);
 	}
 	// If we did not read a version, then it is 1.0
 	if (version_maj == 0) {
@@ -371,9 +561,13 @@ char *signatures::GetFileName (char *buffer) {
 		return buffer;
 	}
 
+	// the sigs of a page of a multi-page TIFF are named after its page path (<file>.tif[N]), keeping the extension
+	// so that they can't be mistaken for the sigs of another image named after the file.
+	std::string image_path;
+	int page;
 	strcpy(buffer,full_path);
-	char_p = strrchr(buffer,'.');
-	if (!char_p) char_p=buffer+strlen(buffer);
+	if (ImageMatrix::SplitPagePath (full_path, image_path, page)) char_p = buffer+strlen(buffer);
+	else if ( !(char_p = strrchr(buffer,'.')) ) char_p=buffer+strlen(buffer);
 
 	sprintf(char_p,"%s.sig",sample_name);
 	return (buffer);
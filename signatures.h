@@ -34,6 +34,10 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <iostream>
+#include <pthread.h>
 
 #include "cmatrix.h"
 #include "Tasks.h"
@@ -62,8 +66,12 @@
 #define MIN_SIG_VAL -FLT_MAX
 #define MAX_SIG_VAL FLT_MAX
 
+// the format of the feature values in sig files
+#define SIG_VALUE_FORMAT "%f"
+
 class FeatureGroup;
 class WORMfile;
+class SigFileWriter;
 class signatures
 {
   private:
@@ -73,6 +81,7 @@ class signatures
     int feature_vec_type;              // stores the integer value of the StdFeatureComputationPlans::feature_vec_types enum.
     int version;                       // The major version of the sig file (1 for wndchrm versions prior to 1.33 , 2 for wndchrm versions > 1.33).
                                        // The full version designation is version.feature_vec_type
+    unsigned long plan_hash;           // FeatureComputationPlan::plan_hash of the plan that computed the sigs (0 if unknown)
     unsigned short sample_class;        /* the class of the sample             */
     double sample_value;                /* a continous value (if TrainingSet->is_continuous is true, sample_value = 1 for known samples, and 0 for unknown samples */      
 	double interpolated_value;          /* a predicted continous value if class_num==1, or an interploated class value if class labels are all numerical */
@@ -91,15 +100,72 @@ class signatures
     void Add(const char *name, double value);
 	void SetFeatureVectorType();
     void Clear();
-    void compute_plan (const ImageMatrix &matrix, const FeatureComputationPlan *plan);
+    void compute_plan (const ImageMatrix &matrix, const FeatureComputationPlan *plan, size_t n_threads = 1,
+		ComputationPlanProfile *profile = NULL, ComputationCostModel *cost_model = NULL);
+    // Computes sigs[i] from matrices[i] for all of the samples at once, with each sample as a separate job for the threads.
+    // If writer is not NULL, each sample is queued for saving as soon as its features are computed.
+    static void compute_plan (const std::vector<signatures *> &sigs, const std::vector<const ImageMatrix *> &matrices,
+		const FeatureComputationPlan *plan, size_t n_threads = 1,
+		ComputationPlanProfile *profile = NULL, ComputationCostModel *cost_model = NULL, SigFileWriter *writer = NULL);
     void normalize(void *TrainSet);                /* normalize the signatures based on the values of the training set */
     void FileClose();
     int SaveToFile(int save_feature_names);
+    static double FileValue (double value);  // value as it is read back from a sig file (rounded to SIG_VALUE_FORMAT)
+    void RoundToFile ();                     // rounds the values to what SaveToFile() writes
     int LoadFromFile(char *filename);
     void LoadFromFilep (FILE *value_file); // implementation for LoadFromFile using a pre-existing FILE*
 	int ReadFromFile (bool wait); // load if exists, or lock and set fpp.
 	char *GetFileName(char *buffer);
 	int CompareToFile (const ImageMatrix &matrix, char *filename, int compute_colors, int large_set);
+  private:
+    void set_plan (const FeatureComputationPlan *plan); // everything compute_plan() sets besides the feature values
+};
+
+// Saves signatures with SaveToFile() on a background thread, so that writing the sig files overlaps with computing features.
+// The signatures are saved in the order they were queued, and must not be changed until finish() returns.
+// If the thread can't be started, save() saves the signature before returning.
+class SigFileWriter {
+  public:
+    void save (signatures *sig);
+    void finish (); // waits for the queued signatures to be saved, and stops the thread
+    SigFileWriter (int save_feature_names_in = 1);
+    ~SigFileWriter ();
+  private:
+    int save_feature_names;
+    std::deque<signatures *> queue;
+    bool threaded, finishing;
+    pthread_t writer_tid;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queued;
+    void writer ();
+    static void *writer_thread (void *sig_writer);
+    SigFileWriter(SigFileWriter const&);  // Don't Implement
+    void operator=(SigFileWriter const&); // Don't implement
+};
+
+// Accumulates the differences between recomputed features and the ones read from existing sig files,
+// e.g. to check how far a build with single-precision pixels (--enable-float-pixels) drifts from sigs computed with doubles.
+// The differences are summarized per feature group.  The recomputed values are rounded the same way as the ones in sig files.
+class FeatureDriftReport {
+  public:
+    struct group_drift_t {
+        std::string name;
+        size_t n_values;
+        double max_abs;          // largest absolute difference
+        double max_rel;          // largest difference relative to the saved value (at least the sig file precision of 1e-6)
+        std::string max_feature; // the feature with the largest relative difference
+    };
+    // computed and saved must be for the same sample.  Samples computed with a different plan are counted, but not compared.
+    void add (const signatures &computed, const signatures &saved, const FeatureComputationPlan *plan);
+    // the groups sorted by max_rel (largest first)
+    std::vector<group_drift_t> sorted_drift () const;
+    // max_rows = 0 prints all of the groups
+    void print_summary (std::ostream &out, size_t max_rows = 0) const;
+    FeatureDriftReport () : n_samples (0), n_skipped (0) {}
+  private:
+    std::vector<group_drift_t> groups;
+    std::map<std::string, size_t> group_index;
+    size_t n_samples, n_skipped;
 };
 
 #endif
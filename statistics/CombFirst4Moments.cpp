@@ -110,11 +110,12 @@ int CombFirst4Moments2D(const ImageMatrix &Im, double *vec) {
 	n2 = (int)(round(n/2));
 	m2 = (int)(round(m/2));
 
+	// the rounded steps can make more than N_COMB_SAMPLES combs (e.g. 24 for a side of 24), but only that many are binned
 	/* major diag -45 degrees */
 	matr4moments_index=0;
 	step = (int)(round((double)m/10));
 	if (step < 1) step = 1;
-	for (ii = 1-m; ii <= m; ii = ii+step) {
+	for (ii = 1-m; ii <= m && matr4moments_index < N_COMB_SAMPLES; ii = ii+step) {
 		for (a = 0; a < 4; a++) matr4moments[a][matr4moments_index]=z4[a];
 
 		tmpMoments.reset();
@@ -140,7 +141,7 @@ int CombFirst4Moments2D(const ImageMatrix &Im, double *vec) {
 	matr4moments_index=0;
 	step = (int)(round((double)m/10));
 	if (step < 1) step = 1;
-	for (ii = 1-m; ii <= m; ii = ii+step) {
+	for (ii = 1-m; ii <= m && matr4moments_index < N_COMB_SAMPLES; ii = ii+step) {
 		for (a = 0; a < 4; a++) matr4moments[a][matr4moments_index]=z4[a];
 
 		tmpMoments.reset();
@@ -161,7 +162,7 @@ int CombFirst4Moments2D(const ImageMatrix &Im, double *vec) {
 	matr4moments_index=0;
 	step = (int)(round((double)n/10));
 	if (step < 1) step = 1;
-	for (ii = 1-n; ii <= n; ii = ii+step) {
+	for (ii = 1-n; ii <= n && matr4moments_index < N_COMB_SAMPLES; ii = ii+step) {
 		for (a = 0; a < 4; a++) matr4moments[a][matr4moments_index]=z4[a];
 
 		tmpMoments.reset();
@@ -182,7 +183,7 @@ int CombFirst4Moments2D(const ImageMatrix &Im, double *vec) {
 	matr4moments_index=0;
 	step = (int)(round((double)m/10));
 	if (step < 1) step = 1;
-	for (ii = 1-m; ii <= m; ii = ii+step) {
+	for (ii = 1-m; ii <= m && matr4moments_index < N_COMB_SAMPLES; ii = ii+step) {
 		for (a = 0; a < 4; a++) matr4moments[a][matr4moments_index] = z4[a];
 
 		tmpMoments.reset();
@@ -32,96 +32,58 @@
 
 #include "FeatureStatistics.h"
 
-typedef struct POINT1 {
-	long x,y;
-} point;
-
 //---------------------------------------------------------------------------
 /*  BWlabel
     label groups of 4-connected pixels.
     This is an implementation of the Matlab function bwlabel
+    The groups are filled in an integer plane of labels, queueing the pixels to visit by their index,
+    and the labels are written to the pixels at the end.
 */
+static inline void bwlabel_visit (unsigned int *labels, size_t *queue, size_t &tail, const size_t index, const unsigned int group) {
+	if (labels[index] == 1) {
+		labels[index] = group;
+		queue[tail++] = index;
+	}
+}
+
 unsigned long bwlabel(ImageMatrix &Im, int level) {
-	long x, y, base_x,base_y,stack_count, w = Im.width, h = Im.height;
-	unsigned long group_counter = 1;
-	point *stack=new point[w*h];
+	long x, y, base_x, base_y, w = Im.width, h = Im.height;
+	unsigned int group_counter = 1;
+	size_t i, base, head, tail;
 	pixData &pix_plane = Im.WriteablePixels();
+	// 1 for the pixels to label until they get their group (from 2 up), 0 for all others
+	ArenaBuffer<unsigned int> labels (w * h);
+	// each pixel is queued at most once
+	ArenaBuffer<size_t> queue (w * h);
 
-	for (y = 0; y < h; y++) {
-		for (x = 0; x < w; x++) {
-			if ( pix_plane(y,x) == 1) {
-				/* start a new group */
-				group_counter++;
-				pix_plane(y,x) = group_counter;
-				stack[0].x=x;
-				stack[0].y=y;
-				stack_count=1;
-				while (stack_count > 0) {
-					base_x=stack[0].x;
-					base_y=stack[0].y;
-
-					if (base_x > 0 && pix_plane(base_y,base_x-1) == 1) {
-						pix_plane(base_y,base_x-1) = group_counter;
-						stack[stack_count].x=base_x-1;
-						stack[stack_count].y=base_y;
-						stack_count++;
-					}
-
-					if (base_x < w-1 && pix_plane(base_y,base_x+1) == 1) {
-						pix_plane(base_y,base_x+1) = group_counter;
-						stack[stack_count].x=base_x+1;
-						stack[stack_count].y=base_y;
-						stack_count++;
-					}
-
-					if (base_y > 0 && pix_plane(base_y-1,base_x) == 1) {
-						pix_plane(base_y-1,base_x) = group_counter;
-						stack[stack_count].x=base_x;
-						stack[stack_count].y=base_y-1;
-						stack_count++;
-					}
-
-					if (base_y < h-1 && pix_plane(base_y+1,base_x) == 1) {
-						pix_plane(base_y+1,base_x) = group_counter;
-						stack[stack_count].x=base_x;
-						stack[stack_count].y=base_y+1;
-						stack_count++;
-					}
-
-					/* look for 8 connected pixels */
-					if (level==8) {
-						if (base_x > 0 && base_y > 0 && pix_plane(base_y-1,base_x-1) == 1) {
-							pix_plane(base_y-1,base_x-1) = group_counter;
-							stack[stack_count].x=base_x-1;
-							stack[stack_count].y=base_y-1;
-							stack_count++;
-						}
-
-						if (base_x < w-1 && base_y > 0 && pix_plane(base_y-1,base_x+1) == 1) {
-							pix_plane(base_y-1,base_x+1) = group_counter;
-							stack[stack_count].x=base_x+1;
-							stack[stack_count].y=base_y-1;
-							stack_count++;
-						}
-
-						if (base_x > 0 && base_y < h-1 && pix_plane(base_y+1,base_x-1) == 1) {
-							pix_plane(base_y+1,base_x-1) = group_counter;
-							stack[stack_count].x=base_x-1;
-							stack[stack_count].y=base_y+1;
-							stack_count++;
-						}
-
-						if (base_x < w-1 && base_y < h-1 && pix_plane(base_y+1,base_x+1) == 1) {
-							pix_plane(base_y+1,base_x+1) = group_counter;
-							stack[stack_count].x=base_x+1;
-							stack[stack_count].y=base_y+1;
-							stack_count++;
-						}
-					}
-			  
-					stack_count-=1;
-					memmove(stack,&(stack[1]),sizeof(point)*stack_count);
-				}
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			labels[y * w + x] = (pix_plane(y,x) == 1);
+
+	for (i = 0; i < (size_t)(w * h); i++) {
+		if (labels[i] != 1) continue;
+		/* start a new group */
+		group_counter++;
+		labels[i] = group_counter;
+		queue[0] = i;
+		head = 0;
+		tail = 1;
+		while (head < tail) {
+			base = queue[head++];
+			base_x = base % w;
+			base_y = base / w;
+
+			if (base_x > 0)   bwlabel_visit (labels, queue, tail, base - 1, group_counter);
+			if (base_x < w-1) bwlabel_visit (labels, queue, tail, base + 1, group_counter);
+			if (base_y > 0)   bwlabel_visit (labels, queue, tail, base - w, group_counter);
+			if (base_y < h-1) bwlabel_visit (labels, queue, tail, base + w, group_counter);
+
+			/* look for 8 connected pixels */
+			if (level==8) {
+				if (base_x > 0 && base_y > 0)     bwlabel_visit (labels, queue, tail, base - w - 1, group_counter);
+				if (base_x < w-1 && base_y > 0)   bwlabel_visit (labels, queue, tail, base - w + 1, group_counter);
+				if (base_x > 0 && base_y < h-1)   bwlabel_visit (labels, queue, tail, base + w - 1, group_counter);
+				if (base_x < w-1 && base_y < h-1) bwlabel_visit (labels, queue, tail, base + w + 1, group_counter);
 			}
 		}
 	}
@@ -129,10 +91,11 @@ unsigned long bwlabel(ImageMatrix &Im, int level) {
 	/* now decrease every non-zero pixel by one because the first group was "2" */
 	for (y=0;y<h;y++)
 		for (x=0;x<w;x++)
-			if (pix_plane(y,x) != 0)
+			if (labels[y * w + x])
+				pix_plane(y,x) = labels[y * w + x] - 1;
+			else if (pix_plane(y,x) != 0)
 				pix_plane(y,x) -= 1;
 
-	delete [] stack;
 	return(group_counter-1);
 }
 
@@ -83,7 +83,21 @@ class Moments2 {
 		if (x < _min) _min = x;
 		return (x);
   	}
-  	
+  	// Adds a block of n values at once, given its min, max, mean and sum of squared deviations from its mean
+  	// (Chan et al.'s pairwise update).  The values must already be in the range accepted by add().
+  	inline void add_block (const size_t n, const double min, const double max, const double mean, const double block_M2) {
+  		double delta;
+  		if (n == 0) return;
+
+  		delta = mean - _mean;
+  		_mean = _mean + delta * n / (_n + n);
+  		M2 += block_M2 + delta * delta * ((double)_n * n / (_n + n));
+  		_n = _n + n;
+
+		if (max > _max) _max = max;
+		if (min < _min) _min = min;
+  	}
+
   	size_t n()    const { return _n; }
   	double min()  const { return _min; }
   	double max()  const { return _max; }
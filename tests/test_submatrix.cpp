@@ -0,0 +1,96 @@
+/* Checks that submatrix() and submatrix_view() clip blocks reaching past the right and bottom edges of an image
+   to the pixels that are in it, with the same pixels, colors and levels as the image. */
+
+#include <stdio.h>
+#include "cmatrix.h"
+
+static int failures = 0;
+
+static void check (bool ok, const char *what) {
+	if (!ok) {
+		printf ("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+// A w x h image read from a raw frame (see ImageMatrix::LoadRawFrame()), so that gray images have levels.
+// Sample (x,y,c) is 20 * y + 2 * x + 7 * c.
+static bool make_image (ImageMatrix &image, const unsigned int w, const unsigned int h, const unsigned int spp) {
+	FILE *fp = tmpfile();
+	if (!fp) return (false);
+	fprintf (fp, "WNDRAW %u %u 8 %u test\n", w, h, spp);
+	for (unsigned int y = 0; y < h; y++)
+		for (unsigned int x = 0; x < w; x++)
+			for (unsigned int c = 0; c < spp; c++)
+				fputc (20 * y + 2 * x + 7 * c, fp);
+	rewind (fp);
+	int res = image.LoadRawFrame (fp);
+	image.finish();
+	fclose (fp);
+	return (res == 1);
+}
+
+// block should be the w x h area of image starting at (x0,y0)
+static void check_block (const ImageMatrix &block, const ImageMatrix &image, const unsigned int x0, const unsigned int y0,
+	const unsigned int w, const unsigned int h, const char *what) {
+	char msg[128];
+
+	snprintf (msg, sizeof (msg), "%s is %ux%u (expected %ux%u)", what, block.width, block.height, w, h);
+	check (block.width == w && block.height == h, msg);
+	if (block.width != w || block.height != h) return;
+	check (block.has_levels() == image.has_levels(), what);
+	for (unsigned int y = 0; y < h; y++) {
+		for (unsigned int x = 0; x < w; x++) {
+			snprintf (msg, sizeof (msg), "%s pixel (%u,%u)", what, x, y);
+			check (block.ReadablePixels() (y, x) == image.ReadablePixels() (y + y0, x + x0), msg);
+			if (image.ColorMode != cmGRAY) {
+				check (block.ReadableColors().h (y, x) == image.ReadableColors().h (y + y0, x + x0), msg);
+				check (block.ReadableColors().s (y, x) == image.ReadableColors().s (y + y0, x + x0), msg);
+				check (block.ReadableColors().v (y, x) == image.ReadableColors().v (y + y0, x + x0), msg);
+			}
+			if (image.has_levels())
+				check (block.ReadableLevels() (y, x) == image.ReadableLevels() (y + y0, x + x0), msg);
+		}
+	}
+}
+
+static void check_image (const ImageMatrix &image, const char *what) {
+	char msg[128];
+
+	// inside the image
+	ImageMatrix inside_view, inside_copy;
+	inside_view.submatrix_view (image, 2, 1, 5, 3);
+	inside_copy.submatrix (image, 2, 1, 5, 3);
+	snprintf (msg, sizeof (msg), "%s: view inside the image", what);
+	check_block (inside_view, image, 2, 1, 4, 3, msg);
+	snprintf (msg, sizeof (msg), "%s: copy inside the image", what);
+	check_block (inside_copy, image, 2, 1, 4, 3, msg);
+
+	// past the right and bottom edges
+	ImageMatrix edge_view, edge_copy;
+	edge_view.submatrix_view (image, 6, 5, 20, 20);
+	edge_copy.submatrix (image, 6, 5, 20, 20);
+	snprintf (msg, sizeof (msg), "%s: view clipped at the right and bottom edges", what);
+	check_block (edge_view, image, 6, 5, 4, 3, msg);
+	snprintf (msg, sizeof (msg), "%s: copy clipped at the right and bottom edges", what);
+	check_block (edge_copy, image, 6, 5, 4, 3, msg);
+
+	// a view of a view, clipped at the edges of the first view
+	ImageMatrix nested_view;
+	nested_view.submatrix_view (inside_view, 1, 1, 9, 9);
+	snprintf (msg, sizeof (msg), "%s: view of a view clipped at its edges", what);
+	check_block (nested_view, image, 3, 2, 3, 2, msg);
+}
+
+int main () {
+	ImageMatrix gray, color;
+
+	check (make_image (gray, 10, 8, 1), "reading the gray image");
+	check (make_image (color, 10, 8, 3), "reading the color image");
+	if (failures) return (1);
+	check_image (gray, "gray");
+	check_image (color, "color");
+
+	if (failures) printf ("%d checks failed\n", failures);
+	return (failures ? 1 : 0);
+}
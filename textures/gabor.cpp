@@ -163,34 +163,33 @@ double *Gabor(double f0, double sig2lam, double gamma, double theta, double fi,
 
 /* Computes Gabor energy */
 //Function [e2] = GaborEnergy(Im,f0,sig2lam,gamma,theta,n),
-double *GaborEnergy(const ImageMatrix &Im, double* out, double f0, double sig2lam, double gamma, double theta, int n) {
-	double *Gexp, *image, *c;
+pixel_t *GaborEnergy(const ImageMatrix &Im, pixel_t* out, double f0, double sig2lam, double gamma, double theta, int n) {
+	double *Gexp;
 	double fi = 0;
-	unsigned int a,b,x,y;
+	unsigned int x,y;
 	Gexp = Gabor(f0,sig2lam,gamma,theta,fi,n);
-	readOnlyPixels pix_plane = Im.ReadablePixels();
-
-	c = new double[(Im.width+n-1)*(Im.height+n-1)*2];
-	image = new double[Im.width*Im.height];
-	for (y = 0; y < Im.height; y++)
-		for (x = 0; x < Im.width; x++)
-			image[y*Im.width+x] = pix_plane(y,x);
-
-	conv2comp(c, image, Gexp, Im.width, Im.height, n, n);
-
-	b = 0;
-	for (y = (int)ceil((double)n/2); b < Im.height; y++) {
-		a = 0;
-		for (x = (int)ceil((double)n/2); a < Im.width; x++) {
-			out[b*Im.width+a] = sqrt(pow(c[y*2*(Im.width+n-1)+x*2],2)+pow(c[y*2*(Im.width+n-1)+x*2+1],2));
-			a++;
+
+	// conv2 (Im, Gexp) cropped to the image, starting at ceil(n/2):
+	// this is a correlation with the flipped filter, anchored at n-1-ceil(n/2).
+	pixDataMat Gexp_re (n, n), Gexp_im (n, n);
+	for (y = 0; y < (unsigned int)n; y++) {
+		for (x = 0; x < (unsigned int)n; x++) {
+			Gexp_re (n-1-y, n-1-x) = Gexp[y*n*2+x*2];
+			Gexp_im (n-1-y, n-1-x) = Gexp[y*n*2+x*2+1];
 		}
-		b++;
 	}
+	unsigned int anchor = n - 1 - (int)ceil((double)n/2);
+
+	ImageMatrix c_re, c_im;
+	c_re.allocate (Im.width, Im.height);
+	c_im.allocate (Im.width, Im.height);
+	correlate2D (Im.ReadablePixels(), Gexp_re, anchor, anchor, c_re.WriteablePixels());
+	correlate2D (Im.ReadablePixels(), Gexp_im, anchor, anchor, c_im.WriteablePixels());
+
+	pixData out_plane (out, Im.height, Im.width, planeStride (Im.width));
+	out_plane = (c_re.ReadablePixels().array().square() + c_im.ReadablePixels().array().square()).sqrt();
 
-	delete [] image;
 	delete [] Gexp;
-	delete [] c;
 	return(out);
 }
 
@@ -223,7 +222,8 @@ void GaborTextureFilters2D(const ImageMatrix &Im, double *ratios) {
 		unsigned long afterGaborScore = 0;
 		GaborEnergy(Im, e2img.writable_data_ptr(), f0[ii],sig2lam,gamma,theta,n);
 		writeablePixels e2_pix_plane = e2img.WriteablePixels();
-		e2_pix_plane.array() = (e2_pix_plane.array() / e2_pix_plane.maxCoeff()).unaryExpr (Moments2func(e2img.stats));
+		e2_pix_plane.array() = e2_pix_plane.array() / e2_pix_plane.maxCoeff();
+		e2img.UpdateStats();
 		GRAYthr = e2img.Otsu();
 		afterGaborScore = (e2_pix_plane.array() > GRAYthr).count();
 		ratios[ii] = (double)afterGaborScore/(double)originalScore;
@@ -1,6 +1,7 @@
 //---------------------------------------------------------------------------
 
 #include <stdlib.h>
+#include <vector>
 #include "haralick.h"
 #include "CVIPtexture.h"
 
@@ -25,16 +26,32 @@ void haralick2D(const ImageMatrix &Im, double distance, double *out) {
 	for (y = 0; y < Im.height; y++)
 		p_gray[y] = new unsigned char[Im.width];
 
-	// to keep this method from modifying the const Im, we use GetStats on a local Moments2 object
-	Moments2 local_stats;
-	Im.GetStats (local_stats);
-	min_value = local_stats.min();
-	max_value = local_stats.max();
+	if (Im.has_levels()) {
+		// Each level is scaled once into a table, and the gray levels are looked up from the integer levels.
+		level_t lo, hi;
+		Im.level_range (lo, hi);
+		min_value = lo;
+		max_value = hi;
+		scale255 = (255.0/(max_value-min_value));
+		std::vector<unsigned char> gray_levels ((size_t)hi - lo + 1);
+		for (size_t level = 0; level < gray_levels.size(); level++)
+			gray_levels[level] = (unsigned char)(((double)(lo + level) - min_value) * scale255);
+		readOnlyLevels lvl_plane = Im.ReadableLevels();
+		for (y = 0; y < Im.height; y++)
+			for (x = 0; x < Im.width; x++)
+				p_gray[y][x] = gray_levels[lvl_plane(y,x) - lo];
+	} else {
+		// to keep this method from modifying the const Im, we use GetStats on a local Moments2 object
+		Moments2 local_stats;
+		Im.GetStats (local_stats);
+		min_value = local_stats.min();
+		max_value = local_stats.max();
 
-	scale255 = (255.0/(max_value-min_value));
-	for (y = 0; y < Im.height; y++)
-		for (x = 0; x < Im.width; x++)
-			p_gray[y][x] = (unsigned char)((pix_plane(y,x) - min_value) * scale255);
+		scale255 = (255.0/(max_value-min_value));
+		for (y = 0; y < Im.height; y++)
+			for (x = 0; x < Im.width; x++)
+				p_gray[y][x] = (unsigned char)((pix_plane(y,x) - min_value) * scale255);
+	}
 
 	for (a = 0; a < 14; a++) {
 		min[a] = INF;
@@ -36,10 +36,11 @@ double directionality(const ImageMatrix &image) {
 	unsigned int y, ydim = image.height;
 	double Hd[NBINS];
 
+	// the gradients are filtered directly from image, which is left alone
 	ImageMatrix deltaH;
-	deltaH.copy(image);
+	deltaH.allocate (xdim, ydim);
 	ImageMatrix deltaV;
-	deltaV.copy(image);
+	deltaV.allocate (xdim, ydim);
 	
 
 	pixDataMat matrixH (3,3);
@@ -56,8 +57,8 @@ double directionality(const ImageMatrix &image) {
 	matrixV(0,0) =  1; matrixH(0,1) =  2; matrixH(0,2) =  1;
 	matrixV(2,0) = -1; matrixH(2,1) = -2; matrixH(2,2) = -1;
 
-	deltaH.convolve(matrixH);
-	deltaV.convolve(matrixV);
+	correlate2D (image.ReadablePixels(), matrixH, matrixH.rows()/2, matrixH.cols()/2, deltaH.WriteablePixels());
+	correlate2D (image.ReadablePixels(), matrixV, matrixV.rows()/2, matrixV.cols()/2, deltaV.WriteablePixels());
 	deltaH.finish();
 	deltaV.finish();
 	readOnlyPixels deltaH_pix_plane = deltaH.ReadOnlyPixels();
@@ -102,7 +103,7 @@ double directionality(const ImageMatrix &image) {
 }
 
 
-double efficientLocalMean(const long x,const long y,const long k, const pixDataMat &laufendeSumme) {
+double efficientLocalMean(const long x,const long y,const long k, const pixData &laufendeSumme) {
 	long k2 = k/2;
 
 	long dimx = laufendeSumme.cols();
@@ -150,8 +151,10 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	const unsigned int xDim = image.width;
 	double sum = 0.0;
 	ImageMatrix *Sbest;
-	pixDataMat laufendeSumme (yDim,xDim);
-	pixDataMat *Ak[K_VALUE], *Ekh[K_VALUE], *Ekv[K_VALUE];
+	// The scratch planes are ImageMatrixes so that they come from the current PlaneArena
+	ImageMatrix laufendeSumme_matrix, Ak[K_VALUE], Ekh[K_VALUE], Ekv[K_VALUE];
+	laufendeSumme_matrix.allocate (xDim,yDim);
+	writeablePixels laufendeSumme = laufendeSumme_matrix.WriteablePixels();
 
 	readOnlyPixels image_pix_plane = image.ReadablePixels();
 
@@ -173,9 +176,9 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	}
 
 	for (k = 1; k <= K_VALUE; k++) {
-		Ak[k-1] = new pixDataMat(yDim,xDim);
-		Ekh[k-1] = new pixDataMat(yDim,xDim);
-		Ekv[k-1] = new pixDataMat(yDim,xDim);
+		Ak[k-1].allocate (xDim,yDim);
+		Ekh[k-1].allocate (xDim,yDim);
+		Ekv[k-1].allocate (xDim,yDim);
 	}
 	Sbest = new ImageMatrix;
 	Sbest->allocate (image.width,image.height);
@@ -185,7 +188,7 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	int lenOfk = 1;
 	for(k = 1; k <= K_VALUE; ++k) {
 		lenOfk *= 2;
-		pixDataMat &Ak_pix_plane = *Ak[k-1];
+		writeablePixels Ak_pix_plane = Ak[k-1].WriteablePixels();
 		for(y = 0; y < yDim; ++y)
 			for(x = 0; x < xDim; ++x)
 				Ak_pix_plane(y,x) = efficientLocalMean(x,y,lenOfk,laufendeSumme);
@@ -196,9 +199,9 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	for(k = 1; k <= K_VALUE; ++k) {
 		int k2 = lenOfk;
 		lenOfk *= 2;
-		pixDataMat &Ekh_pix_plane = *Ekh[k-1];
-		pixDataMat &Ekv_pix_plane = *Ekv[k-1];
-		pixDataMat &Ak_pix_plane = *Ak[k-1];
+		writeablePixels Ekh_pix_plane = Ekh[k-1].WriteablePixels();
+		writeablePixels Ekv_pix_plane = Ekv[k-1].WriteablePixels();
+		readOnlyPixels Ak_pix_plane = Ak[k-1].ReadablePixels();
 		for(y = 0; y < yDim; ++y) {
 			for(x = 0; x < xDim; ++x) {
 				int posx1 = x+k2;
@@ -224,8 +227,8 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 			double maxE = 0;
 			int maxk = 0;
 			for(int k = 1; k <= K_VALUE; ++k) {
-				double Ekh_val = (*(Ekh[k-1]))(y,x);
-				double Ekv_val = (*(Ekv[k-1]))(y,x);
+				double Ekh_val = Ekh[k-1].ReadablePixels()(y,x);
+				double Ekv_val = Ekv[k-1].ReadablePixels()(y,x);
 				if(Ekh_val > maxE) {
 					maxE = Ekh_val;
 					maxk = k;
@@ -257,11 +260,6 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 		hist[k] = hist[k]/max;
 
 	/* free allocated memory */
-	for (k = 1; k <= K_VALUE; k++) {
-		delete Ak[k-1];
-		delete Ekh[k-1];
-		delete Ekv[k-1];
-	}
 	delete Sbest;
 	return(sum);  /* return the mean coarseness */
 }
@@ -282,7 +280,8 @@ void Tamura3Sigs2D(const ImageMatrix &Im, double *vec) {
 	ImageMatrix normImg;
 
 	normImg.allocate (Im.width, Im.height);
-	normImg.WriteablePixels() = ((Im.ReadablePixels().array() - min_val) / max_val).unaryExpr (Moments2func(normImg.stats));
+	normImg.WriteablePixels() = (Im.ReadablePixels().array() - min_val) / max_val;
+	normImg.UpdateStats();
 
 	temp[0] = coarseness(normImg,&(temp[1]),3);
 	temp[4] = directionality(normImg);
@@ -30,6 +30,7 @@
 #include <cfloat> // Has definition of DBL_EPSILON
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "gsl/specfunc.h"
 
 #include "cmatrix.h"
@@ -46,6 +47,8 @@
 // This is also based on the maximum D parameter - contains pre-computed factorials
 #define MAX_LUT 240
 
+// Guards the one-time initialization of the static lookup tables below when features are computed concurrently.
+static pthread_mutex_t zernike_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 //---------------------------------------------------------------------------
 
@@ -74,6 +77,7 @@ void mb_Znl(double *X, double *Y, double *P, int size, double D, double m10_m00,
 // Other hard-coded D values should just need changing MAX_D, MAX_Z and MAX_LUT above.
 	assert (D == MAX_D);
 
+	pthread_mutex_lock (&zernike_init_mutex);
 	if (!init_lut) {
 		theZ=0;
 		theLUT=0;
@@ -93,6 +97,7 @@ void mb_Znl(double *X, double *Y, double *P, int size, double D, double m10_m00,
 		}
 		init_lut = 1;
 	}
+	pthread_mutex_unlock (&zernike_init_mutex);
 
 // Get the number of Z values, and clear the sums.
 	for (n = 0; n <= D; n++) {
@@ -250,6 +255,7 @@ void mb_zernike2D (const ImageMatrix &Im, double order, double rad, double *zval
 			
 
 // Pre-initialization of statics
+	pthread_mutex_lock (&zernike_init_mutex);
 	if (init) {
 		for (n = 0; n < MAX_L; n++) {
 			for (m = 0; m <= n; m++) {
@@ -262,6 +268,7 @@ void mb_zernike2D (const ImageMatrix &Im, double order, double rad, double *zval
 		}
 		init = 0;
 	}
+	pthread_mutex_unlock (&zernike_init_mutex);
 
 // Zero-out the Zernike moment accumulators
 	for (n = 0; n <= L; n++) {
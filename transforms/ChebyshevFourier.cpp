@@ -58,18 +58,14 @@ ChebyshevFourier - Chebyshev Fourier transform
 */
 void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_packed, unsigned int packingOrder) {
 	unsigned long a,m,n,x,y,nLast,NN,Nmax,ind;
-	double *sum_r,*sum_i,*f,*r,*img,*Tn,*coeff;
 	double min,max;
-	long *kk;
 
 	if (N==0) N=11;
 	m=Im.height;
 	n=Im.width;
 
-	img = new double[m*n];
-	f   = new double[m*n];
-	r   = new double[m*n];
-	kk  = new long[m*n];  /* the required size of kk is equal to nLast */
+	ArenaBuffer<double> img (m*n), f (m*n), r (m*n);
+	ArenaBuffer<long> kk (m*n);  /* the required size of kk is equal to nLast */
 
 	readOnlyPixels Im_pix_plane = Im.ReadablePixels();
 	double x_ind,x_2, y_ind;
@@ -97,9 +93,7 @@ void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_pa
 	if (N>Nmax) N=Nmax;
 	NN = 2*N + 1;
 
-	Tn=new double[NN];
-	sum_r = new double [NN*NN];
-	sum_i = new double [NN*NN];
+	ArenaBuffer<double> Tn (NN), sum_r (NN*NN), sum_i (NN*NN);
 	for (a = 0; a < NN*NN; a++) sum_r [a] = sum_i [a] = 0;
 
 	for (ind = 0; ind < nLast; ind++) {
@@ -129,7 +123,7 @@ void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_pa
 
 	min =  INF;
 	max = -INF;
-	coeff = new double[NN*NN];
+	ArenaBuffer<double> coeff (NN*NN);
 	for (a = 0; a < NN*NN; a++) {
 		coeff[a]=sqrt( pow (sum_r[a], 2) + pow (sum_i[a], 2) );
 		if (coeff[a] < min) min = coeff[a];
@@ -148,13 +142,4 @@ void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_pa
 			coeff_packed [bin] += 1;
 		}
 	}
-
-	delete [] sum_r;
-	delete [] sum_i;
-	delete [] coeff;
-	delete [] f;
-	delete [] r;
-	delete [] kk;
-	delete [] img;
-	delete [] Tn;
 }
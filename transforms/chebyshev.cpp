@@ -38,12 +38,10 @@
 
 void TNx(double *x, double *out, int N, int height) {
 	int ix,iy;
-	double *temp,*temp1;
 //	if( max(abs(x(:))) > 1 )
 //		error(':: Cheb. Polynomials Tn :: abs(arg) > 1');
 //	end;
-	temp = new double[N*height];
-	temp1 = new double[N*height];
+	ArenaBuffer<double> temp (N*height), temp1 (N*height);
 
 // 	T = cos((ones(size(x,2),1)*(0:(N-1))).*acos(x'*ones(1,N)));
 //     	T(:,1) = ones(size(x'));
@@ -72,16 +70,12 @@ void TNx(double *x, double *out, int N, int height) {
 
 	for (iy = 0; iy < height; iy++)
 		out[iy*N+0] = 1;
-
-	delete [] temp1;
-	delete [] temp;
 }
 
 void getChCoeff1D(double *f,double *out,double *Tj,int N,int width) {
-	double *tj;
 	int jj,a;
 
-	tj = new double[width];
+	ArenaBuffer<double> tj (width);
 	for (jj = 0; jj < N; jj++) {
 		int jx;
 		jx = jj;
@@ -98,7 +92,6 @@ void getChCoeff1D(double *f,double *out,double *Tj,int N,int width) {
 		for (a = 0; a < width; a++)
 			out[jj] += f[a]*tj[a]/2;
 	}
-	delete [] tj;
 }
 
 void getChCoeff(double *Im, double *out, double *Tj,int N,int width, int height) {
@@ -116,24 +109,20 @@ width - width of the image
 height - height of the image
 */
 void Chebyshev2D(const ImageMatrix &Im, double *out, unsigned int N) {
-	double *TjIn,*Tj;
-	double *in;
 	unsigned int a,i,j;
+	unsigned int max_dim = (Im.width > Im.height ? Im.width : Im.height);
+	ArenaBuffer<double> TjIn (max_dim), Tj (max_dim*N), in (Im.width*Im.height);
 
 // Make a default value for coeficient order if it was not given as an input
 //   if (N< = 0)
 //     N = min(Im.width,Im.height);
 
-	TjIn = new double[Im.width];
 	for (a = 0; a < Im.width; a++)
 		TjIn[a] = 2*(double)(a+1) / (double)Im.width -1;
 
 // Pre-compute Tj on x
-	Tj = new double[Im.width*N];
 	TNx(TjIn,Tj,N,Im.width);
 
-
-	in = new double[Im.width*Im.height];
 	readOnlyPixels Im_pix_plane = Im.ReadablePixels();
 
 	for (j = 0; j < Im.height; j++)
@@ -148,20 +137,12 @@ void Chebyshev2D(const ImageMatrix &Im, double *out, unsigned int N) {
 
 // If the height is different, re-compute Tj
 	if (Im.height != Im.width) {
-		delete [] Tj;
-		delete [] TjIn;
-		TjIn = new double[Im.height];
 		for (a = 0; a < Im.height; a++)
 			TjIn[a] = 2*(double)(a+1) / (double)Im.height -1;
 	// Pre-compute Tj on y
-		Tj = new double[Im.height*N];
 		TNx(TjIn,Tj,N,Im.height);
 	}
 	getChCoeff(in,out,Tj,N,Im.height,N);
-
-	delete [] in;
-	delete [] TjIn;
-	delete [] Tj;
 }
 
 
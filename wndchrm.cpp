@@ -40,6 +40,7 @@
 // isdigit
 #include <ctype.h>
 #include <algorithm>
+#include <fstream>
 
 #include "TrainingSet.h"
 #include "wndchrm_error.h"
@@ -52,6 +53,8 @@
 extern int verbosity;
 
 #include <sys/time.h>
+#include <sys/stat.h> // mkdir
+#include <errno.h>
 void randomize() {
 	timeval t1;
 	gettimeofday(&t1, NULL);
@@ -115,6 +118,9 @@ void setup_featureset (featureset_t *featureset) {
 				if (feature_opts->large_set) {
 					sample_name_lngth += sprintf (sample_name+sample_name_lngth,"-%s",feature_opts->large_set_base);
 				}
+				if (feature_opts->plan) {
+					sample_name_lngth += sprintf (sample_name+sample_name_lngth,"-%s%08lx",feature_opts->plan_base,feature_opts->plan->plan_hash);
+				}
 				
 				strcpy(featureset->samples[n_samples].sample_name,sample_name);
 				featureset->samples[n_samples].rot_index = rot_index;
@@ -126,7 +132,9 @@ void setup_featureset (featureset_t *featureset) {
 	}
 	featureset->n_samples = n_samples;
 
-	if (!feature_opts->large_set && !feature_opts->compute_colors)
+	if (feature_opts->plan)
+		featureset->n_features = feature_opts->plan->n_features;
+	else if (!feature_opts->large_set && !feature_opts->compute_colors)
 		featureset->n_features = NUM_DEF_FEATURES;
 	else if (!feature_opts->large_set && feature_opts->compute_colors)
 		featureset->n_features = NUM_C_FEATURES;
@@ -141,8 +149,9 @@ void setup_featureset (featureset_t *featureset) {
 /*
 check_split_params - checks parameters for consistency with regards to training/testing a given dataset.
 Returns 1 on success, 0 upon failure.
+If quiet is set, warnings are not reported (errors still are).
 */
-int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, TrainingSet *dataset, TrainingSet *testset, int class_num, int samples_per_image, int balanced_splits, int max_training_images, int max_test_images, int exact_training_images) {
+int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, TrainingSet *dataset, TrainingSet *testset, int class_num, int samples_per_image, int balanced_splits, int max_training_images, int max_test_images, int exact_training_images, int quiet = 0) {
 	int class_index, smallest_class=0;
 	int max_balanced_samples,max_balanced_i;
 
@@ -173,11 +182,11 @@ int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, Trai
 		}
 	}
 	max_balanced_i = max_balanced_samples / samples_per_image;
-	if( verbosity >= 2 ) printf ("Max balanced training images: %d\n",max_balanced_i);
+	if( verbosity >= 2 && !quiet ) printf ("Max balanced training images: %d\n",max_balanced_i);
 	// Check provided parameters against balanced testing/training
 	if (max_training_images > 0 && !exact_training_images) { // N.B.: -i overrides -r, except if exact_training_images
 		if (max_training_images > max_balanced_i && testset) {
-			catError("WARNING: Specified training images (%d) exceeds maximum for balanced training (%d).\n  %d images used for training.\n  Use -r# instead of -i to over-ride balanced training.\n",
+			if (!quiet) catError("WARNING: Specified training images (%d) exceeds maximum for balanced training (%d).\n  %d images used for training.\n  Use -r# instead of -i to over-ride balanced training.\n",
 				max_training_images,max_balanced_i,max_balanced_i);
 			max_training_images = max_balanced_i;
 		} else if (max_training_images >= max_balanced_i && testset == NULL) { // No images left for testing unless we have a test .fit
@@ -207,10 +216,10 @@ int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, Trai
 	
 	if (max_test_images > 0) { // -jN specified
 		if (testset) {
-			catError("WARNING: The -j%d parameter is ignored when a test set is specified (%s).\n",max_test_images,testset->source_path);
+			if (!quiet) catError("WARNING: The -j%d parameter is ignored when a test set is specified (%s).\n",max_test_images,testset->source_path);
 		} else if ( max_test_images > (max_balanced_i - max_training_images) ) { // -jN always balanced unless test .fit
 			if (max_balanced_i - max_training_images > 0) {
-				catError("WARNING: Insufficient images for balanced training (%d) and specified testing (%d).  %d images used for testing.\n",
+				if (!quiet) catError("WARNING: Insufficient images for balanced training (%d) and specified testing (%d).  %d images used for testing.\n",
 					max_training_images,max_test_images,max_balanced_i - max_training_images);
 				max_test_images = max_balanced_i - max_training_images;
 			}
@@ -228,9 +237,206 @@ int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, Trai
 }
 
 
+/*
+remove_classes - removes classes from the end if N is specified,
+  and classes with less than max_training_images if exact_training_images is true.
+*/
+void remove_classes (TrainingSet *ts, int N, int exact_training_images, int max_training_images, int samples_per_image) {
+	int class_index;
+
+	if (N>0) while (ts->class_num>N) ts->RemoveClass(ts->class_num);
+
+	if (exact_training_images) {
+		class_index=ts->class_num;
+		while( class_index > 0 ) {
+			if( ts->class_nsamples[ class_index ] * samples_per_image <  max_training_images ) {
+				ts->RemoveClass( class_index );
+			}
+			class_index--;
+		}
+	}
+}
+
+/*
+train_split - splits ts into the train and test sets of one split, normalizes the training set and computes its feature weights,
+  then replaces the weights with a weight vector file if weight_vector_action is 'r', '+' or '-'.
+  With tile_areas, the training set is split into one training set per tile position in *TilesTrainingSets_p instead.
+  Both split_and_test() and prune_classify_plan() train this way, so that the test set of 'classify' can be pruned to
+  the features that split_and_test() will weigh.
+Returns < 0 if the split failed, 0 if the weight vector could not be loaded, or 1.
+*/
+int train_split (TrainingSet *ts, TrainingSet *train, TrainingSet *test, data_split *split, int random_splits, double split_ratio,
+	int samples_per_image, int n_train, int n_test, double max_features, double used_mrmr, int tile_areas, TrainingSet ***TilesTrainingSets_p,
+	char *weight_file_buffer, char weight_vector_action, double *feature_weight_distance) {
+	int tile_index, i, res;
+
+	*feature_weight_distance = -1.0;
+	res = ts->split (random_splits, split_ratio, train, test, samples_per_image, n_train, n_test, split);
+	if (res < 0) return (res);
+
+	if (tile_areas)  // split into several datasets such that each dataset contains tiles of the same location
+	{
+		*TilesTrainingSets_p = new TrainingSet*[samples_per_image];
+		res = train->SplitAreas (samples_per_image, *TilesTrainingSets_p);
+		if (res < 0) return (res);
+		for (tile_index=0;tile_index<samples_per_image;tile_index++)
+		{
+			(*TilesTrainingSets_p)[tile_index]->normalize();
+			(*TilesTrainingSets_p)[tile_index]->SetFisherScores(max_features,used_mrmr,NULL);
+		}
+	}
+	else
+	{
+		train->normalize(); // normalize the feature values of the training set
+		train->SetFisherScores(max_features,used_mrmr,split);  // compute the Fisher Scores for the image features
+		if( ts->aggregated_feature_stats ) {
+			if( ts->aggregated_feature_stats->empty() ) {
+				featuregroup_stats_t temp;
+				for( i = 0; i < ts->signature_count; i++ ) {
+					temp.name = train->SignatureNames[i];
+					temp.min = train->SignatureWeights[i];
+					temp.max = train->SignatureWeights[i];
+					temp.sum_weight = train->SignatureWeights[i];
+					temp.sum_weight2 = train->SignatureWeights[i] * train->SignatureWeights[i];
+					temp.mean = 0;
+					temp.stddev = 0;
+					temp.n_features = 1;	
+					ts->aggregated_feature_stats->push_back( temp ); // makes a copy
+				}
+			}
+			else
+			{
+				for( i = 0; i < ts->signature_count; i++ ) {
+					if( train->SignatureWeights[i] < (*(ts->aggregated_feature_stats))[i].min )
+						 (*(ts->aggregated_feature_stats))[i].min = train->SignatureWeights[i];
+					if( train->SignatureWeights[i] > (*(ts->aggregated_feature_stats))[i].max )
+						 (*(ts->aggregated_feature_stats))[i].max = train->SignatureWeights[i];
+					(*(ts->aggregated_feature_stats))[i].sum_weight += train->SignatureWeights[i];
+					(*(ts->aggregated_feature_stats))[i].sum_weight2 += train->SignatureWeights[i] * train->SignatureWeights[i];
+					(*(ts->aggregated_feature_stats))[i].n_features++;
+				}
+			}
+		}
+	}
+
+	if (weight_vector_action=='r' || weight_vector_action=='+' || weight_vector_action=='-')
+	{
+		*feature_weight_distance=train->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));
+		if (tile_areas) for (tile_index=0;tile_index<samples_per_image;tile_index++) *feature_weight_distance=(*TilesTrainingSets_p)[tile_index]->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));	   
+		if (*feature_weight_distance<0) return (0);
+	}
+	return (1);
+}
+
+/*
+prune_classify_plan - makes a feature computation plan for the test set in 'classify' that only computes
+  the features that will have non-zero weights.
+  classify trains on the first images of each class rather than random ones, so the weights that train_split() computes here
+  are the same as the ones it computes for split_and_test() once the test set is loaded.
+  ts must already have had its classes removed by remove_classes().
+  testset is the (still empty) test set, which is only used for checking the split parameters.
+Returns a new plan (the caller deletes it), or NULL if the dataset's features don't match the standard plan.
+*/
+FeatureComputationPlan *prune_classify_plan (TrainingSet *ts, TrainingSet *testset, featureset_t *featureset, double split_ratio, int balanced_splits, double max_features,
+	int max_training_images, int exact_training_images, char *weight_file_buffer, char weight_vector_action) {
+	TrainingSet *train, *test, **TilesTrainingSets=NULL;
+	data_split split;
+	FeatureComputationPlan *pruned_plan = NULL;
+	int samples_per_image = featureset->n_samples;
+	int n_train, n_test;
+	int sig_index;
+	double feature_weight_distance;
+
+	const FeatureComputationPlan *plan = featureset->feature_opts.plan;
+	if (!plan) plan = StdFeatureComputationPlans::getFeatureSet (featureset->feature_opts.large_set, featureset->feature_opts.compute_colors);
+	if (ts->signature_count != (long)plan->n_features) return (NULL);
+	for (sig_index = 0; sig_index < ts->signature_count; sig_index++)
+		if (plan->getFeatureNameByIndex (sig_index) != ts->SignatureNames[sig_index]) return (NULL);
+
+	if (!check_split_params (&n_train, &n_test, &split_ratio, ts, testset,
+		MAX_CLASS_NUM, samples_per_image, balanced_splits, max_training_images, 0, exact_training_images, 1))
+			return (NULL);
+
+	train = new TrainingSet (ts->count, ts->class_num);
+	test = new TrainingSet (ts->count, ts->class_num);
+	split.training_images = new unsigned short[ts->class_num+1];
+	split.testing_images = new unsigned short[ts->class_num+1];
+	if (train_split (ts, train, test, &split, 0, split_ratio, samples_per_image, n_train, 0, max_features, 0.0, 0, &TilesTrainingSets,
+		weight_file_buffer, weight_vector_action, &feature_weight_distance) > 0)
+			pruned_plan = FeatureComputationPlan::prune (plan, train->SignatureWeights);
+
+	delete [] split.training_images;
+	delete [] split.testing_images;
+	delete train;
+	delete test;
+	return (pruned_plan);
+}
+
+/*
+stream_sigs - computes the features of a stream of raw frames (see ImageMatrix::LoadRawFrame()), and prints them to stdout
+  as tab-delimited rows: the image name (frame<N> if the frame has none), the sample name, then the feature values.
+  The first row has the feature names.  Nothing is written to disk.  Each frame's rows are flushed once they are computed,
+  so the frames can come from a live source through a pipe.
+Returns the number of frames, or -1 if a frame couldn't be read.
+*/
+long stream_sigs (FILE *in_file, featureset_t *featureset) {
+	preproc_opts_t *preproc_opts = &(featureset->preproc_opts);
+	feature_opts_t *feature_opts = &(featureset->feature_opts);
+	int sample_index, res;
+	long frame_index;
+	size_t sig_index;
+
+	const FeatureComputationPlan *plan = feature_opts->plan;
+	if (!plan) plan = StdFeatureComputationPlans::getFeatureSet (feature_opts->large_set, feature_opts->compute_colors);
+
+	printf ("image\tsample");
+	for (sig_index = 0; sig_index < plan->n_features; sig_index++)
+		printf ("\t%s", plan->getFeatureNameByIndex (sig_index).c_str());
+	printf ("\n");
+	fflush (stdout);
+
+	for (frame_index = 0; ; frame_index++) {
+		ImageMatrix image_matrix;
+		rect bounding_rect = preproc_opts->bounding_rect;
+		res = image_matrix.OpenRawFrame (in_file, preproc_opts->downsample, &bounding_rect, (double)preproc_opts->mean, (double)preproc_opts->stddev);
+		if (res == 0) break;
+		if (res < 0) {
+			catError ("Frame %ld of the stream is malformed or incomplete.\n", frame_index);
+			return (-1);
+		}
+		if (!image_matrix.source.length()) {
+			char name[32];
+			sprintf (name, "frame%ld", frame_index);
+			image_matrix.source = name;
+		}
+
+		// The samples are made as in TrainingSet::AddImageFile()
+		ImageSampler sampler (image_matrix, featureset);
+		std::vector<const ImageMatrix *> compute_matrices;
+		std::vector<signatures *> compute_sigs;
+		for (sample_index = 0; sample_index < featureset->n_samples; sample_index++) {
+			compute_sigs.push_back (new signatures ());
+			compute_matrices.push_back (sampler.sample (featureset->samples[sample_index].rot_index,
+				featureset->samples[sample_index].tile_index_x, featureset->samples[sample_index].tile_index_y));
+		}
+		signatures::compute_plan (compute_sigs, compute_matrices, plan, feature_opts->n_threads, feature_opts->profile, feature_opts->cost_model);
+
+		for (sig_index = 0; sig_index < compute_sigs.size(); sig_index++) {
+			printf ("%s\t%s", image_matrix.source.c_str(), featureset->samples[sig_index].sample_name);
+			for (int i = 0; i < compute_sigs[sig_index]->count; i++)
+				printf ("\t" SIG_VALUE_FORMAT, compute_sigs[sig_index]->data[i]);
+			printf ("\n");
+			delete compute_sigs[sig_index];
+		}
+		fflush (stdout);
+		if (verbosity>=2) fprintf (stderr, "Computed the features of frame %ld (%s).\n", frame_index, image_matrix.source.c_str());
+	}
+	return (frame_index);
+}
+
 int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **argv, int class_num, int method, featureset_t *featureset, double split_ratio, int balanced_splits, double max_features, double used_mrmr, long split_num,
 	int report,int max_training_images, int exact_training_images, int max_test_images, char *phylib_path,int distance_method, int phylip_algorithm,int export_tsv,
-	long first_n, char *weight_file_buffer, char weight_vector_action, int N, TrainingSet *testset, int ignore_group, int tile_areas, int max_tile, int image_similarities, int random_splits) {
+	long first_n, char *weight_file_buffer, char weight_vector_action, TrainingSet *testset, int ignore_group, int tile_areas, int max_tile, int image_similarities, int random_splits) {
 	TrainingSet *train,*test,**TilesTrainingSets=NULL;
 	std::vector<data_split> splits;
 	char group_name[64];
@@ -244,20 +450,6 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 	// set samples per image
 	int samples_per_image = featureset->n_samples;
 
-	// Remove classes from the end if N is specified
-	if (N>0) while (ts->class_num>N) ts->RemoveClass(ts->class_num);
-
-// Remove classes with less than max_training_images if exact_training_images is true
-	if (exact_training_images) {
-		class_index=ts->class_num;
-		while( class_index > 0 ) {
-			if( ts->class_nsamples[ class_index ] * samples_per_image <  max_training_images ) {
-				ts->RemoveClass( class_index );
-			}
-			class_index--;
-		}
-	}
-
 	// If a testset was specified, make sure its classes are consistent with ts.
 	if (testset) {
 		testset->train_class = new int[testset->class_num+1];
@@ -297,6 +489,11 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 			catError ("Delete .fit and .sig files generated by older versions of wndchrm and try again.\n");
 		return(showError(1, NULL));
 	}
+	if (testset && testset->plan_hash && ts->plan_hash && testset->plan_hash != ts->plan_hash) {
+		catError ("ERROR: The train set '%s' (plan %08lx) and test set '%s' (plan %08lx) were computed by different feature computation plans.\n",
+			ts->source_path, ts->plan_hash, testset->source_path, testset->plan_hash);
+		return(showError(1, NULL));
+	}
 	if (testset && testset->signature_count != ts->signature_count) {
 		catError ("The feature versions in the train set '%s' (%d.%d) is inconsistent with test set '%s' (%d.%d).\n",
 			ts->source_path,
@@ -345,67 +542,16 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 		}
 		else splits[split_index].tile_area_accuracy=NULL;
 
-		res=ts->split(random_splits,split_ratio,train,test,samples_per_image,n_train,n_test,&(splits[split_index]));
-		if ( res < 0) return (res);
+		res=train_split(ts,train,test,&(splits[split_index]),random_splits,split_ratio,samples_per_image,n_train,n_test,max_features,used_mrmr,
+			tile_areas,&TilesTrainingSets,weight_file_buffer,weight_vector_action,&feature_weight_distance);
+		if (res < 0) return (res);
+		if (res == 0) showError(1,"Could not load weight vector from '%s'\n",weight_file_buffer);
 		if (image_similarities) splits[split_index].image_similarities=new double[(1+test->count/(samples_per_image))*(1+test->count/(samples_per_image))];
 		else splits[split_index].image_similarities=NULL;
 
-		//int temp=train->class_num;
-		//train->class_num=1;
-		if (tile_areas)  // split into several datasets such that each dataset contains tiles of the same location
-		{
-			TilesTrainingSets=new TrainingSet*[samples_per_image];
-			res = train->SplitAreas(samples_per_image, TilesTrainingSets);
-			if (res < 0) return (res);
-			for (tile_index=0;tile_index<samples_per_image;tile_index++)
-			{
-				TilesTrainingSets[tile_index]->normalize();
-				TilesTrainingSets[tile_index]->SetFisherScores(max_features,used_mrmr,NULL);
-			}
-		}
-		else
-		{
-			train->normalize(); // normalize the feature values of the training set
-			train->SetFisherScores(max_features,used_mrmr,&(splits[split_index]));  // compute the Fisher Scores for the image features
-			if( ts->aggregated_feature_stats ) {
-				if( ts->aggregated_feature_stats->empty() ) {
-					featuregroup_stats_t temp;
-					for( i = 0; i < ts->signature_count; i++ ) {
-						temp.name = train->SignatureNames[i];
-						temp.min = train->SignatureWeights[i];
-						temp.max = train->SignatureWeights[i];
-						temp.sum_weight = train->SignatureWeights[i];
-						temp.sum_weight2 = train->SignatureWeights[i] * train->SignatureWeights[i];
-						temp.mean = 0;
-						temp.stddev = 0;
-						temp.n_features = 1;	
-						ts->aggregated_feature_stats->push_back( temp ); // makes a copy
-					}
-				}
-				else
-				{
-					for( i = 0; i < ts->signature_count; i++ ) {
-						if( train->SignatureWeights[i] < (*(ts->aggregated_feature_stats))[i].min )
-							 (*(ts->aggregated_feature_stats))[i].min = train->SignatureWeights[i];
-						if( train->SignatureWeights[i] > (*(ts->aggregated_feature_stats))[i].max )
-							 (*(ts->aggregated_feature_stats))[i].max = train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].sum_weight += train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].sum_weight2 += train->SignatureWeights[i] * train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].n_features++;
-					}
-				}
-			}
-		}
-		//train->class_num=temp;
 		if (weight_vector_action=='w')
 			if(!train->SaveWeightVector(weight_file_buffer))
 				showError(1,"Could not write weight vector to '%s'\n",weight_file_buffer);
-		if (weight_vector_action=='r' || weight_vector_action=='+' || weight_vector_action=='-')
-		{
-			feature_weight_distance=train->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));
-			if (tile_areas) for (tile_index=0;tile_index<samples_per_image;tile_index++) feature_weight_distance=TilesTrainingSets[tile_index]->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));	   
-			if (feature_weight_distance<0) showError(1,"Could not load weight vector from '%s'\n",weight_file_buffer);
-		}
 		if (report) splits[split_index].individual_images=new char[(int)((test->count/(samples_per_image))*(class_num*15))];
 		else splits[split_index].individual_images=NULL;
 		if (ignore_group)   /* assign to zero all features of the group */
@@ -592,7 +738,8 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 void ShowHelp()
 {
 	printf("\n"PACKAGE_STRING".  Laboratory of Genetics/NIA/NIH \n");
-	printf("usage: \n======\nwndchrm [ train | test | classify ] [-mtslcdowfrijnpqvNSBACDTh] [<dataset>|<train set>] [<test set>|<feature file>] [<report_file>]\n");
+	printf("usage: \n======\nwndchrm [ train | test | classify ] [-mtslcdowfrijnpqvMNSBACDTXFVKLh] [<dataset>|<train set>] [<test set>|<feature file>] [<report_file>]\n");
+	printf("       wndchrm stream [-tslcdRMSBXF] [<raw stream>]\n");
 	printf("  <dataset> is a <root directory>, <feature file>, <file of filenames>, <image directory> or <image filename>\n");
 	printf("  <root directory> is a directory of sub-directories containing class images with one class per sub-directory.\n");
 	printf("      The sub-directory names will be used as the class labels. Currently supported file formats: TIFF, PPM. \n");
@@ -607,6 +754,11 @@ void ShowHelp()
 	printf("  <test set> is anything that qualifies as a <dataset>.  The <train set> will be used to classify the <test set>.\n");
 	printf("      This parameter is required for 'classify' and is optional for 'test' (when doing internal tests of the <train set>\n");
 	printf("  <report_file> is a report of the test/classify results in html format (must end in .htm or .html).\n");
+	printf("  <raw stream> is a file or named pipe of raw frames for the 'stream' command, which reads stdin if it isn't given (or is '-').\n");
+	printf("      Each frame is a 'WNDRAW <width> <height> <bits> <channels> [<name>]' line followed by the pixels: 8 or 16-bit samples\n");
+	printf("      in the machine's byte order, rows from the top, with the 3 channels of RGB pixels together.\n");
+	printf("      The features of each frame are written to stdout as tab-delimited rows (name, sample, features) after a row of\n");
+	printf("      feature names.  No files are written.\n");
 	
 	printf("\nImage sampling options (require re-computing features):\n========================================================\n");
 	printf("m - Allow running multiple instances of this program concurrently, save (and re-use) pre-calculated .sig files.\n");
@@ -618,8 +770,15 @@ void ShowHelp()
 	printf("    If only C is specified (e.g. -t2), tiling will be CxC (e.g. 2 columns by 2 rows). \n");
 	printf("      - If both C and R are specified (e.g. -t2x3), tiling will be CxR (e.g. 2 columns by 3 rows). \n");
 	printf("dN - Downsample the images (N percents, where N is 1 to 100)\n");
+	printf("    Pyramid TIFFs are downsampled from their smallest stored resolution that is larger than the result.\n");
 	printf("Sx[:y] - normalize the images such that the mean is set to x and (optinally) the stddev is set to y.\n");   
 	printf("Bx,y,w,h - compute features only from the (x,y,w,h) block of the image.\n");      
+	printf("Kpath - cache the decoded images in the directory 'path' as memory-mapped .planes files.\n");
+	printf("    Images decoded in earlier runs are mapped from there instead of being decoded again, and their pixels are\n");
+	printf("    read from disk only as they are used.  The directory should not be inside the dataset.\n");
+	printf("    .planes files can also be used as images.\n");
+	printf("Each page of a multi-page TIFF (z-stack, time series, channels) is a separate image, with sigs named <file>.tif[N]...\n");
+	printf("    A single page can be listed in a file of filenames as <file>.tif[N] (pages are counted from 0).\n");
 	
 	printf("\nImage Feature options:\n======================\n");
 	printf("l - Use a large image feature set.\n");
@@ -627,6 +786,20 @@ void ShowHelp()
 	printf("o - force overwriting pre-computed .sig files.\n");   
 	printf("O - if there are pre-computed .sig files accompanying images that have the old-style naming pattern,\n" );
 	printf("    skip the check to see that they were calculated with the same wndchrm parameters as the current experiment.\n");   
+	printf("M[N] - compute the features of each image using N threads. The default N is the number of processors.\n");
+	printf("    Transforms and feature groups on the longest paths are started first, using the times measured for previous images.\n");
+	printf("    Images with at least N tiles and rotations compute one tile or rotation per thread instead.\n");
+	printf("    The strips or tiles of TIFF images are also decoded using N threads.\n");
+	printf("L[N] - open and decode the next images on N background threads (default 2) while the features of an image are computed.\n");
+	printf("    Images whose .sig files all exist are skipped.\n");
+	printf("X[path] - profile the feature computation, and print the most expensive transforms and feature groups.\n");
+	printf("    If a path is given, the times and memory used by every transform and feature group are saved to it\n");
+	printf("    as JSON if it ends in .json, or as tab-delimited text otherwise.\n");
+	printf("V - also recompute the features of samples read from .sig files, and report how far they drift from the saved values.\n");
+	printf("    Use this to validate a build configured with --enable-float-pixels against .sig files computed with double pixels.\n");
+	printf("F[r|w]path - read the feature computation plan from a file, or write the standard plan selected by -l and -c to it.\n");
+	printf("    The file lists one feature group per line, e.g. 'Haralick Textures (Fourier (Wavelet ()))'.\n");
+	printf("    Lines beginning with '#' are ignored.  A plan that is read replaces the one selected by -l and -c.\n");
 	
 	printf("\nFeature reduction options:\n==========================\n");
 	printf("fN[:M] - maximum number of features out of the dataset (0,1) . The default is 0.15. \n");
@@ -688,6 +861,8 @@ void ShowHelp()
 	printf("       Unlike 'test', 'classify' will chose the training images in order rather than randomly.\n");
 	printf("       classify will ignore the -n parameter because the result will be the same for each run or split.\n");
 	printf("       The default -r for 'classify' is 1.0 rather than the 0.75 used in 'test'.\n");
+	printf("       classify only computes the features of <test set> images that have non-zero weights, and does not save them in .sig files.\n");
+	printf("       All features are computed and saved if -T is used.\n");
 	printf("\nAdditional help:\n================\n");
 	printf("A detailed description can be found in: Shamir, L., Orlov, N., Eckley, D.M., Macura, T., Johnston, J., Goldberg, I.\n");
 	printf("  [1] \"Wndchrm - an open source utility for biological image analysis\", BMC Source Code for Biology and Medicine, 3:13, 2008.\n");   
@@ -716,6 +891,7 @@ int main(int argc, char *argv[])
     int train=0;
     int test=0;
     int classify=0;
+    int stream=0;
     char phylib_path_buffer[256];
     char *phylib_path=NULL;
     char report_file_buffer[256];
@@ -740,9 +916,22 @@ int main(int argc, char *argv[])
 	int do_continuous=0;
 	int save_sigs=1;
 	int skip_sig_check = 0;
+	ComputationPlanProfile *profile=NULL;   /* per-node profile of feature computation             */
+	int report_profile=0;            /* report the profile (-X)                                    */
+	char *profile_path=NULL;         /* path to save the profile report                           */
+	FeatureDriftReport *drift=NULL;  /* drift of recomputed features from the saved .sig files (-V) */
+	ComputationCostModel *cost_model=NULL;  /* for scheduling multi-threaded feature computation   */
+	char plan_action='\0';          /* read or write the feature computation plan (-F)            */
+	char *plan_path=NULL;            /* path of the feature computation plan file                  */
+	const FeatureComputationPlan *file_plan=NULL;  /* plan read from plan_path                    */
 
 	assert (ComputationTaskInstances::initialized() && "Failed to initialize computation tasks");
 
+	// The planes and scratch buffers of the images and their transforms are recycled here instead of going back to the heap.
+	// The executors' threads use it too.
+	PlaneArena plane_arena;
+	PlaneArena::set_current (&plane_arena);
+
 	featureset_t featureset;         /* for recording the sampling params for images               */
 	memset (&featureset,0,sizeof(featureset));
 	preproc_opts_t *preproc_opts = &(featureset.preproc_opts);
@@ -760,6 +949,7 @@ int main(int argc, char *argv[])
 	strcpy (preproc_opts->normalize_base,"S");
 	preproc_opts->mean = -1;                      /* normalize all image to a sepcified mean                    */
 	preproc_opts->stddev = -1;                  /* normalize all image to a sepcified standard deviation      */
+	preproc_opts->n_load_threads = 0;           /* threads opening the next images in the background          */
 
 	strcpy (sampling_opts->rot_base,"R");
 	sampling_opts->rotations = 1;
@@ -771,6 +961,12 @@ int main(int argc, char *argv[])
 	feature_opts->compute_colors = 0;
 	strcpy (feature_opts->large_set_base,"l");
 	feature_opts->large_set = 0;
+	feature_opts->n_threads = 1;
+	strcpy (feature_opts->plan_base,"F");
+	feature_opts->plan = NULL;
+	feature_opts->profile = NULL;
+	feature_opts->cost_model = NULL;
+	feature_opts->drift = NULL;
 
 
     /* read parameters */
@@ -790,15 +986,19 @@ int main(int argc, char *argv[])
     	split_ratio = 1.0;
     	random_splits = 0; // use order in the input file
     }
-	if (!train && !test && !classify) {
+    if (strcmp(argv[arg_index],"stream")==0) {
+    	stream=1;
+    	verbosity = 0; // stdout is for the features (-s can still set it)
+    }
+	if (!train && !test && !classify && !stream) {
 		ShowHelp();
-		showError(1,"Either 'train', 'test' or 'classify' must be specified.\n");
+		showError(1,"Either 'train', 'test', 'classify' or 'stream' must be specified.\n");
 		return(1);
 	}
     arg_index++;
 
 	/* read the switches */
-    while (argv[arg_index][0]=='-')
+    while (arg_index<argc && argv[arg_index][0]=='-' && argv[arg_index][1]) // a lone '-' is stdin for stream
     {   char *p,arg[32];
 	    if (argv[arg_index][1]=='p')
         {  report=1;
@@ -813,6 +1013,14 @@ int main(int argc, char *argv[])
 		   arg_index++;
 		   continue;	/* so that the path will not trigger other switches */
         }
+		if (argv[arg_index][1]=='F') {
+			plan_action = argv[arg_index][2];
+			if ((plan_action!='r' && plan_action!='w') || !argv[arg_index][3])
+				showError(1,"-F must be followed with either 'r' (read) or 'w' (write) and a path\n");
+			plan_path = argv[arg_index]+3;
+			arg_index++;
+			continue;	/* so that the path will not trigger other switches */
+		}
         if (strchr(argv[arg_index],'P')) distance_method=atoi(&(strchr(argv[arg_index],'P')[1]));
 		if (argv[arg_index][1]=='v' && strlen(argv[arg_index])>3)
 		{  weight_vector_action=argv[arg_index][2];
@@ -832,6 +1040,20 @@ int main(int argc, char *argv[])
 	    	arg_index++;
 			continue;	/* so that the path will not trigger other switches */
 		}
+		if (argv[arg_index][1]=='K') {
+			if (!argv[arg_index][2]) showError(1,"-K must be followed by the path to a directory for caching decoded images\n");
+			if (mkdir (argv[arg_index]+2, 0777) != 0 && errno != EEXIST)
+				showError(1,"Could not make the directory '%s' for caching decoded images: %s\n", argv[arg_index]+2, strerror(errno));
+			ImageMatrix::SetPlaneCacheDir (argv[arg_index]+2);
+	    	arg_index++;
+			continue;	/* so that the path will not trigger other switches */
+		}
+		if (argv[arg_index][1]=='X') {
+			report_profile = 1;
+			if (argv[arg_index][2]) profile_path = argv[arg_index]+2;
+	    	arg_index++;
+			continue;	/* so that the path will not trigger other switches */
+		}
         /* a block for computing features */
         if ( (char_p = strchr(argv[arg_index],'B'))  && isdigit (*(char_p+1)) ) {
 			strcpy(arg,char_p+1);
@@ -855,6 +1077,14 @@ int main(int argc, char *argv[])
 		   preproc_opts->mean=atoi(&(strchr(arg,'S')[1]));   /* mean */
         }
 	    if (strchr(argv[arg_index],'m')) multi_processor=1;
+        if ( (char_p = strchr(argv[arg_index],'M')) ) {
+			if (isdigit (*(char_p+1))) feature_opts->n_threads = atoi (char_p+1);
+			else feature_opts->n_threads = FeatureComputationPlanConcurrentExecutor::default_threads();
+		}
+        if ( (char_p = strchr(argv[arg_index],'L')) ) {
+			if (isdigit (*(char_p+1))) preproc_opts->n_load_threads = atoi (char_p+1);
+			else preproc_opts->n_load_threads = 2;
+		}
         if (strchr(argv[arg_index],'n')) splits_num=atoi(&(strchr(argv[arg_index],'n')[1]));
         if( (char_p = strchr( argv[arg_index],'s') ) ) {
 			if( isdigit( *(char_p+1) ) ) {
@@ -865,6 +1095,10 @@ int main(int argc, char *argv[])
 		}
         if (strchr(argv[arg_index],'o')) overwrite=1;
         if (strchr(argv[arg_index],'O')) skip_sig_check=1;
+        if (strchr(argv[arg_index],'V') && !drift) {
+			drift = new FeatureDriftReport;
+			feature_opts->drift = drift;
+		}
         if (strchr(argv[arg_index],'l')) feature_opts->large_set=1;
         if (strchr(argv[arg_index],'c')) feature_opts->compute_colors=1;
         if (strchr(argv[arg_index],'C')) do_continuous=1;
@@ -933,15 +1167,56 @@ int main(int argc, char *argv[])
 	if (test && report && arg_index==argc-1) showError(1,"a report html file must be specified");
 	if (sampling_opts->tiles_x<=0 || sampling_opts->tiles_y <=0) showError(1,"number of tiles (t) must be an integer greater than 0");
 	if (preproc_opts->downsample<1 || preproc_opts->downsample>100) showError(1,"downsample size (d) must be an integer between 1 to 100");
+	if (feature_opts->n_threads<1) showError(1,"number of threads (M) must be an integer greater than 0");
+	if (preproc_opts->n_load_threads<0) showError(1,"number of loading threads (L) must be an integer of 0 or more");
 	if (split_ratio<0 || split_ratio>1) showError(1,"training fraction (r) must be > 0 and < 1");
 	if (splits_num<1 || splits_num>MAX_SPLITS) showError(1,"splits num out of range");
 	if (weight_vector_action!='\0' && weight_vector_action!='r' && weight_vector_action!='w' && weight_vector_action!='-' && weight_vector_action!='+') showError(1,"-v must be followed with either 'w' (write) or 'r' (read) ");
 	if (distance_method < 1 || distance_method > 5) showError(1,"Unrecognized distance method %d.  Must be between 1 and 5.",distance_method);
 
+	// Multi-threaded feature computation is scheduled using the costs profiled for the images processed so far.
+	if (report_profile || feature_opts->n_threads > 1) {
+		profile = new ComputationPlanProfile;
+		feature_opts->profile = profile;
+	}
+	if (feature_opts->n_threads > 1) {
+		cost_model = new ComputationCostModel;
+		feature_opts->cost_model = cost_model;
+	}
+	ImageMatrix::SetDecodeThreads (feature_opts->n_threads);
+
+	// A plan read from a file replaces the standard plan selected by -l and -c.
+	if (plan_action=='r') {
+		file_plan = StdFeatureComputationPlans::getFeatureSetFromFile (plan_path);
+		if (!file_plan) showError(1,"Could not read the feature computation plan '%s'\n",plan_path);
+		feature_opts->plan = file_plan;
+	} else if (plan_action=='w') {
+		std::ofstream plan_file (plan_path);
+		if (!plan_file) showError (1,"Couldn't open '%s' for writing\n",plan_path);
+		StdFeatureComputationPlans::getFeatureSet (feature_opts->large_set, feature_opts->compute_colors)->write (plan_file);
+		if (verbosity>=2) printf ("Saved feature computation plan to '%s'.\n",plan_path);
+	}
+
 	 /* run */
 	randomize();   /* random numbers are used for selecting random samples for testing and training */
 	setup_featureset (&featureset);
-	if (arg_index<argc) {
+	if (stream) {
+		FILE *in_file = stdin;
+		const char *in_path = "stdin";
+		long res;
+		// the input can be a file or a named pipe, or stdin if it isn't given (or is '-')
+		if (arg_index<argc && strcmp (argv[arg_index],"-")) {
+			in_path = argv[arg_index];
+			if (!(in_file=fopen(in_path,"rb"))) showError (1,"Couldn't open '%s' for reading\n",in_path);
+		}
+		res = stream_sigs (in_file, &featureset);
+		if (in_file != stdin) fclose (in_file);
+		if (res < 0) showError (1,"Errors reading from '%s'\n",in_path);
+		if (verbosity>=2) fprintf (stderr,"Computed the features of %ld frames.\n",res);
+
+		// report any warnings
+		showError (0,NULL);
+	} else if (arg_index<argc) {
 		int res;
 		dataset_path=argv[arg_index++];
 		TrainingSet *dataset=new TrainingSet(MAX_SAMPLES,MAX_CLASS_NUM);
@@ -969,6 +1244,7 @@ int main(int argc, char *argv[])
        } else if (test || classify) {
 			int ignore_group=0;
 			TrainingSet *testset=NULL;
+			FeatureComputationPlan *pruned_plan=NULL;
 		// Make sure we can write to the dataset output file if we got one before calculating anything.
 			FILE *out_file;
 			if (dataset_save_fit && !(out_file=fopen(dataset_save_fit,"a"))) {// don't truncate if exists.
@@ -991,6 +1267,8 @@ int main(int argc, char *argv[])
 				if (res < 1) showError (1,"Could not save dataset to '%s'.\n",dataset_save_fit);
 				if (verbosity>=2) printf ("Saved dataset to '%s'.\n",dataset_save_fit);
 			}
+			// Done once before anything is trained on the dataset (prune_classify_plan() and split_and_test())
+			remove_classes (dataset, N, exact_training_images, max_training_images, featureset.n_samples);
 
 			/* check if there is a report file name */
 			if (arg_index<argc) {
@@ -1007,8 +1285,16 @@ int main(int argc, char *argv[])
 				} else if (testset_save_fit) fclose (out_file);
 				if (verbosity>=2) printf ("Processing test set '%s'.\n",testset_path);
 				testset=new TrainingSet(MAX_SAMPLES,MAX_CLASS_NUM);
+				// Only compute the features that will be used to classify the test set.
+				// Not done when the test set features are saved, or when features with zero weights are still used.
+				if (classify && !testset_save_fit && !tile_areas && !assess_features && used_mrmr <= 0) {
+					pruned_plan = prune_classify_plan (dataset, testset, &featureset, split_ratio, balanced_splits, max_features,
+						max_training_images, exact_training_images, weight_file_buffer, weight_vector_action);
+				}
+				if (pruned_plan) feature_opts->plan = pruned_plan;
 				res=testset->LoadFromPath(testset_path, save_sigs, &featureset, do_continuous, skip_sig_check);
 				if (res < 1) showError(1,"Errors reading from '%s'\n",testset_path);
+				feature_opts->plan = file_plan;
 				if (testset_save_fit) {
 					res = testset->SaveToFile (testset_save_fit);
 					if (res < 1) showError (1,"Could not save testset to '%s'.\n",testset_save_fit);
@@ -1041,9 +1327,10 @@ int main(int argc, char *argv[])
 
 			for (ignore_group=0;ignore_group<=assess_features;ignore_group++) {
 				split_and_test(dataset, report_file, argc, argv, MAX_CLASS_NUM, method, &featureset, split_ratio, balanced_splits, max_features, used_mrmr,splits_num,report,max_training_images,
-					exact_training_images,max_test_images,phylib_path,distance_method,phylip_algorithm,export_tsv,first_n,weight_file_buffer,weight_vector_action,N,
+					exact_training_images,max_test_images,phylib_path,distance_method,phylip_algorithm,export_tsv,first_n,weight_file_buffer,weight_vector_action,
 					testset,ignore_group,tile_areas,max_tile,image_similarities, random_splits);
 			}
+			if (pruned_plan) delete pruned_plan;
 	
 			// report any warnings
 			showError (0,NULL);
@@ -1054,6 +1341,23 @@ int main(int argc, char *argv[])
      } // no params left for dataset / test set.
      else ShowHelp();
 
+	if (report_profile) {
+		if (verbosity>=1) profile->print_summary (std::cout, 20);
+		if (profile_path) {
+			std::ofstream profile_file (profile_path);
+			if (!profile_file) showError (1,"Couldn't open '%s' for writing\n",profile_path);
+			if (strstr (profile_path,".json")) profile->write_json (profile_file);
+			else profile->write_tsv (profile_file);
+			if (verbosity>=2) printf ("Saved profile to '%s'.\n",profile_path);
+		}
+	}
+	if (drift) {
+		if (verbosity>=1) drift->print_summary (std::cout, verbosity>=2 ? 0 : 20);
+		delete drift;
+	}
+	if (profile) delete profile;
+	if (cost_model) delete cost_model;
+
      return(1);
 }
 